@@ -0,0 +1,421 @@
+// wg-tcp-tunnel - capture.cpp
+// SPDX-FileCopyrightText: 2023-2025 Arkadiusz Bokowy and contributors
+// SPDX-License-Identifier: MIT
+
+#include "capture.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if !defined(_WIN32)
+#	include <netinet/in.h>
+#	include <sys/socket.h>
+#endif
+
+#include <boost/asio.hpp>
+#include <boost/system/error_code.hpp>
+#include <boost/system/system_error.hpp>
+
+#include "queue.h"
+#include "utils.hpp"
+#include "version.h"
+
+namespace wg::tunnel::capture {
+
+#if !defined(_WIN32)
+
+namespace {
+
+// Socket address big enough for both address families, copied as is from
+// the endpoint, so the data path does not have to convert anything
+using address = sockaddr_in6;
+
+struct entry {
+	point where;
+	uint16_t length;
+	uint16_t caplen;
+	address src;
+	address dst;
+	// Time of the pipeline stages in nanoseconds of the steady clock
+	int64_t received;
+	int64_t dequeued;
+	int64_t sent;
+};
+
+// Ring of the records written by one thread. Every slot is guarded by the
+// sequence number which is odd while the slot is being written, so the dump
+// can read slots without stopping the writer, torn copies are discarded.
+class ring {
+public:
+	ring(size_t records, size_t snaplen)
+	    : m_slots(std::make_unique<slot[]>(records)),
+	      m_data(std::make_unique<char[]>(records * snaplen)), m_records(records),
+	      m_snaplen(snaplen) {}
+
+	// Overwrite the oldest record, must be called by the owner thread only
+	auto push(const entry & r, const void * data) -> void {
+		const auto index = m_head++ % m_records;
+		auto & s = m_slots[index];
+		const auto seq = s.seq.load(std::memory_order_relaxed);
+		s.seq.store(seq + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		s.r = r;
+		std::memcpy(&m_data[index * m_snaplen], data, r.caplen);
+		s.seq.store(seq + 2, std::memory_order_release);
+	}
+
+	// Copy consistent records with their data
+	auto read(std::vector<entry> & records, std::vector<std::vector<char>> & data) const
+	    -> void {
+		std::vector<char> buffer(m_snaplen);
+		for (size_t i = 0; i < m_records; i++) {
+			const auto & s = m_slots[i];
+			const auto seq = s.seq.load(std::memory_order_acquire);
+			if (seq == 0 || seq % 2 != 0)
+				continue;
+			const auto r = s.r;
+			const auto caplen = std::min<size_t>(r.caplen, m_snaplen);
+			std::memcpy(buffer.data(), &m_data[i * m_snaplen], caplen);
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (s.seq.load(std::memory_order_relaxed) != seq)
+				continue;
+			records.push_back(r);
+			data.emplace_back(buffer.begin(), buffer.begin() + caplen);
+		}
+	}
+
+	[[nodiscard]] auto snaplen() const -> size_t { return m_snaplen; }
+
+private:
+	struct slot {
+		std::atomic<uint64_t> seq{ 0 };
+		entry r;
+	};
+
+	std::unique_ptr<slot[]> m_slots;
+	std::unique_ptr<char[]> m_data;
+	size_t m_records;
+	size_t m_snaplen;
+	size_t m_head = 0;
+};
+
+// Rings of all threads, registered when the thread is attached
+struct shared_state {
+	std::mutex mutex;
+	std::vector<std::shared_ptr<ring>> rings;
+	size_t records = 0;
+	size_t snaplen = 0;
+};
+
+auto state() -> shared_state & {
+	static shared_state s;
+	return s;
+}
+
+thread_local std::shared_ptr<ring> t_ring;
+
+auto ns(clock::time_point time) -> int64_t {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+}
+
+auto copy(address & addr, const asio::ip::udp::endpoint & ep) -> void {
+	std::memcpy(&addr, ep.data(), std::min<size_t>(ep.size(), sizeof(addr)));
+}
+
+// Writer of the pcapng blocks, integers are written in the host byte order,
+// which is announced by the section header block
+class pcapng {
+public:
+	// Link type of the raw IPv4 or IPv6 packets
+	static constexpr uint16_t linktype_raw = 101;
+
+	explicit pcapng(const std::string & path) : m_file(path, std::ios::binary | std::ios::trunc) {
+		if (!m_file)
+			throw std::runtime_error("Couldn't open file: " + path);
+	}
+
+	auto section(const std::string & application) -> void {
+		begin(0x0A0D0D0A);
+		put<uint32_t>(0x1A2B3C4D);
+		put<uint16_t>(1);
+		put<uint16_t>(0);
+		put<int64_t>(-1);
+		option(4, application); // shb_userappl
+		end();
+	}
+
+	auto interface(const std::string & name, uint32_t snaplen) -> void {
+		begin(1);
+		put<uint16_t>(linktype_raw);
+		put<uint16_t>(0);
+		put<uint32_t>(snaplen);
+		option(2, name); // if_name
+		option(9, std::string(1, 9)); // if_tsresol: nanoseconds
+		end();
+	}
+
+	auto enhanced_packet(uint32_t interface, uint64_t time, uint32_t length,
+	                     const std::string & data, uint32_t flags, const std::string & comment)
+	    -> void {
+		begin(6);
+		put<uint32_t>(interface);
+		put<uint32_t>(static_cast<uint32_t>(time >> 32));
+		put<uint32_t>(static_cast<uint32_t>(time));
+		put<uint32_t>(static_cast<uint32_t>(data.size()));
+		put<uint32_t>(length);
+		padded(data);
+		// epb_flags: inbound or outbound direction
+		option(2, std::string(reinterpret_cast<const char *>(&flags), sizeof(flags)));
+		option(1, comment); // opt_comment
+		end();
+	}
+
+	auto close() -> void {
+		m_file.close();
+		if (!m_file)
+			throw std::runtime_error("Couldn't write file");
+	}
+
+private:
+	template <typename T> auto put(T value) -> void {
+		m_block.append(reinterpret_cast<const char *>(&value), sizeof(value));
+	}
+	auto padded(const std::string & data) -> void {
+		m_block += data;
+		m_block.append((4 - data.size() % 4) % 4, '\0');
+	}
+	auto option(uint16_t code, const std::string & value) -> void {
+		put<uint16_t>(code);
+		put<uint16_t>(static_cast<uint16_t>(value.size()));
+		padded(value);
+	}
+
+	auto begin(uint32_t type) -> void {
+		m_block.clear();
+		put<uint32_t>(type);
+		put<uint32_t>(0);
+	}
+	auto end() -> void {
+		// End of options, followed by the total block length
+		put<uint32_t>(0);
+		const auto length = static_cast<uint32_t>(m_block.size() + sizeof(uint32_t));
+		std::memcpy(&m_block[sizeof(uint32_t)], &length, sizeof(length));
+		put<uint32_t>(length);
+		m_file.write(m_block.data(), static_cast<std::streamsize>(m_block.size()));
+	}
+
+	std::ofstream m_file;
+	std::string m_block;
+};
+
+// IPv4 header checksum
+auto checksum(const uint8_t * data, size_t length) -> uint16_t {
+	uint32_t sum = 0;
+	for (size_t i = 0; i + 1 < length; i += 2)
+		sum += (data[i] << 8) | data[i + 1];
+	while (sum >> 16)
+		sum = (sum & 0xFFFF) + (sum >> 16);
+	return static_cast<uint16_t>(~sum);
+}
+
+auto put16(uint8_t * data, uint16_t value) -> void {
+	data[0] = static_cast<uint8_t>(value >> 8);
+	data[1] = static_cast<uint8_t>(value);
+}
+
+// Address as IPv6, IPv4 addresses are mapped
+auto to_v6(const address & addr) -> std::array<uint8_t, 16> {
+	if (addr.sin6_family == AF_INET6) {
+		std::array<uint8_t, 16> bytes;
+		std::memcpy(bytes.data(), &addr.sin6_addr, bytes.size());
+		return bytes;
+	}
+	sockaddr_in v4;
+	std::memcpy(&v4, &addr, sizeof(v4));
+	std::array<uint8_t, 16> bytes = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF };
+	std::memcpy(&bytes[12], &v4.sin_addr, 4);
+	return bytes;
+}
+
+// Prepend the IP and UDP headers, so the datagram is decoded by the tools
+// which know nothing about the tunnel, e.g. the WireGuard dissector
+auto encapsulate(const entry & r, const std::vector<char> & data, uint32_t & length)
+    -> std::string {
+	const bool v4 = r.src.sin6_family == AF_INET && r.dst.sin6_family == AF_INET;
+	std::array<uint8_t, 48> header = {};
+	auto * ip = header.data();
+	size_t size = v4 ? 20 : 40;
+	const auto udp_length = static_cast<uint16_t>(8 + r.length);
+	if (v4) {
+		sockaddr_in src;
+		sockaddr_in dst;
+		std::memcpy(&src, &r.src, sizeof(src));
+		std::memcpy(&dst, &r.dst, sizeof(dst));
+		ip[0] = 0x45;
+		put16(&ip[2], static_cast<uint16_t>(size + udp_length));
+		ip[6] = 0x40; // Don't fragment
+		ip[8] = 64;
+		ip[9] = IPPROTO_UDP;
+		std::memcpy(&ip[12], &src.sin_addr, 4);
+		std::memcpy(&ip[16], &dst.sin_addr, 4);
+		put16(&ip[10], checksum(ip, size));
+	} else {
+		ip[0] = 0x60;
+		put16(&ip[4], udp_length);
+		ip[6] = IPPROTO_UDP;
+		ip[7] = 64;
+		const auto src = to_v6(r.src);
+		const auto dst = to_v6(r.dst);
+		std::memcpy(&ip[8], src.data(), src.size());
+		std::memcpy(&ip[24], dst.data(), dst.size());
+	}
+	// Ports are stored in the network byte order in both families
+	auto * udp = ip + size;
+	std::memcpy(&udp[0], &r.src.sin6_port, 2);
+	std::memcpy(&udp[2], &r.dst.sin6_port, 2);
+	put16(&udp[4], udp_length);
+	size += 8;
+	length = static_cast<uint32_t>(size + r.length);
+	std::string frame(reinterpret_cast<const char *>(header.data()), size);
+	frame.append(data.begin(), data.end());
+	return frame;
+}
+
+}; // namespace
+
+auto configure(size_t records, size_t snaplen) -> void {
+	auto & s = state();
+	std::lock_guard lock(s.mutex);
+	s.records = records;
+	s.snaplen = std::min(snaplen, packet::payload_size_max);
+	enabled = records > 0;
+}
+
+auto attach() -> void {
+	auto & s = state();
+	std::lock_guard lock(s.mutex);
+	if (s.records == 0 || t_ring)
+		return;
+	t_ring = std::make_shared<ring>(s.records, s.snaplen);
+	s.rings.push_back(t_ring);
+}
+
+auto append(point where, asio::const_buffer data, const asio::ip::udp::endpoint & src,
+            const asio::ip::udp::endpoint & dst, clock::time_point received,
+            clock::time_point dequeued) -> void {
+	if (!t_ring)
+		return;
+	entry r;
+	r.where = where;
+	r.length = static_cast<uint16_t>(data.size());
+	r.caplen = static_cast<uint16_t>(std::min(data.size(), t_ring->snaplen()));
+	copy(r.src, src);
+	copy(r.dst, dst);
+	r.received = ns(received);
+	r.dequeued = ns(dequeued);
+	r.sent = ns(clock::now());
+	t_ring->push(r, data.data());
+}
+
+auto append(point where, const std::vector<packet> & batch, const asio::ip::udp::endpoint & src,
+            const asio::ip::udp::endpoint & dst, clock::time_point dequeued) -> void {
+	for (const auto & pkt : batch) {
+		auto data = pkt.data();
+		if (pkt.offset == 0) {
+			// Skip the framing header, and the control frames as well as data
+			// which is not framed at the packet boundary, e.g. after the handoff
+			utils::ip::udp::header header(0, 0, 0);
+			if (pkt.length < sizeof(header))
+				continue;
+			std::memcpy(&header, pkt.buffer.data(), sizeof(header));
+			if (!header.valid() || header.m_length == 0 ||
+			    header.m_length != pkt.length - sizeof(header))
+				continue;
+			data += sizeof(header);
+		}
+		append(where, data, src, dst, pkt.timestamp, dequeued);
+	}
+}
+
+auto dump(const std::string & path) -> size_t {
+
+	std::vector<std::shared_ptr<ring>> rings;
+	size_t snaplen = 0;
+	{
+		auto & s = state();
+		std::lock_guard lock(s.mutex);
+		rings = s.rings;
+		snaplen = s.snaplen;
+	}
+
+	std::vector<entry> records;
+	std::vector<std::vector<char>> data;
+	for (const auto & r : rings)
+		r->read(records, data);
+
+	std::vector<size_t> order(records.size());
+	for (size_t i = 0; i < order.size(); i++)
+		order[i] = i;
+	std::sort(order.begin(), order.end(),
+	          [&records](auto a, auto b) { return records[a].sent < records[b].sent; });
+
+	// Records are stamped with the steady clock, which has to be converted to
+	// the wall clock time expected by the capture tools
+	const auto offset = ns(clock::now()) -
+	                    std::chrono::duration_cast<std::chrono::nanoseconds>(
+	                        std::chrono::system_clock::now().time_since_epoch())
+	                        .count();
+
+	pcapng file(path);
+	file.section(PROJECT_NAME);
+	// One interface for every capture point, the IP and UDP headers included
+	for (const auto name : { "udp2tcp-tx", "udp2tcp-rx", "tcp2udp-tx", "tcp2udp-rx" })
+		file.interface(name, static_cast<uint32_t>(snaplen + 48));
+	for (const auto i : order) {
+		const auto & r = records[i];
+		uint32_t length = 0;
+		const auto frame = encapsulate(r, data[i], length);
+		// Direction from the perspective of the tunnel: inbound or outbound
+		const bool tx = r.where == point::udp2tcp_tx || r.where == point::tcp2udp_tx;
+		const auto comment = "queue=" + std::to_string(r.dequeued - r.received) +
+		                     "ns send=" + std::to_string(r.sent - r.dequeued) + "ns";
+		file.enhanced_packet(static_cast<uint32_t>(r.where),
+		                     static_cast<uint64_t>(r.sent - offset), length, frame, tx ? 2 : 1,
+		                     comment);
+	}
+	file.close();
+
+	return records.size();
+}
+
+#else
+
+auto configure(size_t, size_t) -> void {}
+
+auto attach() -> void {}
+
+auto append(point, asio::const_buffer, const asio::ip::udp::endpoint &,
+            const asio::ip::udp::endpoint &, clock::time_point, clock::time_point) -> void {}
+
+auto append(point, const std::vector<packet> &, const asio::ip::udp::endpoint &,
+            const asio::ip::udp::endpoint &, clock::time_point) -> void {}
+
+auto dump(const std::string &) -> size_t {
+	throw boost::system::system_error(
+	    boost::system::errc::make_error_code(boost::system::errc::operation_not_supported),
+	    "capture dump");
+}
+
+#endif
+
+}; // namespace wg::tunnel::capture
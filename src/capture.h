@@ -0,0 +1,70 @@
+// wg-tcp-tunnel - capture.h
+// SPDX-FileCopyrightText: 2023-2025 Arkadiusz Bokowy and contributors
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include "queue.h"
+
+namespace wg::tunnel::capture {
+
+namespace asio = boost::asio;
+using std::size_t;
+using clock = std::chrono::steady_clock;
+
+// Point of the pipeline at which the datagram was captured
+enum class point : uint8_t {
+	// Datagram from the local WireGuard written to the tunnel by the client
+	udp2tcp_tx = 0,
+	// Datagram from the tunnel sent to the local WireGuard by the client
+	udp2tcp_rx,
+	// Datagram from the WireGuard endpoint written to the tunnel by the server
+	tcp2udp_tx,
+	// Datagram from the tunnel sent to the WireGuard endpoint by the server
+	tcp2udp_rx,
+};
+
+// Whether the capture is enabled, checked by the data path before doing
+// anything else, so the disabled capture costs a single load
+inline std::atomic<bool> enabled{ false };
+
+[[nodiscard]] inline auto active() -> bool { return enabled.load(std::memory_order_relaxed); }
+// Time of the pipeline stage, not taken when the capture is disabled
+[[nodiscard]] inline auto stamp() -> clock::time_point {
+	return active() ? clock::now() : clock::time_point();
+}
+
+// Enable the capture with the given number of records kept by every thread
+// and the number of datagram bytes copied to every record
+auto configure(size_t records, size_t snaplen) -> void;
+// Preallocate the ring of the calling thread, datagrams passing through
+// threads without the ring are not captured
+auto attach() -> void;
+
+// Copy the datagram to the ring of the calling thread, the record is stamped
+// with the time of sending, so it shall be called right after the send
+auto append(point where, asio::const_buffer data, const asio::ip::udp::endpoint & src,
+            const asio::ip::udp::endpoint & dst, clock::time_point received,
+            clock::time_point dequeued) -> void;
+// Copy datagrams of the written batch, skipping the control frames
+auto append(point where, const std::vector<packet> & batch, const asio::ip::udp::endpoint & src,
+            const asio::ip::udp::endpoint & dst, clock::time_point dequeued) -> void;
+
+template <typename... T> auto record(point where, const T &... args) -> void {
+	if (active())
+		append(where, args...);
+}
+
+// Write records of all threads to the pcapng file, return number of records
+auto dump(const std::string & path) -> size_t;
+
+}; // namespace wg::tunnel::capture
@@ -0,0 +1,431 @@
+// wg-tcp-tunnel - handoff.cpp
+// SPDX-FileCopyrightText: 2023-2025 Arkadiusz Bokowy and contributors
+// SPDX-License-Identifier: MIT
+
+#include "handoff.h"
+
+#include <array>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/system/error_code.hpp>
+#include <boost/system/system_error.hpp>
+
+#if !defined(_WIN32)
+#	include <cstdlib>
+#	include <fcntl.h>
+#	include <sys/socket.h>
+#	include <sys/un.h>
+#	include <unistd.h>
+#endif
+
+#include "utils.hpp"
+
+namespace wg::tunnel {
+
+namespace asio = boost::asio;
+
+#if !defined(_WIN32)
+
+namespace {
+
+// Record sent over the upgrade socket. It is followed by the key and the
+// session read and write buffers. Descriptors are attached to the record.
+struct record {
+	enum : uint8_t { end, socket, session };
+	enum : uint8_t { ctrl_ext = 1, initialized = 2, read_header = 4, resume = 8 };
+	uint8_t type = end;
+	uint8_t flags = 0;
+	uint16_t read_ctrl_type = 0;
+	uint32_t key_size = 0;
+	uint32_t read_length = 0;
+	uint32_t read_size = 0;
+	uint32_t write_size = 0;
+	std::array<uint8_t, 16> token = {};
+};
+
+// Time after which the new process gives up waiting for the handoff
+constexpr int receive_timeout = 30;
+
+auto error(const char * what) -> boost::system::system_error {
+	return { errno, boost::system::system_category(), what };
+}
+
+// Descriptor which is closed when it goes out of scope
+struct descriptor {
+	explicit descriptor(int fd_) : fd(fd_) {}
+	descriptor(const descriptor &) = delete;
+	auto operator=(const descriptor &) -> descriptor & = delete;
+	~descriptor() {
+		if (fd != -1)
+			::close(fd);
+	}
+	int fd;
+};
+
+auto write_all(int fd, const void * data, size_t size) -> void {
+	for (auto p = static_cast<const char *>(data); size > 0;) {
+		const auto n = ::send(fd, p, size, MSG_NOSIGNAL);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			throw error("handoff send");
+		}
+		p += n;
+		size -= n;
+	}
+}
+
+auto read_all(int fd, void * data, size_t size) -> void {
+	for (auto p = static_cast<char *>(data); size > 0;) {
+		const auto n = ::recv(fd, p, size, 0);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			throw error("handoff receive");
+		}
+		if (n == 0)
+			throw boost::system::system_error(boost::system::errc::make_error_code(
+			                                      boost::system::errc::connection_aborted),
+			                                  "handoff receive");
+		p += n;
+		size -= n;
+	}
+}
+
+auto send_record(int fd, const record & rec, std::initializer_list<int> fds) -> void {
+	std::array<char, CMSG_SPACE(2 * sizeof(int))> control = {};
+	iovec iov = { const_cast<record *>(&rec), sizeof(rec) };
+	msghdr msg = {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (fds.size() > 0) {
+		msg.msg_control = control.data();
+		msg.msg_controllen = CMSG_SPACE(fds.size() * sizeof(int));
+		auto cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(fds.size() * sizeof(int));
+		std::memcpy(CMSG_DATA(cmsg), fds.begin(), fds.size() * sizeof(int));
+	}
+	ssize_t n;
+	while ((n = ::sendmsg(fd, &msg, MSG_NOSIGNAL)) == -1 && errno == EINTR)
+		continue;
+	if (n == -1)
+		throw error("handoff send");
+	// Descriptors were passed with the first byte, so send the rest as is
+	write_all(fd, reinterpret_cast<const char *>(&rec) + n, sizeof(rec) - n);
+}
+
+auto recv_record(int fd, record & rec, std::vector<int> & fds) -> void {
+	std::array<char, CMSG_SPACE(2 * sizeof(int))> control = {};
+	iovec iov = { &rec, sizeof(rec) };
+	msghdr msg = {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.data();
+	msg.msg_controllen = control.size();
+	ssize_t n;
+	while ((n = ::recvmsg(fd, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR)
+		continue;
+	if (n == -1)
+		throw error("handoff receive");
+	for (auto cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		const auto count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (size_t i = 0; i < count; i++) {
+			int received;
+			std::memcpy(&received, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+			fds.push_back(received);
+		}
+	}
+	if (n == 0)
+		read_all(fd, &rec, sizeof(rec));
+	else
+		read_all(fd, reinterpret_cast<char *>(&rec) + n, sizeof(rec) - n);
+}
+
+}; // namespace
+
+auto handoff::close(int fd) -> void {
+	::close(fd);
+}
+
+auto handoff::duplicate(int fd) -> int {
+	const auto dup = ::fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (dup == -1)
+		throw error("handoff duplicate");
+	return dup;
+}
+
+auto handoff::send(int fd) const -> void {
+
+	// The peer is waiting for the whole handoff, so there is no point in
+	// using non-blocking writes here
+	const auto flags = ::fcntl(fd, F_GETFL);
+	if (flags != -1)
+		::fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+
+	for (const auto & [key, socket] : m_sockets) {
+		record rec;
+		rec.type = record::socket;
+		rec.key_size = static_cast<uint32_t>(key.size());
+		send_record(fd, rec, { socket });
+		write_all(fd, key.data(), key.size());
+	}
+
+	for (const auto & [key, s] : m_sessions) {
+		record rec;
+		rec.type = record::session;
+		rec.flags = (s.ctrl_ext ? record::ctrl_ext : 0) |
+		            (s.initialized ? record::initialized : 0) |
+		            (s.read_header ? record::read_header : 0) |
+		            (s.resume ? record::resume : 0);
+		rec.read_ctrl_type = static_cast<uint16_t>(s.read_ctrl_type);
+		rec.key_size = static_cast<uint32_t>(key.size());
+		rec.read_length = static_cast<uint32_t>(s.read_length);
+		rec.read_size = static_cast<uint32_t>(s.read.size());
+		rec.write_size = static_cast<uint32_t>(s.write.size());
+		if (s.resume)
+			rec.token = s.resume->m_token;
+		send_record(fd, rec, { s.tcp, s.udp });
+		write_all(fd, key.data(), key.size());
+		write_all(fd, s.read.data(), s.read.size());
+		write_all(fd, s.write.data(), s.write.size());
+	}
+
+	send_record(fd, record(), {});
+	// Socket is also used for waiting for the confirmation
+	if (flags != -1)
+		::fcntl(fd, F_SETFL, flags);
+}
+
+auto handoff::receive(const std::string & path) -> bool {
+
+	sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(addr.sun_path))
+		throw boost::system::system_error(
+		    boost::system::errc::make_error_code(boost::system::errc::filename_too_long),
+		    "handoff connect");
+	std::memcpy(addr.sun_path, path.data(), path.size());
+
+	descriptor sock(::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+	if (sock.fd == -1)
+		throw error("handoff socket");
+	if (::connect(sock.fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == -1) {
+		// There is no running process which could pass its sockets
+		if (errno == ENOENT || errno == ECONNREFUSED)
+			return false;
+		throw error("handoff connect");
+	}
+
+	timeval timeout = { receive_timeout, 0 };
+	::setsockopt(sock.fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	receive_records(sock.fd);
+	// Keep the connection, so the running process knows whether to stop
+	if (m_upgrade != -1)
+		::close(m_upgrade);
+	m_upgrade = std::exchange(sock.fd, -1);
+	return true;
+}
+
+auto handoff::confirm() -> void {
+
+	if (m_upgrade == -1)
+		return;
+
+	descriptor sock(std::exchange(m_upgrade, -1));
+	write_all(sock.fd, &confirmation, sizeof(confirmation));
+	receive_records(sock.fd);
+}
+
+auto handoff::receive_records(int fd) -> void {
+
+	for (;;) {
+
+		record rec;
+		std::vector<int> fds;
+		recv_record(fd, rec, fds);
+		// Take the ownership of the received descriptors right away
+		std::vector<std::unique_ptr<descriptor>> owned;
+		for (auto received : fds)
+			owned.push_back(std::make_unique<descriptor>(received));
+
+		if (rec.type == record::end)
+			return;
+
+		std::string key(rec.key_size, '\0');
+		read_all(fd, key.data(), key.size());
+
+		if (rec.type == record::socket && owned.size() == 1) {
+			add_socket(key, std::exchange(owned[0]->fd, -1));
+			continue;
+		}
+
+		if (rec.type == record::session && owned.size() == 2) {
+			session s;
+			s.ctrl_ext = rec.flags & record::ctrl_ext;
+			s.initialized = rec.flags & record::initialized;
+			s.read_header = rec.flags & record::read_header;
+			if (rec.flags & record::resume)
+				s.resume = utils::ctrl::session{ rec.token };
+			s.read_ctrl_type = static_cast<utils::ctrl::type>(rec.read_ctrl_type);
+			s.read_length = rec.read_length;
+			s.read.resize(rec.read_size);
+			read_all(fd, s.read.data(), s.read.size());
+			s.write.resize(rec.write_size);
+			read_all(fd, s.write.data(), s.write.size());
+			s.tcp = std::exchange(owned[0]->fd, -1);
+			s.udp = std::exchange(owned[1]->fd, -1);
+			add_session(key, std::move(s));
+			continue;
+		}
+
+		throw boost::system::system_error(
+		    boost::system::errc::make_error_code(boost::system::errc::protocol_error),
+		    "handoff receive");
+	}
+}
+
+auto handoff::activate() -> size_t {
+
+	const auto pid = std::getenv("LISTEN_PID");
+	const auto fds = std::getenv("LISTEN_FDS");
+	if (pid == nullptr || fds == nullptr || std::atol(pid) != ::getpid())
+		return 0;
+	const auto count = std::atoi(fds);
+	// Environment shall not be inherited by child processes
+	::unsetenv("LISTEN_PID");
+	::unsetenv("LISTEN_FDS");
+	::unsetenv("LISTEN_FDNAMES");
+
+	// Passed descriptors start right after the standard streams
+	constexpr int listen_fds_start = 3;
+
+	size_t activated = 0;
+	for (int fd = listen_fds_start; fd < listen_fds_start + count; fd++) {
+
+		::fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+		int type = 0;
+		socklen_t type_len = sizeof(type);
+		sockaddr_storage addr = {};
+		socklen_t addr_len = sizeof(addr);
+		if (::getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &type_len) == -1 ||
+		    ::getsockname(fd, reinterpret_cast<sockaddr *>(&addr), &addr_len) == -1 ||
+		    (addr.ss_family != AF_INET && addr.ss_family != AF_INET6 &&
+		     addr.ss_family != AF_UNIX)) {
+			// Only IP and Unix domain sockets can be used by the tunnel
+			::close(fd);
+			continue;
+		}
+
+		if (type == SOCK_STREAM || (type == SOCK_SEQPACKET && addr.ss_family == AF_UNIX)) {
+			const utils::stream_endpoint ep(&addr, addr_len);
+			add_socket(utils::to_string(ep), fd);
+		} else if (type == SOCK_DGRAM && addr.ss_family != AF_UNIX) {
+			asio::ip::udp::endpoint ep;
+			std::memcpy(ep.data(), &addr, addr_len);
+			add_socket(utils::to_string(ep), fd);
+		} else {
+			::close(fd);
+			continue;
+		}
+		activated++;
+	}
+
+	return activated;
+}
+
+#else
+
+auto handoff::close(int) -> void {}
+
+auto handoff::duplicate(int) -> int {
+	throw boost::system::system_error(
+	    boost::system::errc::make_error_code(boost::system::errc::operation_not_supported),
+	    "handoff duplicate");
+}
+
+auto handoff::send(int) const -> void {
+	throw boost::system::system_error(
+	    boost::system::errc::make_error_code(boost::system::errc::operation_not_supported),
+	    "handoff send");
+}
+
+auto handoff::receive(const std::string &) -> bool {
+	throw boost::system::system_error(
+	    boost::system::errc::make_error_code(boost::system::errc::operation_not_supported),
+	    "handoff receive");
+}
+
+auto handoff::confirm() -> void {}
+
+auto handoff::receive_records(int) -> void {}
+
+auto handoff::activate() -> size_t {
+	return 0;
+}
+
+#endif
+
+handoff::~handoff() {
+	// Running process keeps serving when the upgrade was not confirmed
+	if (m_upgrade != -1)
+		close(m_upgrade);
+	for (const auto & [key, fd] : m_sockets)
+		close(fd);
+	for (const auto & [key, s] : m_sessions) {
+		close(s.tcp);
+		close(s.udp);
+	}
+}
+
+auto handoff::add_socket(const std::string & key, int fd) -> void {
+	// Every socket is bound to a different endpoint, so keys shall be unique
+	if (auto [it, inserted] = m_sockets.emplace(key, fd); !inserted)
+		close(std::exchange(it->second, fd));
+}
+
+auto handoff::add_session(const std::string & key, session && s) -> void {
+	m_sessions.emplace(key, std::move(s));
+}
+
+auto handoff::merge(handoff & other) -> void {
+	for (auto & [key, fd] : other.m_sockets)
+		add_socket(key, fd);
+	other.m_sockets.clear();
+	m_sessions.merge(other.m_sessions);
+}
+
+auto handoff::take_socket(const std::string & key) -> std::optional<int> {
+	auto it = m_sockets.find(key);
+	if (it == m_sockets.end())
+		return std::nullopt;
+	const auto fd = it->second;
+	m_sockets.erase(it);
+	return fd;
+}
+
+auto handoff::take_sessions(const std::string & key) -> std::vector<session> {
+	std::vector<session> sessions;
+	auto [begin, end] = m_sessions.equal_range(key);
+	for (auto it = begin; it != end; it++)
+		sessions.push_back(std::move(it->second));
+	m_sessions.erase(begin, end);
+	return sessions;
+}
+
+}; // namespace wg::tunnel
@@ -0,0 +1,96 @@
+// wg-tcp-tunnel - handoff.h
+// SPDX-FileCopyrightText: 2023-2025 Arkadiusz Bokowy and contributors
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "utils.hpp"
+
+namespace wg::tunnel {
+
+using std::size_t;
+
+// Sockets and session state passed from the running process to the new
+// process during the binary upgrade, or sockets passed by the service
+// manager. Sockets are identified by the string representation of their
+// local endpoint.
+//
+// The upgrade is done in two steps. The running process passes duplicates
+// of its sockets and keeps serving. Once the new process has set up all
+// tunnels, it confirms the upgrade, and only then the running process stops
+// accepting connections and passes its sessions.
+class handoff {
+public:
+	// State of the raw transport session
+	struct session {
+		int tcp = -1;
+		int udp = -1;
+		bool ctrl_ext = false;
+		bool initialized = false;
+		std::optional<utils::ctrl::session> resume;
+		// Frame being read from the client: whether it is the framing header,
+		// type of the control frame which body is read, total frame length
+		// and the bytes which were already read
+		bool read_header = true;
+		utils::ctrl::type read_ctrl_type = utils::ctrl::type::none;
+		size_t read_length = 0;
+		std::vector<char> read;
+		// Data which was not written to the client yet
+		std::vector<char> write;
+	};
+
+	handoff() = default;
+	handoff(const handoff &) = delete;
+	auto operator=(const handoff &) -> handoff & = delete;
+	// Descriptors which were not taken over are closed
+	~handoff();
+
+	// Duplicate the descriptor, so it stays open when the socket is closed
+	static auto duplicate(int fd) -> int;
+
+	auto add_socket(const std::string & key, int fd) -> void;
+	auto add_session(const std::string & key, session && s) -> void;
+	// Move all sockets and sessions from the other handoff
+	auto merge(handoff & other) -> void;
+
+	// Take over the socket, the caller becomes the descriptor owner
+	auto take_socket(const std::string & key) -> std::optional<int>;
+	auto take_sessions(const std::string & key) -> std::vector<session>;
+
+	[[nodiscard]] auto empty() const -> bool { return m_sockets.empty() && m_sessions.empty(); }
+	[[nodiscard]] auto sessions() const -> size_t { return m_sessions.size(); }
+
+	// Byte sent by the new process to confirm the upgrade
+	static constexpr char confirmation = 'C';
+
+	// Send everything over the connected Unix stream socket
+	auto send(int fd) const -> void;
+	// Connect to the upgrade socket of the running process and receive its
+	// sockets, return false if no process is listening on the socket
+	auto receive(const std::string & path) -> bool;
+	// Confirm the upgrade to the running process and receive its sessions,
+	// the running process keeps serving if the upgrade is not confirmed
+	auto confirm() -> void;
+	// Take over sockets passed with the systemd socket activation protocol
+	// (LISTEN_PID and LISTEN_FDS), return the number of sockets
+	auto activate() -> size_t;
+
+private:
+	static auto close(int fd) -> void;
+	// Receive records until the end record
+	auto receive_records(int fd) -> void;
+
+	std::map<std::string, int> m_sockets;
+	std::multimap<std::string, session> m_sessions;
+	// Connection to the running process which waits for the confirmation
+	int m_upgrade = -1;
+};
+
+}; // namespace wg::tunnel
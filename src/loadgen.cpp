@@ -0,0 +1,1143 @@
+// wg-tcp-tunnel - loadgen.cpp
+// SPDX-FileCopyrightText: 2023-2025 Arkadiusz Bokowy and contributors
+// SPDX-License-Identifier: MIT
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if defined(__unix__)
+#	include <sys/resource.h>
+#endif
+
+#include <boost/asio.hpp>
+#include <boost/program_options.hpp>
+
+#include "queue.h"
+#include "utils.hpp"
+#include "version.h"
+
+namespace asio = boost::asio;
+namespace po = boost::program_options;
+using std::size_t;
+
+namespace wg::loadgen {
+
+using clock = std::chrono::steady_clock;
+using tunnel::packet;
+
+// Interval given in fractional seconds
+auto seconds(double s) -> clock::duration {
+	return std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(s));
+}
+
+// Latency histogram with logarithmic buckets, 16 per power of two, so the
+// memory stays bounded during long soak runs and the error is below 7%
+class histogram {
+public:
+	auto add(clock::duration d) -> void {
+		const auto us = std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+		m_buckets[bucket(us > 0 ? static_cast<uint64_t>(us) : 0)]++;
+		m_count++;
+	}
+	auto clear() -> void {
+		m_buckets.fill(0);
+		m_count = 0;
+	}
+	[[nodiscard]] auto count() const -> uint64_t { return m_count; }
+	// Lower bound of the bucket holding the given percentile in microseconds
+	[[nodiscard]] auto percentile(double p) const -> uint64_t {
+		const auto target = static_cast<uint64_t>(p / 100 * static_cast<double>(m_count));
+		uint64_t sum = 0;
+		for (size_t i = 0; i < m_buckets.size(); i++)
+			if ((sum += m_buckets[i]) > target)
+				return value(i);
+		return value(m_buckets.size() - 1);
+	}
+
+	friend auto operator<<(std::ostream & os, const histogram & h) -> std::ostream & {
+		if (h.m_count == 0)
+			return os << "-";
+		return os << h.percentile(50) << "/" << h.percentile(99) << "us";
+	}
+
+private:
+	static constexpr unsigned int exponent_max = 40;
+
+	static auto bucket(uint64_t v) -> size_t {
+		if (v < 16)
+			return v;
+		unsigned int e = 4;
+		while (e < exponent_max && (v >> (e + 1)) != 0)
+			e++;
+		return (e - 3) * 16 + ((v >> (e - 4)) & 15);
+	}
+	static auto value(size_t b) -> uint64_t {
+		if (b < 16)
+			return b;
+		return (16 + b % 16) << (b / 16 - 1);
+	}
+
+	std::array<uint64_t, (exponent_max - 2) * 16> m_buckets{};
+	uint64_t m_count = 0;
+};
+
+// Latency recorded for the report interval and for the whole run
+struct latency {
+	histogram interval;
+	histogram total;
+	auto add(clock::duration d) -> void {
+		interval.add(d);
+		total.add(d);
+	}
+};
+
+struct counters {
+	uint64_t connects = 0;
+	uint64_t connect_failed = 0;
+	uint64_t disconnects = 0;
+	uint64_t tx_packets = 0;
+	uint64_t tx_bytes = 0;
+	// Datagrams not sent, because the flow was not able to keep up
+	uint64_t tx_dropped = 0;
+	uint64_t sink_packets = 0;
+	uint64_t sink_bytes = 0;
+	uint64_t sink_dropped = 0;
+	uint64_t rx_packets = 0;
+	uint64_t rx_bytes = 0;
+};
+
+struct metrics {
+	counters c;
+	// TCP connection establishment
+	latency connect;
+	// Start of the flow until its first datagram reached the sink, i.e. the
+	// tunnel server accepted the session and forwarded the traffic
+	latency accept;
+	// Start of the flow until the first reply came back through the tunnel
+	latency setup;
+	// Round-trip time of the echoed datagrams
+	latency rtt;
+};
+
+// WireGuard-shaped datagrams. Every generated message carries the index of
+// the flow and a counter in place of the receiver index and the nonce, and
+// the send time in place of the encrypted data, so the sink can attribute
+// datagrams to flows and the RTT can be measured.
+namespace message {
+
+constexpr size_t stamp_size = 24;
+constexpr size_t initiation_size = 148;
+constexpr size_t response_size = 92;
+
+auto now_ns() -> uint64_t {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+	           clock::now().time_since_epoch())
+	    .count();
+}
+
+auto stamp(uint8_t * data, size_t length, uint32_t index, uint64_t counter) -> void {
+	if (length < stamp_size)
+		return;
+	const auto ns = now_ns();
+	std::memcpy(data + 4, &index, sizeof(index));
+	std::memcpy(data + 8, &counter, sizeof(counter));
+	std::memcpy(data + 16, &ns, sizeof(ns));
+}
+
+auto index(const uint8_t * data, size_t length, uint32_t & index) -> bool {
+	using utils::wireguard::message_type;
+	if (length < stamp_size || utils::wireguard::get_message_type(data, length) ==
+	                               message_type::unknown)
+		return false;
+	std::memcpy(&index, data + 4, sizeof(index));
+	return true;
+}
+
+auto sent(const uint8_t * data) -> clock::time_point {
+	uint64_t ns;
+	std::memcpy(&ns, data + 16, sizeof(ns));
+	return clock::time_point(std::chrono::nanoseconds(ns));
+}
+
+auto header(uint8_t * data, utils::wireguard::message_type type, size_t length) -> size_t {
+	std::memset(data, 0, 4);
+	data[0] = static_cast<uint8_t>(type);
+	return length;
+}
+
+}; // namespace message
+
+// Source of the datagrams sent by every flow
+class traffic {
+public:
+	// Synthetic transport data messages carrying inner packets of the given
+	// size, or of the simple IMIX distribution (7:4:1 of 60, 576 and 1420
+	// bytes) if the size is 0
+	explicit traffic(size_t size) : m_size(size) {}
+	// Datagrams replayed in a loop from the pcap or pcapng capture file
+	explicit traffic(const std::string & path);
+
+	// Write the next datagram of the flow to the buffer, return its length
+	auto next(uint8_t * data, uint32_t index, uint64_t counter) const -> size_t {
+		size_t length = 0;
+		if (!m_replay.empty()) {
+			const auto & d = m_replay[counter % m_replay.size()];
+			std::memcpy(data, d.data(), d.size());
+			length = d.size();
+		} else {
+			static constexpr std::array<size_t, 12> imix = { 60,  60,  60,  60,  60,   60,
+				                                             60,  576, 576, 576, 576, 1420 };
+			const auto inner = m_size != 0 ? m_size : imix[counter % imix.size()];
+			// Header, nonce and tag around the padded inner packet
+			length = message::header(data, utils::wireguard::message_type::transport_data,
+			                         32 + (inner + 15) / 16 * 16);
+		}
+		message::stamp(data, length, index, counter);
+		return length;
+	}
+
+	[[nodiscard]] auto replayed() const -> size_t { return m_replay.size(); }
+
+private:
+	size_t m_size = 0;
+	std::vector<std::vector<uint8_t>> m_replay;
+};
+
+class loadgen;
+
+// Traffic flow of a single WireGuard peer
+class flow {
+public:
+	flow(loadgen & lg, uint32_t index);
+	flow(const flow &) = delete;
+	auto operator=(const flow &) -> flow & = delete;
+	virtual ~flow() = default;
+
+	// Start or restart the flow
+	virtual auto start() -> void = 0;
+	virtual auto stop() -> void = 0;
+	// Send the datagram, return false if it had to be dropped
+	virtual auto send(const uint8_t * data, size_t length) -> bool = 0;
+
+	[[nodiscard]] auto ready() const -> bool { return m_ready; }
+	[[nodiscard]] auto index() const -> uint32_t { return m_index; }
+	auto counter() -> uint64_t { return m_counter++; }
+	[[nodiscard]] auto timer() -> asio::steady_timer & { return m_timer; }
+	// Called by the sink for every datagram of the flow
+	auto sink_received() -> void;
+
+protected:
+	auto do_reset() -> void;
+	// Mark the flow as ready and send the handshake initiation
+	auto do_ready() -> void;
+	auto do_received(const uint8_t * data, size_t length) -> void;
+	auto do_closed() -> void;
+
+	loadgen & m_loadgen;
+	metrics & m_metrics;
+	uint32_t m_index;
+	// Incremented on every restart, so handlers of the previous incarnation
+	// of the flow can be told apart
+	unsigned int m_generation = 0;
+	bool m_ready = false;
+	uint64_t m_counter = 0;
+	clock::time_point m_started;
+	bool m_sink_seen = false;
+	bool m_reply_seen = false;
+	// Lifetime or retry timer, driven by the generator
+	asio::steady_timer m_timer;
+};
+
+// Framed raw transport session connected to the tunnel server
+class tcp_flow : public flow {
+public:
+	// Maximum number of bytes waiting for the write
+	static constexpr size_t backlog_max = 256 * 1024;
+
+	tcp_flow(loadgen & lg, uint32_t index, utils::stream_endpoint ep);
+
+	auto start() -> void override;
+	auto stop() -> void override;
+	auto send(const uint8_t * data, size_t length) -> bool override;
+
+private:
+	auto do_connect_handler(const boost::system::error_code & ec) -> void;
+	auto do_write() -> void;
+	auto do_read() -> void;
+	auto do_read_handler(const boost::system::error_code & ec, size_t length) -> void;
+	auto do_error(const boost::system::error_code & ec) -> void;
+
+	utils::stream_endpoint m_ep;
+	utils::stream_socket m_socket;
+	clock::time_point m_connecting;
+	std::vector<uint8_t> m_write;
+	std::vector<uint8_t> m_backlog;
+	bool m_writing = false;
+	std::vector<uint8_t> m_read;
+	size_t m_read_length = 0;
+};
+
+// UDP sender driving the tunnel client
+class udp_flow : public flow {
+public:
+	udp_flow(loadgen & lg, uint32_t index, asio::ip::udp::endpoint ep);
+
+	auto start() -> void override;
+	auto stop() -> void override;
+	auto send(const uint8_t * data, size_t length) -> bool override;
+
+private:
+	auto do_read() -> void;
+
+	asio::ip::udp::endpoint m_ep;
+	asio::ip::udp::socket m_socket;
+	std::array<uint8_t, packet::payload_size_max> m_read;
+};
+
+struct options {
+	std::vector<utils::stream_endpoint> dst_tcp;
+	asio::ip::udp::endpoint dst_udp;
+	asio::ip::udp::endpoint sink;
+	bool echo = true;
+	size_t flows = 100;
+	double rate = 1000;
+	double connect_rate = 0;
+	size_t size = 0;
+	std::string replay;
+	double reconnect = 0;
+	double storm = 0;
+	double duration = 0;
+	double report = 1;
+};
+
+// Load generator driving all flows at the controlled rate
+class loadgen {
+public:
+	loadgen(asio::io_context & ioc, options o, traffic t);
+
+	auto run() -> void;
+	auto finish() -> void;
+
+	[[nodiscard]] auto io_context() -> asio::io_context & { return m_io_context; }
+	[[nodiscard]] auto stats() -> metrics & { return m_metrics; }
+	// The flow has become ready, or it was closed and shall be restarted
+	auto ready(flow & f) -> void;
+	auto closed(flow & f, bool failed) -> void;
+
+private:
+	// Datagrams are generated and flows are started on every tick
+	static constexpr auto tick = std::chrono::milliseconds(1);
+
+	auto do_tick() -> void;
+	auto do_start(clock::time_point now) -> void;
+	auto do_send(clock::time_point now) -> void;
+	auto do_storm() -> void;
+	auto do_report(bool final = false) -> void;
+	auto do_restart(flow & f, clock::duration delay) -> void;
+	auto do_sink_recv() -> void;
+	auto do_sink_recv_handler(const boost::system::error_code & ec, size_t length) -> void;
+
+	asio::io_context & m_io_context;
+	options m_options;
+	traffic m_traffic;
+	metrics m_metrics;
+	std::vector<std::unique_ptr<flow>> m_flows;
+	// Flows waiting to be started, paced by the connect rate
+	std::deque<uint32_t> m_queue;
+	double m_started = 0;
+	size_t m_cursor = 0;
+	double m_generated = 0;
+	clock::time_point m_begin;
+	clock::time_point m_last_tick;
+	asio::steady_timer m_tick_timer;
+	asio::steady_timer m_storm_timer;
+	asio::steady_timer m_report_timer;
+	asio::steady_timer m_end_timer;
+	counters m_last;
+	clock::time_point m_last_report;
+	bool m_finishing = false;
+	// Local UDP sink standing for the WireGuard endpoint behind the tunnel
+	asio::ip::udp::socket m_sink;
+	asio::ip::udp::endpoint m_sink_sender;
+	std::array<uint8_t, packet::payload_size_max> m_sink_buffer;
+	std::array<uint8_t, packet::payload_size_max> m_buffer;
+};
+
+namespace {
+
+// Read the value stored in the capture byte order
+template <typename T> auto read(const uint8_t * data, bool swap) -> T {
+	T v;
+	std::memcpy(&v, data, sizeof(v));
+	if (swap) {
+		auto p = reinterpret_cast<uint8_t *>(&v);
+		std::reverse(p, p + sizeof(v));
+	}
+	return v;
+}
+
+auto read_be16(const uint8_t * data) -> unsigned int { return (data[0] << 8) | data[1]; }
+
+// Extract the UDP payload of the captured frame of the given link type,
+// truncated payloads are padded with zeros up to the length from the header
+auto udp_payload(unsigned int linktype, const uint8_t * data, size_t length,
+                 std::vector<uint8_t> & payload) -> bool {
+	size_t offset = 0;
+	switch (linktype) {
+	case 0: // BSD loopback
+		offset = 4;
+		break;
+	case 1: // Ethernet, possibly with VLAN tags
+		for (offset = 12; offset + 2 <= length; offset += 4)
+			if (const auto type = read_be16(data + offset); type != 0x8100 && type != 0x88a8)
+				break;
+		offset += 2;
+		break;
+	case 12:  // Raw IP
+	case 101: // Raw IP
+		break;
+	case 113: // Linux cooked capture
+		offset = 16;
+		break;
+	case 276: // Linux cooked capture v2
+		offset = 20;
+		break;
+	default:
+		return false;
+	}
+	if (offset + 1 > length)
+		return false;
+	size_t udp = 0;
+	if (data[offset] >> 4 == 4) {
+		const size_t ihl = (data[offset] & 0x0f) * 4;
+		// Only the first fragment carries the UDP header
+		if (offset + 20 > length || data[offset + 9] != 17 ||
+		    (read_be16(data + offset + 6) & 0x1fff) != 0)
+			return false;
+		udp = offset + ihl;
+	} else if (data[offset] >> 4 == 6) {
+		if (offset + 40 > length || data[offset + 6] != 17)
+			return false;
+		udp = offset + 40;
+	} else {
+		return false;
+	}
+	if (udp + 8 > length || read_be16(data + udp + 4) < 8)
+		return false;
+	const size_t size = std::min<size_t>(read_be16(data + udp + 4) - 8, packet::payload_size_max);
+	payload.assign(size, 0);
+	std::copy_n(data + udp + 8, std::min(size, length - udp - 8), payload.begin());
+	return true;
+}
+
+}; // namespace
+
+traffic::traffic(const std::string & path) {
+	std::ifstream file(path, std::ios::binary);
+	if (!file)
+		throw std::runtime_error("unable to open capture file: " + path);
+	const std::vector<uint8_t> buf((std::istreambuf_iterator<char>(file)),
+	                               std::istreambuf_iterator<char>());
+	const auto add = [this](unsigned int linktype, const uint8_t * data, size_t length) {
+		std::vector<uint8_t> payload;
+		if (udp_payload(linktype, data, length, payload) &&
+		    utils::wireguard::get_message_type(payload.data(), payload.size()) !=
+		        utils::wireguard::message_type::unknown)
+			m_replay.push_back(std::move(payload));
+	};
+	if (buf.size() < 24)
+		throw std::runtime_error("invalid capture file: " + path);
+
+	const auto magic = read<uint32_t>(buf.data(), false);
+	if (magic == 0x0a0d0d0a) {
+		// The pcapng file is a sequence of blocks, every section starts with
+		// the header block which defines the byte order of the section
+		std::vector<unsigned int> interfaces;
+		bool swap = false;
+		for (size_t offset = 0; offset + 12 <= buf.size();) {
+			const auto block = buf.data() + offset;
+			if (read<uint32_t>(block, false) == 0x0a0d0d0a) {
+				swap = read<uint32_t>(block + 8, false) != 0x1a2b3c4d;
+				interfaces.clear();
+			}
+			const auto type = read<uint32_t>(block, swap);
+			const auto length = read<uint32_t>(block + 4, swap);
+			if (length < 12 || length % 4 != 0 || offset + length > buf.size())
+				break;
+			if (type == 1 && length >= 20) {
+				interfaces.push_back(read<uint16_t>(block + 8, swap));
+			} else if (type == 6 && length >= 32) {
+				const auto interface = read<uint32_t>(block + 8, swap);
+				const auto captured = read<uint32_t>(block + 20, swap);
+				if (interface < interfaces.size() && captured <= length - 32)
+					add(interfaces[interface], block + 28, captured);
+			} else if (type == 3 && length >= 16 && !interfaces.empty()) {
+				const auto original = read<uint32_t>(block + 8, swap);
+				add(interfaces[0], block + 12, std::min<size_t>(original, length - 16));
+			}
+			offset += length;
+		}
+	} else if (magic == 0xa1b2c3d4 || magic == 0xa1b23c4d || magic == 0xd4c3b2a1 ||
+	           magic == 0x4d3cb2a1) {
+		const bool swap = magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1;
+		const auto linktype = read<uint32_t>(buf.data() + 20, swap) & 0xffff;
+		for (size_t offset = 24; offset + 16 <= buf.size();) {
+			const auto captured = read<uint32_t>(buf.data() + offset + 8, swap);
+			if (offset + 16 + captured > buf.size())
+				break;
+			add(linktype, buf.data() + offset + 16, captured);
+			offset += 16 + captured;
+		}
+	} else {
+		throw std::runtime_error("unsupported capture file format: " + path);
+	}
+
+	if (m_replay.empty())
+		throw std::runtime_error("no WireGuard datagrams in capture file: " + path);
+}
+
+flow::flow(loadgen & lg, uint32_t index)
+    : m_loadgen(lg), m_metrics(lg.stats()), m_index(index), m_timer(lg.io_context()) {}
+
+auto flow::sink_received() -> void {
+	if (m_sink_seen)
+		return;
+	m_sink_seen = true;
+	m_metrics.accept.add(clock::now() - m_started);
+}
+
+auto flow::do_reset() -> void {
+	m_generation++;
+	m_ready = false;
+	m_started = clock::now();
+	m_sink_seen = false;
+	m_reply_seen = false;
+}
+
+auto flow::do_ready() -> void {
+	m_ready = true;
+	m_loadgen.ready(*this);
+	// Every WireGuard session starts with the handshake
+	std::array<uint8_t, message::initiation_size> data = {};
+	message::header(data.data(), utils::wireguard::message_type::handshake_initiation,
+	                data.size());
+	message::stamp(data.data(), data.size(), m_index, counter());
+	if (send(data.data(), data.size())) {
+		m_metrics.c.tx_packets++;
+		m_metrics.c.tx_bytes += data.size();
+	}
+}
+
+auto flow::do_received(const uint8_t * data, size_t length) -> void {
+	m_metrics.c.rx_packets++;
+	m_metrics.c.rx_bytes += length;
+	if (!m_reply_seen) {
+		m_reply_seen = true;
+		m_metrics.setup.add(clock::now() - m_started);
+	}
+	// Replies can arrive at any flow of the tunnel client
+	if (uint32_t index; message::index(data, length, index) && index == m_index)
+		if (const auto sent = message::sent(data); sent >= m_started)
+			m_metrics.rtt.add(clock::now() - sent);
+}
+
+auto flow::do_closed() -> void {
+	const bool failed = !m_ready;
+	stop();
+	m_loadgen.closed(*this, failed);
+}
+
+tcp_flow::tcp_flow(loadgen & lg, uint32_t index, utils::stream_endpoint ep)
+    : flow(lg, index), m_ep(std::move(ep)), m_socket(lg.io_context()),
+      m_read(64 * 1024) {}
+
+auto tcp_flow::start() -> void {
+	do_reset();
+	m_connecting = clock::now();
+	m_socket.async_connect(m_ep, [this, generation = m_generation](const auto & ec) {
+		if (generation == m_generation)
+			do_connect_handler(ec);
+	});
+}
+
+auto tcp_flow::stop() -> void {
+	m_generation++;
+	m_ready = false;
+	m_timer.cancel();
+	boost::system::error_code ec;
+	m_socket.close(ec);
+	m_write.clear();
+	m_backlog.clear();
+	m_writing = false;
+	m_read_length = 0;
+}
+
+auto tcp_flow::send(const uint8_t * data, size_t length) -> bool {
+	if (!m_ready || m_backlog.size() > backlog_max)
+		return false;
+	// Ports of the frame are not used by the tunnel server
+	const utils::ip::udp::header header(51820, 51820, static_cast<uint16_t>(length));
+	const auto h = reinterpret_cast<const uint8_t *>(&header);
+	m_backlog.insert(m_backlog.end(), h, h + sizeof(header));
+	m_backlog.insert(m_backlog.end(), data, data + length);
+	if (!m_writing)
+		do_write();
+	return true;
+}
+
+auto tcp_flow::do_connect_handler(const boost::system::error_code & ec) -> void {
+	if (ec) {
+		do_error(ec);
+		return;
+	}
+	m_metrics.c.connects++;
+	m_metrics.connect.add(clock::now() - m_connecting);
+	if (!utils::is_local(m_ep)) {
+		boost::system::error_code ec2;
+		m_socket.set_option(asio::ip::tcp::no_delay(true), ec2);
+	}
+	do_read();
+	do_ready();
+}
+
+auto tcp_flow::do_write() -> void {
+	std::swap(m_write, m_backlog);
+	m_backlog.clear();
+	m_writing = true;
+	asio::async_write(m_socket, asio::buffer(m_write),
+	                  [this, generation = m_generation](const auto & ec, size_t) {
+		                  if (generation != m_generation)
+			                  return;
+		                  m_writing = false;
+		                  if (ec) {
+			                  do_error(ec);
+			                  return;
+		                  }
+		                  if (!m_backlog.empty())
+			                  do_write();
+	                  });
+}
+
+auto tcp_flow::do_read() -> void {
+	m_socket.async_read_some(
+	    asio::buffer(m_read.data() + m_read_length, m_read.size() - m_read_length),
+	    [this, generation = m_generation](const auto & ec, size_t length) {
+		    if (generation == m_generation)
+			    do_read_handler(ec, length);
+	    });
+}
+
+auto tcp_flow::do_read_handler(const boost::system::error_code & ec, size_t length) -> void {
+	if (ec) {
+		do_error(ec);
+		return;
+	}
+	m_read_length += length;
+	size_t offset = 0;
+	while (m_read_length - offset >= sizeof(utils::ip::udp::header)) {
+		utils::ip::udp::header header(0, 0, 0);
+		std::memcpy(&header, m_read.data() + offset, sizeof(header));
+		if (!header.valid()) {
+			do_error(asio::error::invalid_argument);
+			return;
+		}
+		// Control frames of the tunnel, e.g. keep-alive, carry no datagram
+		const auto size = sizeof(header) + header.m_length;
+		if (m_read_length - offset < size)
+			break;
+		if (header.m_length > 0)
+			do_received(m_read.data() + offset + sizeof(header), header.m_length);
+		offset += size;
+	}
+	std::memmove(m_read.data(), m_read.data() + offset, m_read_length - offset);
+	m_read_length -= offset;
+	do_read();
+}
+
+auto tcp_flow::do_error(const boost::system::error_code & ec) -> void {
+	if (ec == asio::error::operation_aborted)
+		return;
+	if (ec != asio::error::eof && ec != asio::error::connection_reset)
+		std::cerr << "flow " << m_index << ": " << utils::to_string(m_ep) << ": " << ec.message()
+		          << "\n";
+	do_closed();
+}
+
+udp_flow::udp_flow(loadgen & lg, uint32_t index, asio::ip::udp::endpoint ep)
+    : flow(lg, index), m_ep(std::move(ep)), m_socket(lg.io_context()) {}
+
+auto udp_flow::start() -> void {
+	do_reset();
+	// Every start uses a new source port, like a restarted WireGuard peer
+	boost::system::error_code ec;
+	m_socket.open(m_ep.protocol(), ec);
+	if (!ec)
+		m_socket.connect(m_ep, ec);
+	if (!ec)
+		m_socket.non_blocking(true, ec);
+	if (ec) {
+		std::cerr << "flow " << m_index << ": " << utils::to_string(m_ep) << ": "
+		          << ec.message() << "\n";
+		do_closed();
+		return;
+	}
+	do_read();
+	do_ready();
+}
+
+auto udp_flow::stop() -> void {
+	m_generation++;
+	m_ready = false;
+	m_timer.cancel();
+	boost::system::error_code ec;
+	m_socket.close(ec);
+}
+
+auto udp_flow::send(const uint8_t * data, size_t length) -> bool {
+	boost::system::error_code ec;
+	return m_ready && m_socket.send(asio::buffer(data, length), 0, ec) == length && !ec;
+}
+
+auto udp_flow::do_read() -> void {
+	m_socket.async_receive(asio::buffer(m_read), [this, generation = m_generation](
+	                                                 const auto & ec, size_t length) {
+		if (generation != m_generation || ec == asio::error::operation_aborted)
+			return;
+		// Datagram refused by the closed tunnel client, keep receiving
+		if (!ec)
+			do_received(m_read.data(), length);
+		do_read();
+	});
+}
+
+loadgen::loadgen(asio::io_context & ioc, options o, traffic t)
+    : m_io_context(ioc), m_options(std::move(o)), m_traffic(std::move(t)), m_tick_timer(ioc),
+      m_storm_timer(ioc), m_report_timer(ioc), m_end_timer(ioc), m_sink(ioc) {
+	for (uint32_t i = 0; i < m_options.flows; i++) {
+		if (!m_options.dst_tcp.empty())
+			m_flows.push_back(std::make_unique<tcp_flow>(
+			    *this, i, m_options.dst_tcp[i % m_options.dst_tcp.size()]));
+		else
+			m_flows.push_back(std::make_unique<udp_flow>(*this, i, m_options.dst_udp));
+		m_queue.push_back(i);
+	}
+	if (m_options.sink.port() != 0) {
+		m_sink.open(m_options.sink.protocol());
+		m_sink.bind(m_options.sink);
+		m_sink.non_blocking(true);
+		m_sink.set_option(asio::socket_base::receive_buffer_size(4 * 1024 * 1024));
+	}
+}
+
+auto loadgen::run() -> void {
+	m_begin = m_last_tick = m_last_report = clock::now();
+	if (m_sink.is_open())
+		do_sink_recv();
+	do_tick();
+	if (m_options.storm > 0)
+		do_storm();
+	m_report_timer.expires_after(seconds(m_options.report));
+	m_report_timer.async_wait([this](const auto & ec) {
+		if (!ec)
+			do_report();
+	});
+	if (m_options.duration > 0) {
+		m_end_timer.expires_after(seconds(m_options.duration));
+		m_end_timer.async_wait([this](const auto & ec) {
+			if (!ec)
+				finish();
+		});
+	}
+}
+
+auto loadgen::finish() -> void {
+	if (std::exchange(m_finishing, true))
+		return;
+	// Stop generating and give the datagrams in flight a moment to arrive
+	m_tick_timer.cancel();
+	m_storm_timer.cancel();
+	m_end_timer.expires_after(std::chrono::seconds(1));
+	m_end_timer.async_wait([this](const auto &) {
+		do_report(true);
+		for (auto & f : m_flows)
+			f->stop();
+		m_io_context.stop();
+	});
+}
+
+auto loadgen::ready(flow & f) -> void {
+	if (m_options.reconnect <= 0)
+		return;
+	// Spread lifetimes between 50% and 150% of the reconnect interval, so
+	// flows started together do not reconnect together
+	const auto spread = 0.5 + static_cast<double>((f.index() * 2654435761U) % 1000) / 1000;
+	f.timer().expires_after(seconds(m_options.reconnect * spread));
+	f.timer().async_wait([this, &f](const auto & ec) {
+		if (ec)
+			return;
+		f.stop();
+		m_metrics.c.disconnects++;
+		m_queue.push_back(f.index());
+	});
+}
+
+auto loadgen::closed(flow & f, bool failed) -> void {
+	if (failed)
+		m_metrics.c.connect_failed++;
+	else
+		m_metrics.c.disconnects++;
+	// Do not hammer the server which refuses connections
+	do_restart(f, failed ? std::chrono::seconds(1) : clock::duration::zero());
+}
+
+auto loadgen::do_restart(flow & f, clock::duration delay) -> void {
+	if (delay == clock::duration::zero()) {
+		m_queue.push_back(f.index());
+		return;
+	}
+	f.timer().expires_after(delay);
+	f.timer().async_wait([this, &f](const auto & ec) {
+		if (!ec)
+			m_queue.push_back(f.index());
+	});
+}
+
+auto loadgen::do_tick() -> void {
+	const auto now = clock::now();
+	do_start(now);
+	do_send(now);
+	m_last_tick = now;
+	m_tick_timer.expires_at(now + tick);
+	m_tick_timer.async_wait([this](const auto & ec) {
+		if (!ec)
+			do_tick();
+	});
+}
+
+auto loadgen::do_start(clock::time_point now) -> void {
+	size_t count = m_queue.size();
+	if (m_options.connect_rate > 0) {
+		// Credits are not accumulated while there is nothing to start
+		const std::chrono::duration<double> elapsed = now - m_last_tick;
+		m_started = std::min(m_started + elapsed.count() * m_options.connect_rate,
+		                     std::max(1.0, m_options.connect_rate / 100));
+		count = std::min(count, static_cast<size_t>(m_started));
+		m_started -= static_cast<double>(count);
+	}
+	for (; count > 0 && !m_queue.empty(); count--) {
+		const auto index = m_queue.front();
+		m_queue.pop_front();
+		m_flows[index]->start();
+	}
+}
+
+auto loadgen::do_send(clock::time_point now) -> void {
+	// Datagrams which could not be generated within 10 ms are skipped, so
+	// a stalled loop does not end up with a burst
+	const std::chrono::duration<double> elapsed = now - m_last_tick;
+	m_generated = std::min(m_generated + elapsed.count() * m_options.rate,
+	                       std::max(1.0, m_options.rate / 100));
+	size_t scanned = 0;
+	for (; m_generated >= 1 && scanned < m_flows.size(); scanned++) {
+		auto & f = *m_flows[m_cursor];
+		m_cursor = (m_cursor + 1) % m_flows.size();
+		if (!f.ready())
+			continue;
+		scanned = 0;
+		m_generated -= 1;
+		const auto length = m_traffic.next(m_buffer.data(), f.index(), f.counter());
+		if (!f.send(m_buffer.data(), length)) {
+			m_metrics.c.tx_dropped++;
+			continue;
+		}
+		m_metrics.c.tx_packets++;
+		m_metrics.c.tx_bytes += length;
+	}
+	// Nothing is ready, so there is nobody to generate traffic for
+	if (m_generated >= 1)
+		m_generated = 0;
+}
+
+auto loadgen::do_storm() -> void {
+	m_storm_timer.expires_after(seconds(m_options.storm));
+	m_storm_timer.async_wait([this](const auto & ec) {
+		if (ec)
+			return;
+		// Drop all flows at once, so they will reconnect together
+		m_queue.clear();
+		for (auto & f : m_flows) {
+			if (f->ready())
+				m_metrics.c.disconnects++;
+			f->stop();
+			m_queue.push_back(f->index());
+		}
+		do_storm();
+	});
+}
+
+auto loadgen::do_report(bool final) -> void {
+	const auto now = clock::now();
+	const auto & c = m_metrics.c;
+	const auto ready = std::count_if(m_flows.begin(), m_flows.end(),
+	                                 [](const auto & f) { return f->ready(); });
+	std::ostringstream str;
+	str << std::fixed << std::setprecision(1);
+	if (final) {
+		const std::chrono::duration<double> elapsed = now - m_begin;
+		const auto mbps = static_cast<double>(c.tx_bytes) * 8 / 1e6 / elapsed.count();
+		str << "total: time=" << elapsed.count() << "s connects=" << c.connects
+		    << " failed=" << c.connect_failed << " disconnects=" << c.disconnects
+		    << " tx=" << c.tx_packets << " (" << mbps << "Mbps)"
+		    << " tx-dropped=" << c.tx_dropped << " sink=" << c.sink_packets
+		    << " sink-dropped=" << c.sink_dropped << " rx=" << c.rx_packets
+		    << " lost=" << (c.tx_packets > c.sink_packets ? c.tx_packets - c.sink_packets : 0)
+		    << " connect=" << m_metrics.connect.total << " accept=" << m_metrics.accept.total
+		    << " setup=" << m_metrics.setup.total << " rtt=" << m_metrics.rtt.total;
+		std::cout << str.str() << std::endl;
+		return;
+	}
+
+	const std::chrono::duration<double> interval = now - m_last_report;
+	const auto pps = [&interval](uint64_t v, uint64_t last) {
+		return static_cast<double>(v - last) / interval.count();
+	};
+	const auto mbps = pps(c.tx_bytes, m_last.tx_bytes) * 8 / 1e6;
+	const std::chrono::duration<double> elapsed = now - m_begin;
+	str << "[" << std::setw(6) << elapsed.count() << "s] flows=" << ready << "/"
+	    << m_flows.size() << " connects=" << c.connects - m_last.connects
+	    << " failed=" << c.connect_failed - m_last.connect_failed
+	    << " tx=" << pps(c.tx_packets, m_last.tx_packets) << "pps/" << mbps << "Mbps"
+	    << " tx-dropped=" << c.tx_dropped - m_last.tx_dropped
+	    << " sink=" << pps(c.sink_packets, m_last.sink_packets) << "pps"
+	    << " rx=" << pps(c.rx_packets, m_last.rx_packets) << "pps"
+	    << " connect=" << m_metrics.connect.interval << " accept=" << m_metrics.accept.interval
+	    << " setup=" << m_metrics.setup.interval << " rtt=" << m_metrics.rtt.interval;
+	std::cout << str.str() << std::endl;
+
+	m_last = c;
+	m_last_report = now;
+	m_metrics.connect.interval.clear();
+	m_metrics.accept.interval.clear();
+	m_metrics.setup.interval.clear();
+	m_metrics.rtt.interval.clear();
+	m_report_timer.expires_at(now + seconds(m_options.report));
+	m_report_timer.async_wait([this](const auto & ec) {
+		if (!ec)
+			do_report();
+	});
+}
+
+auto loadgen::do_sink_recv() -> void {
+	m_sink.async_receive_from(asio::buffer(m_sink_buffer), m_sink_sender,
+	                          [this](const auto & ec, size_t length) {
+		                          do_sink_recv_handler(ec, length);
+	                          });
+}
+
+auto loadgen::do_sink_recv_handler(const boost::system::error_code & ec, size_t length)
+    -> void {
+	if (ec == asio::error::operation_aborted)
+		return;
+	if (ec) {
+		do_sink_recv();
+		return;
+	}
+
+	m_metrics.c.sink_packets++;
+	m_metrics.c.sink_bytes += length;
+	const auto data = m_sink_buffer.data();
+	if (uint32_t index; message::index(data, length, index) && index < m_flows.size())
+		m_flows[index]->sink_received();
+
+	// Answer the handshake and echo the data back through the tunnel
+	size_t reply = 0;
+	switch (utils::wireguard::get_message_type(data, length)) {
+	case utils::wireguard::message_type::handshake_initiation:
+		std::memset(data + message::stamp_size, 0, message::response_size - message::stamp_size);
+		reply = message::header(data, utils::wireguard::message_type::handshake_response,
+		                        message::response_size);
+		break;
+	case utils::wireguard::message_type::transport_data:
+		reply = m_options.echo ? length : 0;
+		break;
+	default:
+		break;
+	}
+	if (reply > 0) {
+		boost::system::error_code ec2;
+		m_sink.send_to(asio::buffer(data, reply), m_sink_sender, 0, ec2);
+		if (ec2)
+			m_metrics.c.sink_dropped++;
+	}
+
+	do_sink_recv();
+}
+
+}; // namespace wg::loadgen
+
+namespace boost::asio::ip {
+
+template <typename T>
+auto validate(boost::any & v, const std::vector<std::string> & values, T *, int) -> void {
+	po::validators::check_first_occurrence(v);
+	try {
+		const auto [host, port] = wg::utils::split_host_port(
+		    po::validators::get_single_string(values));
+		v = boost::any(T(asio::ip::make_address(host), port));
+	} catch (const std::exception &) {
+		throw po::error_with_option_name(
+		    "the address in option '%canonical_option%' is invalid");
+	}
+}
+
+}; // namespace boost::asio::ip
+
+namespace boost {
+
+auto validate(boost::any & v, const std::vector<std::string> & values,
+              std::vector<wg::utils::stream_endpoint> *, int) -> void {
+	if (v.empty())
+		v = boost::any(std::vector<wg::utils::stream_endpoint>());
+	const std::string & s = po::validators::get_single_string(values);
+	auto & eps = boost::any_cast<std::vector<wg::utils::stream_endpoint> &>(v);
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+	if (s.substr(0, 5) == "unix:" && s.size() > 5) {
+		eps.emplace_back(asio::local::stream_protocol::endpoint(s.substr(5)));
+		return;
+	}
+#endif
+	boost::any ep;
+	asio::ip::validate(ep, values, static_cast<asio::ip::tcp::endpoint *>(nullptr), 0);
+	eps.emplace_back(boost::any_cast<asio::ip::tcp::endpoint>(ep));
+}
+
+}; // namespace boost
+
+auto main(int argc, char * argv[]) -> int {
+
+	const std::string name = PROJECT_NAME "-loadgen";
+	wg::loadgen::options o;
+
+	po::options_description options("Options");
+	auto o_builder = options.add_options();
+	o_builder("help,h", "print this help message and exit");
+	o_builder("version,V", "print version and exit");
+	o_builder("dst-tcp,t", po::value(&o.dst_tcp)->composing(),
+	          "tunnel server TCP address and port, or 'unix:PATH'; every flow is a framed "
+	          "raw transport session; may be specified multiple times");
+	o_builder("dst-udp,u", po::value(&o.dst_udp),
+	          "tunnel client UDP address and port; every flow is a UDP sender");
+	o_builder("sink,s", po::value(&o.sink),
+	          "local UDP address and port of the sink standing for the WireGuard endpoint "
+	          "behind the tunnel; it answers handshakes and echoes data back");
+	o_builder("no-echo", "do not echo data datagrams back from the sink");
+	o_builder("flows,n", po::value(&o.flows)->default_value(100),
+	          "number of concurrent flows");
+	o_builder("rate,r", po::value(&o.rate)->default_value(1000),
+	          "total number of datagrams per second sent by all flows");
+	o_builder("connect-rate", po::value(&o.connect_rate),
+	          "maximum number of flows started per second; by default all flows are "
+	          "started at once");
+	o_builder("size", po::value(&o.size),
+	          "size of the inner packet carried by the synthetic transport data messages; "
+	          "by default sizes follow the simple IMIX distribution");
+	o_builder("replay", po::value(&o.replay),
+	          "replay WireGuard datagrams from the pcap or pcapng file in a loop instead "
+	          "of the synthetic traffic");
+	o_builder("reconnect", po::value(&o.reconnect),
+	          "restart every flow after the given number of seconds on average");
+	o_builder("storm", po::value(&o.storm),
+	          "restart all flows at once every given number of seconds");
+	o_builder("duration,d", po::value(&o.duration),
+	          "stop after the given number of seconds; by default run until interrupted");
+	o_builder("report", po::value(&o.report)->default_value(1),
+	          "report interval in seconds");
+
+	po::variables_map args;
+	try {
+		po::store(po::parse_command_line(argc, argv, options), args);
+		po::notify(args);
+	} catch (const std::exception & e) {
+		std::cerr << name << ": " << e.what() << "\n";
+		return EXIT_FAILURE;
+	}
+
+	if (args.count("help")) {
+		std::cout << "Usage:" << "\n"
+		          << "  " << name << " [OPTION]..." << "\n"
+		          << "\n"
+		          << options << "\n"
+		          << "Examples:" << "\n"
+		          << "  " << name << " --dst-tcp=127.0.0.1:12345 --sink=127.0.0.1:51820 "
+		          << "--flows=5000 --connect-rate=1000" << "\n"
+		          << "  " << name << " --dst-udp=127.0.0.1:51821 --sink=127.0.0.1:51820 "
+		          << "--rate=100000 --replay=wg.pcapng" << "\n";
+		return EXIT_SUCCESS;
+	}
+	if (args.count("version")) {
+		std::cout << name << " " << PROJECT_VERSION << "\n";
+		return EXIT_SUCCESS;
+	}
+
+	o.echo = !args.count("no-echo");
+	if (o.dst_tcp.empty() == (o.dst_udp.port() == 0)) {
+		std::cerr << name << ": exactly one of '--dst-tcp' or '--dst-udp' must be given" << "\n";
+		return EXIT_FAILURE;
+	}
+	if (o.flows == 0 || o.flows > UINT32_MAX || o.rate < 0 || o.connect_rate < 0 ||
+	    o.reconnect < 0 || o.storm < 0 || o.duration < 0 || o.report <= 0) {
+		std::cerr << name << ": invalid rate, count or interval" << "\n";
+		return EXIT_FAILURE;
+	}
+	if (32 + (o.size + 15) / 16 * 16 > wg::tunnel::packet::payload_size_max) {
+		std::cerr << name << ": the inner packet size is too large" << "\n";
+		return EXIT_FAILURE;
+	}
+
+#if defined(__unix__)
+	// Every flow needs its own socket
+	if (rlimit limit; getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+#endif
+
+	try {
+		asio::io_context ioc(1);
+		auto traffic = o.replay.empty() ? wg::loadgen::traffic(o.size)
+		                                : wg::loadgen::traffic(o.replay);
+		if (traffic.replayed() > 0)
+			std::cout << "replay: datagrams=" << traffic.replayed() << std::endl;
+		wg::loadgen::loadgen lg(ioc, std::move(o), std::move(traffic));
+
+		asio::signal_set signals(ioc, SIGINT, SIGTERM);
+		signals.async_wait([&lg](const auto & ec, int) {
+			if (!ec)
+				lg.finish();
+		});
+
+		lg.run();
+		ioc.run();
+	} catch (const std::exception & e) {
+		std::cerr << name << ": " << e.what() << "\n";
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,228 @@
+// wg-tcp-tunnel - log.cpp
+// SPDX-FileCopyrightText: 2023-2025 Arkadiusz Bokowy and contributors
+// SPDX-License-Identifier: MIT
+
+#include "log.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/log/attributes/constant.hpp>
+#include <boost/log/attributes/current_thread_id.hpp>
+#include <boost/log/attributes/value_extraction.hpp>
+#include <boost/log/core.hpp>
+#include <boost/log/sources/record_ostream.hpp>
+#include <boost/log/trivial.hpp>
+
+namespace wg::tunnel::log {
+
+namespace logging = boost::log;
+using std::size_t;
+
+namespace {
+
+// Single-producer single-consumer ring of the records logged by one thread
+class ring {
+public:
+	// Maximum number of records waiting for the drain thread
+	static constexpr size_t capacity = 4096;
+
+	struct entry {
+		severity level = boost::log::trivial::info;
+		boost::posix_time::ptime time;
+		// Buffer capacity is kept, so the ring does not allocate once warmed up
+		std::string message;
+	};
+
+	ring()
+	    : m_thread_id(logging::attributes::current_thread_id()
+	                      .get_value()
+	                      .extract<logging::attributes::current_thread_id::value_type>()
+	                      .get()) {}
+
+	// Enqueue the record, return false if the ring is full
+	auto push(severity level, const std::string & message, bool & was_empty) -> bool {
+		const auto head = m_head.load(std::memory_order_relaxed);
+		const auto tail = m_tail.load(std::memory_order_acquire);
+		if (head - tail >= capacity) {
+			m_dropped.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+		auto & e = m_entries[head % capacity];
+		e.level = level;
+		e.time = boost::posix_time::microsec_clock::local_time();
+		e.message.assign(message);
+		m_head.store(head + 1, std::memory_order_release);
+		was_empty = head == tail;
+		return true;
+	}
+
+	// Dequeue records, must be called by the drain thread only
+	template <typename F> auto pop(F && consume) -> void {
+		const auto head = m_head.load(std::memory_order_acquire);
+		auto tail = m_tail.load(std::memory_order_relaxed);
+		for (; tail != head; tail++)
+			consume(m_entries[tail % capacity]);
+		m_tail.store(tail, std::memory_order_release);
+	}
+
+	[[nodiscard]] auto thread_id() const -> logging::attributes::current_thread_id::value_type {
+		return m_thread_id;
+	}
+	auto dropped() -> size_t { return m_dropped.exchange(0, std::memory_order_relaxed); }
+
+private:
+	std::array<entry, capacity> m_entries;
+	std::atomic<size_t> m_head{ 0 };
+	std::atomic<size_t> m_tail{ 0 };
+	std::atomic<size_t> m_dropped{ 0 };
+	logging::attributes::current_thread_id::value_type m_thread_id;
+};
+
+// Stream buffer which keeps its capacity between records
+class buffer : public std::streambuf {
+public:
+	auto clear() -> void { m_data.clear(); }
+	[[nodiscard]] auto data() const -> const std::string & { return m_data; }
+
+protected:
+	auto overflow(int_type c) -> int_type override {
+		if (!traits_type::eq_int_type(c, traits_type::eof()))
+			m_data.push_back(traits_type::to_char_type(c));
+		return traits_type::not_eof(c);
+	}
+	auto xsputn(const char_type * s, std::streamsize n) -> std::streamsize override {
+		m_data.append(s, static_cast<size_t>(n));
+		return n;
+	}
+
+private:
+	std::string m_data;
+};
+
+// State shared by all threads and the drain thread
+struct shared_state {
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::vector<std::shared_ptr<ring>> rings;
+	std::atomic<bool> running{ false };
+	bool stop = false;
+	std::thread thread;
+};
+
+auto state() -> shared_state & {
+	static shared_state s;
+	return s;
+}
+
+// Per-thread formatting buffer and ring
+struct thread_context {
+	buffer buf;
+	std::ostream stream{ &buf };
+	std::shared_ptr<ring> r;
+	unsigned int sample = 0;
+};
+
+thread_local thread_context context;
+
+auto consume(const ring & r, const ring::entry & e) -> void {
+	auto & core = *logging::core::get();
+	// Source attributes take precedence over the global ones, so the record
+	// carries the time and the thread at which it was logged
+	logging::attribute_set attrs;
+	attrs.insert("Severity", logging::attributes::make_constant(e.level));
+	attrs.insert("TimeStamp", logging::attributes::make_constant(e.time));
+	attrs.insert("ThreadID", logging::attributes::make_constant(r.thread_id()));
+	if (auto rec = core.open_record(attrs)) {
+		logging::record_ostream strm(rec);
+		strm << e.message;
+		strm.flush();
+		core.push_record(std::move(rec));
+	}
+}
+
+auto drain_rings(shared_state & s) -> void {
+	std::vector<std::shared_ptr<ring>> rings;
+	{
+		std::lock_guard lock(s.mutex);
+		rings = s.rings;
+	}
+	for (const auto & r : rings) {
+		r->pop([&r](const auto & e) { consume(*r, e); });
+		if (const auto dropped = r->dropped())
+			BOOST_LOG_TRIVIAL(warning) << "log: Ring buffer full: dropped=" << dropped;
+	}
+}
+
+}; // namespace
+
+auto record::sampled() -> bool {
+	const auto rate = trace_sample.load(std::memory_order_relaxed);
+	return rate <= 1 || ++context.sample % rate == 0;
+}
+
+auto record::stream() -> std::ostream & {
+	context.buf.clear();
+	return context.stream;
+}
+
+auto record::commit() -> void {
+	m_enabled = false;
+	auto & s = state();
+	if (!s.running.load(std::memory_order_acquire)) {
+		BOOST_LOG_SEV(logging::trivial::logger::get(), m_level) << context.buf.data();
+		return;
+	}
+	if (!context.r) {
+		context.r = std::make_shared<ring>();
+		std::lock_guard lock(s.mutex);
+		s.rings.push_back(context.r);
+	}
+	// The drain thread is woken up only when the ring becomes non-empty
+	bool was_empty = false;
+	if (context.r->push(m_level, context.buf.data(), was_empty) && was_empty)
+		s.cv.notify_one();
+}
+
+drain::drain() {
+	auto & s = state();
+	s.stop = false;
+	s.thread = std::thread([&s]() {
+		// Periodic wakeup covers notifications which raced with the wait
+		constexpr auto interval = std::chrono::milliseconds(100);
+		std::unique_lock lock(s.mutex);
+		while (!s.stop) {
+			lock.unlock();
+			drain_rings(s);
+			lock.lock();
+			s.cv.wait_for(lock, interval);
+		}
+	});
+	s.running.store(true, std::memory_order_release);
+}
+
+drain::~drain() {
+	auto & s = state();
+	s.running.store(false, std::memory_order_release);
+	{
+		std::lock_guard lock(s.mutex);
+		s.stop = true;
+	}
+	s.cv.notify_one();
+	s.thread.join();
+	drain_rings(s);
+}
+
+}; // namespace wg::tunnel::log
@@ -0,0 +1,69 @@
+// wg-tcp-tunnel - log.h
+// SPDX-FileCopyrightText: 2023-2025 Arkadiusz Bokowy and contributors
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <atomic>
+#include <ostream>
+
+#include <boost/log/trivial.hpp>
+
+// Data path log records below this level are compiled out
+#ifndef WGTT_LOG_LEVEL_MIN
+#	define WGTT_LOG_LEVEL_MIN trace
+#endif
+
+namespace wg::tunnel::log {
+
+using severity = boost::log::trivial::severity_level;
+
+constexpr severity level_min = boost::log::trivial::WGTT_LOG_LEVEL_MIN;
+
+// Runtime threshold mirroring the Boost.Log core filter, so records which
+// would be discarded are not formatted and the core is not locked at all
+inline std::atomic<int> threshold{ boost::log::trivial::info };
+// Only every N-th trace record is logged
+inline std::atomic<unsigned int> trace_sample{ 1 };
+
+// Log record formatted into a per-thread buffer and passed to the drain
+// thread through a per-thread lock-free ring buffer
+class record {
+public:
+	explicit record(severity level)
+	    : m_level(level), m_enabled(level >= level_min &&
+	                                static_cast<int>(level) >=
+	                                    threshold.load(std::memory_order_relaxed) &&
+	                                (level != boost::log::trivial::trace || sampled())) {}
+	record(const record &) = delete;
+	auto operator=(const record &) -> record & = delete;
+
+	explicit operator bool() const { return m_enabled; }
+	auto stream() -> std::ostream &;
+	// Pass the formatted record to the drain thread
+	auto commit() -> void;
+
+private:
+	static auto sampled() -> bool;
+
+	severity m_level;
+	bool m_enabled;
+};
+
+// Background thread which passes records to the Boost.Log core, records are
+// logged synchronously when the drain is not running
+class drain {
+public:
+	drain();
+	drain(const drain &) = delete;
+	auto operator=(const drain &) -> drain & = delete;
+	// Log all pending records and stop the thread
+	~drain();
+};
+
+}; // namespace wg::tunnel::log
+
+#define WGTT_LOG(lvl)                                                                           \
+	for (::wg::tunnel::log::record log_record_(::boost::log::trivial::lvl); log_record_;        \
+	     log_record_.commit())                                                                   \
+	log_record_.stream()
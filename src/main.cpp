@@ -2,21 +2,48 @@
 // SPDX-FileCopyrightText: 2023-2025 Arkadiusz Bokowy and contributors
 // SPDX-License-Identifier: MIT
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
 #include <cstdlib>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <sstream>
 #include <stdexcept>
 #include <string>
+#include <system_error>
+#include <thread>
+#include <utility>
 #include <vector>
 
+#if !defined(_WIN32)
+#	include <sys/socket.h>
+#	include <unistd.h>
+#endif
+
 #include <boost/asio.hpp>
 #include <boost/log/core.hpp>
 #include <boost/log/expressions.hpp>
 #include <boost/log/trivial.hpp>
+#include <boost/log/utility/setup/common_attributes.hpp>
 #include <boost/log/utility/setup/console.hpp>
 #include <boost/program_options.hpp>
 
+#include "capture.h"
+#include "handoff.h"
+#include "log.h"
 #include "ngrok.h"
+#include "runner.h"
+#include "scheduler.h"
 #include "tcp2udp.h"
+#if ENABLE_TLS
+#	include "tls.h"
+#endif
+#include "tuning.h"
 #include "udp2tcp.h"
 #include "utils.hpp"
 #include "version.h"
@@ -91,59 +118,718 @@ auto validate(boost::any & v, const std::vector<std::string> & values, wg::utils
 	}
 }
 
+// Stream endpoint is either 'unix:PATH' or IP address and port
+auto validate(boost::any & v, const std::vector<std::string> & values,
+              wg::utils::stream_endpoint *, int) -> void {
+	po::validators::check_first_occurrence(v);
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+	const std::string & s = po::validators::get_single_string(values);
+	if (s.substr(0, 5) == "unix:") {
+		if (s.size() == 5)
+			throw po::error_with_option_name(
+			    "the socket path in option '%canonical_option%' is empty");
+		try {
+			v = boost::any(wg::utils::stream_endpoint(
+			    asio::local::stream_protocol::endpoint(s.substr(5))));
+		} catch (const std::exception &) {
+			throw po::error_with_option_name(
+			    "the socket path in option '%canonical_option%' is too long");
+		}
+		return;
+	}
+#endif
+	boost::any ep;
+	asio::ip::validate(ep, values, static_cast<asio::ip::tcp::endpoint *>(nullptr), 0);
+	v = boost::any(wg::utils::stream_endpoint(boost::any_cast<asio::ip::tcp::endpoint>(ep)));
+}
+
+auto validate(boost::any & v, const std::vector<std::string> & values,
+              std::vector<wg::utils::stream_endpoint> *, int) -> void {
+	if (v.empty())
+		v = boost::any(std::vector<wg::utils::stream_endpoint>());
+	boost::any ep;
+	validate(ep, values, static_cast<wg::utils::stream_endpoint *>(nullptr), 0);
+	boost::any_cast<std::vector<wg::utils::stream_endpoint> &>(v).push_back(
+	    boost::any_cast<wg::utils::stream_endpoint>(ep));
+}
+
+auto validate(boost::any & v, const std::vector<std::string> & values,
+              std::vector<wg::tunnel::rate_limit> *, int) -> void {
+	const std::string & s = po::validators::get_single_string(values);
+	if (v.empty())
+		v = boost::any(std::vector<wg::tunnel::rate_limit>());
+	try {
+		auto & limits = boost::any_cast<std::vector<wg::tunnel::rate_limit> &>(v);
+		limits.push_back(wg::tunnel::rate_limit::from_string(s));
+	} catch (const std::exception &) {
+		throw po::error_with_option_name(
+		    "the rate limit in option '%canonical_option%' is invalid");
+	}
+}
+
 }; // namespace boost
 
-auto main(int argc, char * argv[]) -> int {
+namespace {
 
-	auto transport = wg::utils::transport::raw;
-	asio::ip::tcp::endpoint ep_src_tcp;
+// Options of a single tunnel instance
+struct tunnel_options {
+	wg::utils::stream_endpoint ep_src_tcp;
 	asio::ip::udp::endpoint ep_dst_udp;
 	asio::ip::udp::endpoint ep_src_udp;
-	asio::ip::tcp::endpoint ep_dst_tcp;
+	std::vector<wg::utils::stream_endpoint> ep_dst_tcp;
+	int dst_tcp_probe = 0;
 	int tcp_keep_alive = 0;
-	size_t count_verbose;
-	size_t count_quiet;
+	bool tcp_fast_open = false;
+	int tcp_defer_accept = 0;
+	bool incoming_cpu = false;
+	size_t tcp_zerocopy = 0;
+	int resume_grace = 0;
+	int idle_timeout = 0;
+	size_t max_sessions = 0;
+	size_t memory_limit = 0;
+	int aqm_codel_target = 0;
+	int aqm_codel_interval = 100;
+	std::vector<wg::tunnel::rate_limit> rate_limits;
+	std::string socket_profile;
+	bool tcp_nodelay = true;
+	int tcp_notsent_lowat = 0;
+	int socket_sndbuf = 0;
+	int socket_rcvbuf = 0;
+	std::string tcp_congestion;
+	int socket_busy_poll = 0;
+	int ip_dscp = 0;
+	bool auto_tune = false;
+	int ping_interval = 0;
+	int ping_count = 3;
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+	bool unix_seqpacket = false;
+#endif
+#if ENABLE_WEBSOCKET
+	bool websocket = false;
+	wg::utils::http::headers websocket_headers;
+#endif
+#if ENABLE_TLS
+	bool tls = false;
+	std::string tls_cert;
+	std::string tls_key;
+	std::string tls_ca;
+	std::string tls_server_name;
+#endif
+#if ENABLE_NGROK
+	std::string ngrok_api_key;
+	std::string ngrok_dst_tcp_endpoint;
+	int ngrok_keep_alive = 0;
+#endif
+	// Parsed arguments, so it is possible to check which options were given
+	po::variables_map args;
+};
 
-	po::options_description options("Options");
+// Add options describing a single tunnel instance
+auto add_tunnel_options(po::options_description & options, tunnel_options & o) -> void {
 	auto o_builder = options.add_options();
-	o_builder("help,h", "print this help message and exit");
-	o_builder("version,V", "print version and exit");
-	o_builder("verbose,v", new po::counter(&count_verbose), "increase verbosity level");
-	o_builder("quiet,q", new po::counter(&count_quiet), "decrease verbosity level");
-	o_builder("src-tcp,T", po::value(&ep_src_tcp), "source TCP address and port");
+	o_builder("src-tcp,T", po::value(&o.ep_src_tcp),
+	          "source TCP address and port, or 'unix:PATH' for a Unix domain socket");
 	auto dst_udp_default = asio::ip::udp::endpoint(asio::ip::make_address("127.0.0.1"), 51820);
-	o_builder("dst-udp,u", po::value(&ep_dst_udp)->default_value(dst_udp_default),
+	o_builder("dst-udp,u", po::value(&o.ep_dst_udp)->default_value(dst_udp_default),
 	          "destination UDP address and port");
-	o_builder("src-udp,U", po::value(&ep_src_udp), "source UDP address and port");
-	o_builder("dst-tcp,t", po::value(&ep_dst_tcp), "destination TCP address and port");
-	o_builder("tcp-keep-alive", po::value(&tcp_keep_alive)->implicit_value(120),
+	o_builder("src-udp,U", po::value(&o.ep_src_udp), "source UDP address and port");
+	o_builder("dst-tcp,t", po::value(&o.ep_dst_tcp)->composing(),
+	          "destination TCP address and port, or 'unix:PATH' for a Unix domain socket; "
+	          "may be specified multiple times, in which case connections to all destinations "
+	          "are raced in the given order");
+	o_builder("dst-tcp-probe", po::value(&o.dst_tcp_probe)->implicit_value(5),
+	          "probe all destination TCP addresses optionally specifying the probe interval "
+	          "in seconds; the healthy destination with the lowest RTT is preferred and the "
+	          "tunnel is migrated when the current destination degrades");
+	o_builder("tcp-keep-alive", po::value(&o.tcp_keep_alive)->implicit_value(120),
 	          "enable TCP keep-alive on TCP socket(s) optionally specifying the keep-alive "
 	          "idle time in seconds");
+	o_builder("tcp-fast-open", po::bool_switch(&o.tcp_fast_open),
+	          "enable TCP Fast Open, so the first queued data is sent in the SYN packet "
+	          "when reconnecting to the server");
+	o_builder("tcp-defer-accept", po::value(&o.tcp_defer_accept)->implicit_value(5),
+	          "accept TCP connections only after the client sent some data optionally "
+	          "specifying the timeout in seconds");
+	o_builder("incoming-cpu", po::bool_switch(&o.incoming_cpu),
+	          "accept TCP connections on every worker thread and steer every connection to "
+	          "the worker pinned to the CPU which has received it; session limits are shared "
+	          "by all workers; requires '--cpu-affinity'");
+	o_builder("tcp-zerocopy", po::value(&o.tcp_zerocopy)->implicit_value(16 * 1024),
+	          "send data over TCP with MSG_ZEROCOPY optionally specifying the minimum write "
+	          "size in bytes; smaller writes are copied; raw transport only");
+	o_builder("resume-grace", po::value(&o.resume_grace)->implicit_value(30),
+	          "keep the UDP socket of the closed session, so the reconnecting client can "
+	          "resume it, optionally specifying the grace period in seconds");
+	o_builder("idle-timeout", po::value(&o.idle_timeout),
+	          "close TCP client sessions which have not sent anything for the given number "
+	          "of seconds");
+	o_builder("max-sessions", po::value(&o.max_sessions),
+	          "maximum number of TCP client sessions of all tunnels; the session idle for "
+	          "the longest time is closed to make room for a new one");
+	o_builder("memory-limit", po::value(&o.memory_limit),
+	          "memory budget in MiB for TCP client sessions of all tunnels including queued "
+	          "packets");
+	o_builder("ping-interval", po::value(&o.ping_interval)->implicit_value(1000),
+	          "enable in-band RTT probing optionally specifying the ping interval in "
+	          "milliseconds; requires support on both tunnel ends");
+	o_builder("ping-count", po::value(&o.ping_count)->default_value(3),
+	          "number of missed pongs after which the peer is considered dead");
+	o_builder("codel-target", po::value(&o.aqm_codel_target)->implicit_value(5),
+	          "enable CoDel active queue management for data sent over TCP optionally "
+	          "specifying the target queuing delay in milliseconds");
+	o_builder("codel-interval", po::value(&o.aqm_codel_interval)->default_value(100),
+	          "CoDel interval in milliseconds; should be set to the worst-case RTT "
+	          "of the tunnel path");
+	o_builder("rate-limit", po::value(&o.rate_limits)->composing(),
+	          "limit the rate of data received from every TCP client session; the limit is "
+	          "specified as 'RATE[@ADDRESS/PREFIX]', where RATE is given in bits per second "
+	          "with optional k, M or G suffix; may be specified multiple times");
+	o_builder("socket-profile", po::value(&o.socket_profile)->default_value("default"),
+	          "TCP socket tuning profile; one of 'default', 'latency', 'throughput' or "
+	          "'custom'; options below override the profile settings");
+	o_builder("tcp-nodelay", po::value(&o.tcp_nodelay)->implicit_value(true),
+	          "enable or disable Nagle's algorithm on TCP socket(s)");
+	o_builder("tcp-notsent-lowat", po::value(&o.tcp_notsent_lowat),
+	          "limit for not sent bytes in the TCP socket send buffer");
+	o_builder("socket-sndbuf", po::value(&o.socket_sndbuf), "TCP socket send buffer size");
+	o_builder("socket-rcvbuf", po::value(&o.socket_rcvbuf), "TCP socket receive buffer size");
+	o_builder("tcp-congestion", po::value(&o.tcp_congestion),
+	          "TCP congestion control algorithm, e.g. 'bbr' or 'cubic'");
+	o_builder("socket-busy-poll", po::value(&o.socket_busy_poll),
+	          "busy polling time in microseconds for TCP socket(s)");
+	o_builder("ip-dscp", po::value(&o.ip_dscp),
+	          "DSCP value for packets sent over TCP socket(s)");
+	o_builder("auto-tune", po::bool_switch(&o.auto_tune),
+	          "periodically sample TCP connection info and adapt buffer sizes to the measured "
+	          "bandwidth-delay product");
+
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+	o_builder("unix-seqpacket", po::bool_switch(&o.unix_seqpacket),
+	          "use SOCK_SEQPACKET Unix domain sockets, which carry one datagram per message "
+	          "without the framing header");
+#endif
 
 #if ENABLE_WEBSOCKET
-	bool websocket = false;
-	wg::utils::http::headers websocket_headers;
-	o_builder("web-socket,W", po::bool_switch(&websocket), "enable WebSocket transport mode");
-	o_builder("web-socket-header,H", po::value(&websocket_headers)->composing(),
+	o_builder("web-socket,W", po::bool_switch(&o.websocket), "enable WebSocket transport mode");
+	o_builder("web-socket-header,H", po::value(&o.websocket_headers)->composing(),
 	          "add WebSocket header; may be specified multiple times");
 #endif
 
+#if ENABLE_TLS
+	o_builder("tls", po::bool_switch(&o.tls),
+	          "enable TLS transport mode; record encryption is offloaded to the kernel "
+	          "(kTLS) if supported");
+	o_builder("tls-cert", po::value(&o.tls_cert), "TLS server certificate chain (PEM file)");
+	o_builder("tls-key", po::value(&o.tls_key), "TLS server private key (PEM file)");
+	o_builder("tls-ca", po::value(&o.tls_ca),
+	          "CA certificates (PEM file) used to verify the TLS server; system default "
+	          "CA certificates are used if not given");
+	o_builder("tls-server-name", po::value(&o.tls_server_name),
+	          "TLS server name sent in SNI and matched against the server certificate; "
+	          "required unless '--tls-ca' is given");
+#endif
+
 #if ENABLE_NGROK
-	std::string ngrok_api_key;
-	std::string ngrok_dst_tcp_endpoint;
-	int ngrok_keep_alive = 0;
-	o_builder("ngrok-api-key", po::value(&ngrok_api_key)->default_value("ENV:NGROK_API_KEY"),
+	o_builder("ngrok-api-key", po::value(&o.ngrok_api_key)->default_value("ENV:NGROK_API_KEY"),
 	          "NGROK API key or 'ENV:VARIABLE' to read the key from the environment variable");
-	o_builder("ngrok-dst-tcp-endpoint", po::value(&ngrok_dst_tcp_endpoint),
+	o_builder("ngrok-dst-tcp-endpoint", po::value(&o.ngrok_dst_tcp_endpoint),
 	          "NGROK endpoint used to forward TCP traffic; the endpoint can be specified as "
 	          "'id=ID' or 'uri=REGEX', where ID is the endpoint identifier and REGEX is a "
 	          "regular expression matching the endpoint URI; the special value 'list' can be "
 	          "used to list all available endpoints");
-	o_builder("ngrok-keep-alive", po::value(&ngrok_keep_alive)->implicit_value(270),
+	o_builder("ngrok-keep-alive", po::value(&o.ngrok_keep_alive)->implicit_value(270),
 	          "enable keep-alive for NGROK connection");
 #endif
+}
 
-	po::variables_map args;
+#if ENABLE_NGROK
+// Get NGROK API key, 'ENV:VARIABLE' reads the key from the environment variable
+auto ngrok_api_key(const std::string & key) -> std::string {
+	if (key.substr(0, 4) != "ENV:")
+		return key;
+	const auto value = std::getenv(key.substr(4).c_str());
+	return value != nullptr ? value : "";
+}
+#endif
+
+// Settings of the worker threads which serve the tunnels
+struct worker_options {
+	bool busy_poll = false;
+	// CPU of every worker thread, empty if threads are not pinned
+	std::vector<unsigned int> cpus;
+};
+
+// Tunnel instance created from the options
+class tunnel {
+public:
+	tunnel(std::string name, tunnel_options && options)
+	    : m_name(std::move(name)), m_options(std::move(options)) {}
+
+	// Tunnel which accepts connections on every worker is replicated, every
+	// replica is served by the worker with the same index
+	auto replica(size_t index) -> void { m_replica = index; }
+	[[nodiscard]] auto replica() const -> size_t { return m_replica; }
+
+	[[nodiscard]] auto name() const -> const std::string & { return m_name; }
+	[[nodiscard]] auto options() const -> const tunnel_options & { return m_options; }
+	[[nodiscard]] auto ioc() const -> asio::io_context & { return *m_ioc; }
+
+	// Create tunnel endpoints bound to the given I/O context, sockets passed
+	// by the previous process are used instead of binding new ones
+	auto setup(asio::io_context & ioc, wg::tunnel::handoff & inherited,
+	           const worker_options & workers,
+	           const std::shared_ptr<wg::tunnel::session_limits> & limits) -> void;
+	// Start the tunnel endpoints
+	auto run() -> void {
+		if (m_tcp2udp)
+			m_tcp2udp->run(m_transport);
+		if (m_udp2tcp)
+			m_udp2tcp->run(m_transport);
+		if (m_tcp2udp && !m_inherited.empty())
+			m_tcp2udp->adopt(std::exchange(m_inherited, {}));
+	}
+	// Take over sessions passed by the previous process
+	auto inherit(wg::tunnel::handoff & inherited) -> void {
+		if (m_tcp2udp)
+			m_inherited = inherited.take_sessions(m_handoff_key);
+	}
+	// Pass sockets to the new process, the tunnel keeps running
+	auto handoff(wg::tunnel::handoff & state) -> void {
+		if (m_udp2tcp)
+			m_udp2tcp->handoff(state);
+		if (m_tcp2udp)
+			m_tcp2udp->handoff(state);
+	}
+	// Stop the tunnel and pass sessions to the new process, the handler is
+	// called when done
+	auto handoff_sessions(wg::tunnel::handoff & state, std::function<void()> handler) -> void {
+		if (m_udp2tcp)
+			m_udp2tcp->stop();
+		if (m_tcp2udp)
+			m_tcp2udp->handoff_sessions(state, std::move(handler));
+		else
+			handler();
+	}
+	// Whether there are sessions which were not passed to the new process
+	[[nodiscard]] auto active() const -> bool { return m_tcp2udp && m_tcp2udp->sessions() > 0; }
+	auto log_stats() -> void {
+		if (m_tcp2udp)
+			m_tcp2udp->log_stats();
+		if (m_udp2tcp)
+			m_udp2tcp->log_stats();
+	}
+
+private:
+	std::string m_name;
+	tunnel_options m_options;
+	size_t m_replica = 0;
+	asio::io_context * m_ioc = nullptr;
+	wg::utils::transport m_transport = wg::utils::transport::raw;
+#if ENABLE_NGROK
+	std::unique_ptr<wg::ngrok::client> m_ngrok;
+#endif
+	std::unique_ptr<wg::tunnel::udp2tcp_dest_provider> m_udp2tcp_dest_provider;
+	std::unique_ptr<wg::tunnel::tcp2udp> m_tcp2udp;
+	std::unique_ptr<wg::tunnel::udp2tcp> m_udp2tcp;
+	// Key of the listening socket and its sessions passed to the new process
+	std::string m_handoff_key;
+	// Sessions passed by the previous process
+	std::vector<wg::tunnel::handoff::session> m_inherited;
+};
+
+auto tunnel::setup(asio::io_context & ioc, wg::tunnel::handoff & inherited,
+                   const worker_options & workers,
+                   const std::shared_ptr<wg::tunnel::session_limits> & limits) -> void {
+
+	auto & o = m_options;
+	m_ioc = &ioc;
+
+	auto socket_tuning = wg::tunnel::socket_tuning::profile(o.socket_profile);
+	if (o.args.count("tcp-nodelay"))
+		socket_tuning.nodelay = o.tcp_nodelay;
+	if (o.args.count("tcp-notsent-lowat"))
+		socket_tuning.notsent_lowat = o.tcp_notsent_lowat;
+	if (o.args.count("socket-sndbuf"))
+		socket_tuning.sndbuf = o.socket_sndbuf;
+	if (o.args.count("socket-rcvbuf"))
+		socket_tuning.rcvbuf = o.socket_rcvbuf;
+	if (o.args.count("tcp-congestion"))
+		socket_tuning.congestion = o.tcp_congestion;
+	if (o.args.count("socket-busy-poll"))
+		socket_tuning.busy_poll = o.socket_busy_poll;
+	// Zero would declare the peer dead on every ping
+	if (o.ping_count < 1)
+		throw std::invalid_argument("Ping count must be positive");
+	if (o.args.count("ip-dscp")) {
+		if (o.ip_dscp < 0 || o.ip_dscp > 63)
+			throw std::invalid_argument("DSCP value out of range");
+		socket_tuning.tos = o.ip_dscp << 2;
+	}
+	if (workers.busy_poll) {
+		// Let the spinning thread poll the device queue as well
+		if (!o.args.count("socket-busy-poll"))
+			socket_tuning.busy_poll = 50;
+		socket_tuning.prefer_busy_poll = true;
+	}
+
+	wg::tunnel::udp2tcp_dest_provider_pool * udp2tcp_dest_provider_pool = nullptr;
+	if (o.dst_tcp_probe > 0) {
+		auto provider = std::make_unique<wg::tunnel::udp2tcp_dest_provider_pool>(
+		    ioc, o.ep_dst_tcp, std::chrono::seconds(o.dst_tcp_probe));
+		udp2tcp_dest_provider_pool = provider.get();
+		m_udp2tcp_dest_provider = std::move(provider);
+	} else {
+		m_udp2tcp_dest_provider =
+		    std::make_unique<wg::tunnel::udp2tcp_dest_provider_simple>(o.ep_dst_tcp);
+	}
+	bool dynamic_dst_tcp = false;
+
+#if ENABLE_NGROK
+
+	if (!o.ngrok_dst_tcp_endpoint.empty()) {
+		m_ngrok = std::make_unique<wg::ngrok::client>(ngrok_api_key(o.ngrok_api_key));
+		auto provider = std::make_unique<wg::tunnel::udp2tcp_dest_provider_ngrok>(*m_ngrok);
+		if (o.ngrok_dst_tcp_endpoint.substr(0, 3) == "id=")
+			provider->filter_id(o.ngrok_dst_tcp_endpoint.substr(3));
+		else if (o.ngrok_dst_tcp_endpoint.substr(0, 4) == "uri=")
+			provider->filter_uri(o.ngrok_dst_tcp_endpoint.substr(4));
+		else
+			throw std::runtime_error("Invalid NGROK endpoint specification");
+		m_udp2tcp_dest_provider = std::move(provider);
+		udp2tcp_dest_provider_pool = nullptr;
+		dynamic_dst_tcp = true;
+	}
+
+#endif
+
+	const bool is_server =
+	    (wg::utils::is_local(o.ep_src_tcp) || wg::utils::to_tcp(o.ep_src_tcp).port() != 0) &&
+	    o.ep_dst_udp.port() != 0;
+	const bool is_client =
+	    o.ep_src_udp.port() != 0 && (!o.ep_dst_tcp.empty() || dynamic_dst_tcp);
+	if (!is_server && !is_client)
+		throw std::runtime_error("one of '--src-tcp' && '--dst-udp' or "
+		                         "'--src-udp' && '--dst-tcp' must be given");
+
+#if ENABLE_WEBSOCKET
+	if (o.websocket_headers.size() > 0 && !o.websocket)
+		throw std::runtime_error("'--web-socket-header' can be used only with "
+		                         "the WebSocket transport mode enabled");
+	if (o.websocket)
+		m_transport = wg::utils::transport::websocket;
+#endif
+
+#if ENABLE_TLS
+	if (!o.tls && (o.args.count("tls-cert") || o.args.count("tls-key") ||
+	               o.args.count("tls-ca") || o.args.count("tls-server-name")))
+		throw std::runtime_error("'--tls-*' options can be used only with "
+		                         "the TLS transport mode enabled");
+#	if ENABLE_WEBSOCKET
+	if (o.tls && o.websocket)
+		throw std::runtime_error("TLS transport can not be used with WebSocket transport");
+#	endif
+	if (o.tls && is_server && (o.tls_cert.empty() || o.tls_key.empty()))
+		throw std::runtime_error("TLS server requires '--tls-cert' and '--tls-key'");
+	// Any certificate issued by the system CAs would be accepted otherwise
+	if (o.tls && is_client && o.tls_server_name.empty() && o.tls_ca.empty())
+		throw std::runtime_error("TLS client requires '--tls-server-name' unless "
+		                         "'--tls-ca' is given");
+#endif
+
+	int socket_type = SOCK_STREAM;
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+	if (o.unix_seqpacket) {
+		if ((is_server && !wg::utils::is_local(o.ep_src_tcp)) ||
+		    (is_client && (dynamic_dst_tcp || o.dst_tcp_probe > 0 ||
+		                   !std::all_of(o.ep_dst_tcp.begin(), o.ep_dst_tcp.end(),
+		                                wg::utils::is_local))))
+			throw std::runtime_error("'--unix-seqpacket' requires 'unix:PATH' TCP endpoints "
+			                         "and can not be used with '--dst-tcp-probe'");
+#	if ENABLE_WEBSOCKET
+		if (o.websocket)
+			throw std::runtime_error("'--unix-seqpacket' can not be used with WebSocket "
+			                         "transport");
+#	endif
+#	if ENABLE_TLS
+		if (o.tls)
+			throw std::runtime_error("'--unix-seqpacket' can not be used with TLS transport");
+#	endif
+		m_transport = wg::utils::transport::seqpacket;
+		socket_type = SOCK_SEQPACKET;
+	}
+#endif
+
+	if (o.incoming_cpu) {
+		if (!is_server || is_client || wg::utils::is_local(o.ep_src_tcp))
+			throw std::runtime_error("'--incoming-cpu' can be used only by the server side "
+			                         "listening on a TCP endpoint");
+		if (workers.cpus.empty())
+			throw std::runtime_error("'--incoming-cpu' requires '--cpu-affinity'");
+	}
+
+	if (o.tcp_zerocopy > 0) {
+		if (m_transport != wg::utils::transport::raw)
+			throw std::runtime_error("'--tcp-zerocopy' can be used only with raw transport");
+#if ENABLE_TLS
+		if (o.tls)
+			throw std::runtime_error("'--tcp-zerocopy' can not be used with TLS transport");
+#endif
+	}
+
+	if (is_server) {
+		// Replicas share the listening endpoint, so they need distinct keys
+		auto key = wg::utils::to_string(o.ep_src_tcp);
+		if (m_replica > 0)
+			key += "#" + std::to_string(m_replica);
+		m_handoff_key = key;
+		wg::utils::stream_acceptor acceptor(ioc);
+		if (auto fd = inherited.take_socket(key)) {
+			acceptor.assign(o.ep_src_tcp.protocol(), *fd);
+		} else {
+			acceptor = wg::utils::socket_listen(ioc, o.ep_src_tcp, socket_type, o.incoming_cpu);
+		}
+		if (o.incoming_cpu) {
+			// Connections received by the CPU of this replica are preferred for
+			// its listening socket, older kernels need the program for that
+			const auto cpu = workers.cpus[m_replica];
+			if (auto err = wg::utils::socket_set_incoming_cpu(acceptor, static_cast<int>(cpu)))
+				BOOST_LOG_TRIVIAL(warning)
+				    << "incoming-cpu: Couldn't set SO_INCOMING_CPU: " << err;
+			// Program is shared by the whole SO_REUSEPORT group
+			if (m_replica == 0)
+				if (auto err = wg::utils::socket_attach_reuseport_cpu(acceptor, workers.cpus))
+					BOOST_LOG_TRIVIAL(warning)
+					    << "incoming-cpu: Couldn't attach SO_REUSEPORT program: " << err;
+		}
+		m_tcp2udp = std::make_unique<wg::tunnel::tcp2udp>(ioc, std::move(acceptor),
+		                                                  o.ep_dst_udp);
+		auto & tcp2udp = *m_tcp2udp;
+		tcp2udp.handoff_key(key);
+		tcp2udp.incoming_cpu(o.incoming_cpu);
+		tcp2udp.keep_alive_tcp(o.tcp_keep_alive);
+		tcp2udp.fast_open(o.tcp_fast_open);
+		tcp2udp.defer_accept(o.tcp_defer_accept);
+		tcp2udp.zerocopy_threshold(o.tcp_zerocopy);
+		tcp2udp.resume_grace(o.resume_grace);
+		tcp2udp.idle_timeout(o.idle_timeout);
+		// Limits are shared by all tunnels of the process
+		if (o.max_sessions > 0) {
+			if (limits->max_sessions() > 0 && limits->max_sessions() != o.max_sessions)
+				throw std::runtime_error("'--max-sessions' must be the same for all tunnels");
+			limits->max_sessions(o.max_sessions);
+		}
+		if (const auto bytes = o.memory_limit * 1024 * 1024; bytes > 0) {
+			if (limits->memory().limit() > 0 && limits->memory().limit() != bytes)
+				throw std::runtime_error("'--memory-limit' must be the same for all tunnels");
+			limits->memory().limit(bytes);
+		}
+		tcp2udp.limits(limits);
+		tcp2udp.aqm_codel(o.aqm_codel_target, o.aqm_codel_interval);
+		tcp2udp.rate_limits(o.rate_limits);
+		tcp2udp.tuning(socket_tuning);
+		tcp2udp.auto_tune(o.auto_tune);
+		tcp2udp.ping(o.ping_interval, o.ping_count);
+#if ENABLE_NGROK
+		tcp2udp.keep_alive_app(o.ngrok_keep_alive);
+#endif
+#if ENABLE_WEBSOCKET
+		if (o.websocket)
+			tcp2udp.ws_headers(o.websocket_headers);
+#endif
+#if ENABLE_TLS
+		if (o.tls)
+			tcp2udp.tls(wg::tunnel::tls::server_context(o.tls_cert, o.tls_key));
+#endif
+	}
+
+	if (is_client) {
+		if (auto fd = inherited.take_socket(wg::utils::to_string(o.ep_src_udp))) {
+			asio::ip::udp::socket socket(ioc, o.ep_src_udp.protocol(), *fd);
+			m_udp2tcp = std::make_unique<wg::tunnel::udp2tcp>(ioc, std::move(socket),
+			                                                  *m_udp2tcp_dest_provider);
+		} else {
+			m_udp2tcp = std::make_unique<wg::tunnel::udp2tcp>(ioc, o.ep_src_udp,
+			                                                  *m_udp2tcp_dest_provider);
+		}
+		auto & udp2tcp = *m_udp2tcp;
+		udp2tcp.keep_alive_tcp(o.tcp_keep_alive);
+		udp2tcp.fast_open(o.tcp_fast_open);
+		udp2tcp.zerocopy_threshold(o.tcp_zerocopy);
+		udp2tcp.tuning(socket_tuning);
+		udp2tcp.auto_tune(o.auto_tune);
+		udp2tcp.ping(o.ping_interval, o.ping_count);
+		udp2tcp.aqm_codel(o.aqm_codel_target, o.aqm_codel_interval);
+#if ENABLE_NGROK
+		udp2tcp.keep_alive_app(o.ngrok_keep_alive);
+#endif
+#if ENABLE_WEBSOCKET
+		if (o.websocket)
+			udp2tcp.ws_headers(o.websocket_headers);
+#endif
+#if ENABLE_TLS
+		if (o.tls)
+			udp2tcp.tls(wg::tunnel::tls::client_context(o.tls_ca), o.tls_server_name);
+#endif
+		if (udp2tcp_dest_provider_pool != nullptr)
+			udp2tcp_dest_provider_pool->run();
+	}
+}
+
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+// Maximum time for which the upgraded process serves sessions which could
+// not be passed to the new process
+constexpr std::chrono::seconds upgrade_drain_max{ 60 };
+// Maximum time for which the new process may set up its tunnels
+constexpr std::chrono::seconds upgrade_confirm_max{ 60 };
+
+// Sockets may be taken over only by the same user or by root, other users
+// could have write access to the upgrade socket path
+auto upgrade_peer_allowed(asio::local::stream_protocol::socket & peer) -> bool {
+#	if defined(SO_PEERCRED)
+	ucred cred = {};
+	socklen_t len = sizeof(cred);
+	if (::getsockopt(peer.native_handle(), SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1)
+		return false;
+	if (cred.uid == 0 || cred.uid == ::geteuid())
+		return true;
+	BOOST_LOG_TRIVIAL(warning) << "upgrade: Connection rejected: pid=" << cred.pid
+	                           << " uid=" << cred.uid;
+	return false;
+#	else
+	(void)peer;
+	return true;
+#	endif
+}
+
+// Stop the I/O context once all tunnels served by it were drained
+auto drain(asio::io_context & ioc, const std::vector<std::unique_ptr<tunnel>> & tunnels,
+           std::chrono::steady_clock::time_point deadline) -> void {
+	const bool active = std::any_of(tunnels.begin(), tunnels.end(), [&ioc](const auto & t) {
+		return &t->ioc() == &ioc && t->active();
+	});
+	if (!active || std::chrono::steady_clock::now() >= deadline) {
+		ioc.stop();
+		return;
+	}
+	auto timer = std::make_shared<asio::steady_timer>(ioc, std::chrono::seconds(1));
+	timer->async_wait([&ioc, &tunnels, deadline, timer](const auto &) {
+		drain(ioc, tunnels, deadline);
+	});
+}
+#endif
+
+// Load tunnel instances from the configuration file, where every tunnel is
+// declared in its own [NAME] section using the long command line option names
+auto load_config(const std::string & path) -> std::vector<std::unique_ptr<tunnel>> {
+
+	std::ifstream file(path);
+	if (!file)
+		throw std::runtime_error("Couldn't open configuration file: " + path);
+
+	std::vector<std::pair<std::string, std::string>> sections;
+	std::string line;
+	for (size_t number = 1; std::getline(file, line); number++) {
+		const auto begin = line.find_first_not_of(" \t\r");
+		if (begin == std::string::npos || line[begin] == '#' || line[begin] == ';')
+			continue;
+		if (line[begin] == '[') {
+			const auto end = line.find(']', begin);
+			if (end == std::string::npos || end == begin + 1)
+				throw std::runtime_error(path + ":" + std::to_string(number) +
+				                         ": invalid section header");
+			sections.emplace_back(line.substr(begin + 1, end - begin - 1), "");
+			continue;
+		}
+		if (sections.empty())
+			throw std::runtime_error(path + ":" + std::to_string(number) +
+			                         ": option outside of a tunnel section");
+		sections.back().second += line.substr(begin) + "\n";
+	}
+
+	std::vector<std::unique_ptr<tunnel>> tunnels;
+	for (const auto & [name, body] : sections) {
+		tunnel_options o;
+		po::options_description options;
+		add_tunnel_options(options, o);
+		std::istringstream stream(body);
+		try {
+			po::store(po::parse_config_file(stream, options), o.args);
+			po::notify(o.args);
+		} catch (const std::exception & e) {
+			throw std::runtime_error(name + ": " + e.what());
+		}
+		tunnels.push_back(std::make_unique<tunnel>(name, std::move(o)));
+	}
+
+	if (tunnels.empty())
+		throw std::runtime_error("No tunnels declared in configuration file: " + path);
+	return tunnels;
+}
+
+}; // namespace
+
+auto main(int argc, char * argv[]) -> int {
+
+	std::string config;
+	size_t threads = 1;
+	int busy_poll = 0;
+	std::string cpu_affinity;
+	size_t count_verbose;
+	size_t count_quiet;
+	unsigned int log_trace_sample = 1;
+#if !defined(_WIN32)
+	std::string capture_file;
+	size_t capture_records = 0;
+	size_t capture_snaplen = 0;
+#endif
+
+	po::options_description options("Options");
+	auto o_builder = options.add_options();
+	o_builder("help,h", "print this help message and exit");
+	o_builder("version,V", "print version and exit");
+	o_builder("verbose,v", new po::counter(&count_verbose), "increase verbosity level");
+	o_builder("quiet,q", new po::counter(&count_quiet), "decrease verbosity level");
+	o_builder("log-trace-sample", po::value(&log_trace_sample)->default_value(1),
+	          "log only every N-th per-packet trace message, so the trace level can be "
+	          "enabled on a busy node");
+#if !defined(_WIN32)
+	// The capture is written on SIGUSR2, which is not available on Windows
+	o_builder("capture", po::value(&capture_file),
+	          "keep the recent datagrams passing through the tunnels in a preallocated "
+	          "ring and write them to the given pcapng file on SIGUSR2");
+	o_builder("capture-records", po::value(&capture_records)->default_value(16384),
+	          "number of datagrams kept in the capture ring of every worker thread");
+	o_builder("capture-snaplen", po::value(&capture_snaplen)->default_value(64),
+	          "number of bytes of every datagram kept in the capture ring, 0 to keep "
+	          "the whole datagram");
+#endif
+	o_builder("config,c", po::value(&config),
+	          "load tunnels from the configuration file instead of the command line; every "
+	          "tunnel is declared in its own '[NAME]' section with 'OPTION = VALUE' lines, "
+	          "where OPTION is the long name of any tunnel option listed below");
+	o_builder("threads", po::value(&threads)->default_value(1),
+	          "number of worker threads serving the tunnels; every tunnel is bound to a "
+	          "single thread and tunnels are distributed evenly among threads");
+	o_builder("busy-poll", po::value(&busy_poll)->implicit_value(1000),
+	          "busy-poll the worker threads instead of sleeping until the next event, "
+	          "optionally specifying the idle time in microseconds after which the thread "
+	          "falls back to sleeping; also enables busy polling on TCP socket(s)");
+	o_builder("cpu-affinity", po::value(&cpu_affinity),
+	          "pin worker threads to the given CPUs, e.g. '2,4-7'; threads are assigned "
+	          "to CPUs in the given order");
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+	std::string upgrade_socket;
+	o_builder("upgrade-socket", po::value(&upgrade_socket),
+	          "Unix socket used for zero-downtime upgrades; on startup, listening sockets "
+	          "and sessions are taken over from the process listening on this socket, "
+	          "which then exits once its remaining sessions are closed");
+#endif
+	const auto options_general = options;
+
+	tunnel_options cli;
+	add_tunnel_options(options, cli);
+
+	po::variables_map & args = cli.args;
 	try {
 		po::store(po::parse_command_line(argc, argv, options), args);
 		po::notify(args);
@@ -161,6 +847,8 @@ auto main(int argc, char * argv[]) -> int {
 		          << "  " << PROJECT_NAME << " --src-tcp=127.0.0.1:12345 --dst-udp=127.0.0.1:51820"
 		          << "\n"
 		          << "  " << PROJECT_NAME << " --src-udp=127.0.0.1:51821 --dst-tcp=127.0.0.1:12345"
+		          << "\n"
+		          << "  " << PROJECT_NAME << " --config=/etc/wg-tcp-tunnel.conf --threads=2"
 		          << "\n";
 		return EXIT_SUCCESS;
 	}
@@ -169,115 +857,386 @@ auto main(int argc, char * argv[]) -> int {
 		return EXIT_SUCCESS;
 	}
 
+	// Data path records are passed to the sink by the drain thread, so the
+	// time and the thread are taken from the record attributes
+	auto log_format = "[%TimeStamp(format=\"%Y-%m-%d %H:%M:%S.%f\")%] [%ThreadID%] "
+	                  "[%Severity%] %Message%";
 #if ENABLE_SYSTEMD
 	if (std::getenv("INVOCATION_ID") != nullptr)
 		// If launched by systemd we do not need timestamp in our log message
-		logging::add_console_log(std::clog, logging::keywords::format = "[%Severity%] %Message%");
+		log_format = "[%Severity%] %Message%";
 #endif
+	logging::add_common_attributes();
+	logging::add_console_log(std::clog, logging::keywords::format = log_format);
 
 	const int verbose = count_verbose - count_quiet;
+	auto log_level = logging::trivial::trace;
 	if (verbose < 0) {
-		logging::core::get()->set_filter(logging::trivial::severity >= logging::trivial::error);
+		log_level = logging::trivial::error;
 	} else if (verbose == 0) {
-		logging::core::get()->set_filter(logging::trivial::severity >= logging::trivial::warning);
+		log_level = logging::trivial::warning;
 	} else if (verbose == 1) {
-		logging::core::get()->set_filter(logging::trivial::severity >= logging::trivial::info);
+		log_level = logging::trivial::info;
 	} else if (verbose == 2) {
-		logging::core::get()->set_filter(logging::trivial::severity >= logging::trivial::debug);
-	} else {
-		logging::core::get()->set_filter(logging::trivial::severity >= logging::trivial::trace);
+		log_level = logging::trivial::debug;
 	}
-
-	wg::tunnel::udp2tcp_dest_provider_simple udp2tcp_dest_provider_simple(ep_dst_tcp);
-	wg::tunnel::udp2tcp_dest_provider * udp2tcp_dest_provider = &udp2tcp_dest_provider_simple;
-	bool dynamic_dst_tcp = false;
+	logging::core::get()->set_filter(logging::trivial::severity >= log_level);
+	wg::tunnel::log::threshold = log_level;
+	wg::tunnel::log::trace_sample = log_trace_sample;
 
 #if ENABLE_NGROK
-
-	if (ngrok_api_key.substr(0, 4) == "ENV:") {
-		// Read NGROK API key from the environment variable
-		const auto key = std::getenv(ngrok_api_key.substr(4).c_str());
-		ngrok_api_key = key != nullptr ? key : "";
+	if (cli.ngrok_dst_tcp_endpoint == "list") {
+		try {
+			wg::ngrok::client ngrok(ngrok_api_key(cli.ngrok_api_key));
+			for (const auto & ep : ngrok.endpoints())
+				std::cout << ep << "\n";
+			return EXIT_SUCCESS;
+		} catch (const std::exception & e) {
+			std::cerr << PROJECT_NAME << ": " << e.what() << "\n";
+			return EXIT_FAILURE;
+		}
 	}
+#endif
 
-	wg::ngrok::client ngrok(ngrok_api_key);
-	wg::tunnel::udp2tcp_dest_provider_ngrok udp2tcp_dest_provider_ngrok(ngrok);
-
-	if (!ngrok_dst_tcp_endpoint.empty()) {
-		try {
-			if (ngrok_dst_tcp_endpoint == "list") {
-				for (const auto & ep : ngrok.endpoints())
-					std::cout << ep << "\n";
-				return EXIT_SUCCESS;
-			} else if (ngrok_dst_tcp_endpoint.substr(0, 3) == "id=") {
-				udp2tcp_dest_provider_ngrok.filter_id(ngrok_dst_tcp_endpoint.substr(3));
-				udp2tcp_dest_provider = &udp2tcp_dest_provider_ngrok;
-				dynamic_dst_tcp = true;
-			} else if (ngrok_dst_tcp_endpoint.substr(0, 4) == "uri=") {
-				udp2tcp_dest_provider_ngrok.filter_uri(ngrok_dst_tcp_endpoint.substr(4));
-				udp2tcp_dest_provider = &udp2tcp_dest_provider_ngrok;
-				dynamic_dst_tcp = true;
-			} else {
-				throw std::runtime_error("Invalid NGROK endpoint specification");
+	std::vector<std::unique_ptr<tunnel>> tunnels;
+	if (!config.empty()) {
+		for (const auto & [name, value] : args)
+			if (!value.defaulted() && options_general.find_nothrow(name, false) == nullptr) {
+				std::cerr << PROJECT_NAME << ": '--" << name << "' cannot be used together "
+				          << "with '--config'" << "\n";
+				return EXIT_FAILURE;
 			}
+		try {
+			tunnels = load_config(config);
 		} catch (const std::exception & e) {
 			std::cerr << PROJECT_NAME << ": " << e.what() << "\n";
 			return EXIT_FAILURE;
 		}
+	} else {
+		tunnels.push_back(std::make_unique<tunnel>("", std::move(cli)));
 	}
 
-#endif
-
-	const bool is_server = ep_src_tcp.port() != 0 && ep_dst_udp.port() != 0;
-	const bool is_client = ep_src_udp.port() != 0 && (ep_dst_tcp.port() != 0 || dynamic_dst_tcp);
-	if (!is_server && !is_client) {
-		std::cerr << PROJECT_NAME << ": one of "
-		          << "'--src-tcp' && '--dst-udp'"
-		          << " or "
-		          << "'--src-udp' && '--dst-tcp'"
-		          << " must be given" << "\n";
+	if (threads == 0) {
+		std::cerr << PROJECT_NAME << ": the number of threads must be positive" << "\n";
 		return EXIT_FAILURE;
 	}
-
-#if ENABLE_WEBSOCKET
-	if (websocket_headers.size() > 0 && !websocket) {
-		std::cerr << PROJECT_NAME << ": '--web-socket-header' can be used only with "
-		          << "the WebSocket transport mode enabled" << "\n";
+	if (busy_poll < 0) {
+		std::cerr << PROJECT_NAME << ": the busy-poll idle time must not be negative" << "\n";
 		return EXIT_FAILURE;
 	}
+
+#if !defined(_WIN32)
+	if (!capture_file.empty()) {
+		if (capture_records == 0) {
+			std::cerr << PROJECT_NAME << ": the number of capture records must be positive"
+			          << "\n";
+			return EXIT_FAILURE;
+		}
+		const auto snaplen =
+		    capture_snaplen == 0 ? wg::tunnel::packet::payload_size_max : capture_snaplen;
+		wg::tunnel::capture::configure(capture_records, snaplen);
+	}
 #endif
 
-	asio::io_context ioc;
-	wg::tunnel::tcp2udp tcp2udp(ioc, ep_src_tcp, ep_dst_udp);
-	wg::tunnel::udp2tcp udp2tcp(ioc, ep_src_udp, *udp2tcp_dest_provider);
+	std::vector<unsigned int> cpus;
+	if (!cpu_affinity.empty()) {
+		try {
+			cpus = wg::tunnel::parse_cpu_list(cpu_affinity);
+		} catch (const std::exception &) {
+			std::cerr << PROJECT_NAME << ": invalid CPU list: " << cpu_affinity << "\n";
+			return EXIT_FAILURE;
+		}
+	}
 
-	tcp2udp.keep_alive_tcp(tcp_keep_alive);
-	udp2tcp.keep_alive_tcp(tcp_keep_alive);
-#if ENABLE_NGROK
-	tcp2udp.keep_alive_app(ngrok_keep_alive);
-	udp2tcp.keep_alive_app(ngrok_keep_alive);
-#endif
-#if ENABLE_WEBSOCKET
-	if (websocket) {
-		transport = wg::utils::transport::websocket;
-		tcp2udp.ws_headers(websocket_headers);
-		udp2tcp.ws_headers(websocket_headers);
+	// Tunnels which accept connections on every worker need all threads
+	const bool replicated = std::any_of(tunnels.begin(), tunnels.end(),
+	                                    [](const auto & t) { return t->options().incoming_cpu; });
+
+	// Every tunnel is bound to a single I/O context served by a single thread,
+	// so tunnels (and buffer pools) do not need any synchronization.
+	std::vector<std::unique_ptr<asio::io_context>> iocs;
+	for (size_t i = 0; i < (replicated ? threads : std::min(threads, tunnels.size())); i++)
+		iocs.push_back(std::make_unique<asio::io_context>(1));
+
+	worker_options settings;
+	settings.busy_poll = busy_poll > 0;
+	for (size_t i = 0; !cpus.empty() && i < iocs.size(); i++)
+		settings.cpus.push_back(cpus[i % cpus.size()]);
+
+	if (replicated) {
+		// Replicas are set up in order, so the index of the replica is also the
+		// index of its listening socket in the SO_REUSEPORT group
+		std::vector<std::unique_ptr<tunnel>> expanded;
+		for (auto & t : tunnels) {
+			const bool incoming_cpu = t->options().incoming_cpu;
+			auto & first = expanded.emplace_back(std::move(t));
+			for (size_t i = 1; incoming_cpu && i < iocs.size(); i++) {
+				auto & replica = expanded.emplace_back(
+				    std::make_unique<tunnel>(first->name(), tunnel_options(first->options())));
+				replica->replica(i);
+			}
+		}
+		tunnels = std::move(expanded);
 	}
+
+	// Session limits of the server tunnels are enforced for the whole process
+	const auto limits = std::make_shared<wg::tunnel::session_limits>();
+
+	{
+		// Sockets passed by the previous process, sockets which are not
+		// taken over by any tunnel are closed at the end of this scope
+		wg::tunnel::handoff inherited;
+#if ENABLE_SYSTEMD
+		// Sockets bound by systemd, so connections are queued by the kernel
+		// while the service is being (re)started
+		if (const auto count = inherited.activate(); count > 0)
+			BOOST_LOG_TRIVIAL(info) << "systemd: Sockets passed by service manager: "
+			                        << "count=" << count;
 #endif
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+		try {
+			if (!upgrade_socket.empty() && inherited.receive(upgrade_socket))
+				BOOST_LOG_TRIVIAL(info) << "upgrade: Sockets received from previous process";
+		} catch (const std::exception & e) {
+			std::cerr << PROJECT_NAME << ": " << e.what() << "\n";
+			return EXIT_FAILURE;
+		}
+#endif
+		size_t next = 0;
+		for (auto & tunnel : tunnels) {
+			auto & t = *tunnel;
+			const auto index = t.options().incoming_cpu ? t.replica() : next++ % iocs.size();
+			try {
+				t.setup(*iocs[index], inherited, settings, limits);
+			} catch (const std::exception & e) {
+				std::cerr << PROJECT_NAME << ": " << (t.name().empty() ? "" : t.name() + ": ")
+				          << e.what() << "\n";
+				return EXIT_FAILURE;
+			}
+		}
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+		// All tunnels were set up, so the previous process can stop serving
+		// and pass its sessions
+		try {
+			inherited.confirm();
+			if (inherited.sessions() > 0)
+				BOOST_LOG_TRIVIAL(info) << "upgrade: Sessions received from previous process: "
+				                        << "sessions=" << inherited.sessions();
+		} catch (const std::exception & e) {
+			BOOST_LOG_TRIVIAL(error) << "upgrade: " << e.what();
+		}
+		for (auto & t : tunnels)
+			t->inherit(inherited);
+#endif
+	}
 
-restart:
+#if defined(SIGUSR1)
+	// Log statistics of all tunnels on user request
+	asio::signal_set signals_stats(*iocs.front(), SIGUSR1);
+	std::function<void()> do_signals_stats = [&]() {
+		signals_stats.async_wait([&](const auto & ec, int) {
+			if (ec)
+				return;
+			for (auto & t : tunnels)
+				asio::post(t->ioc(), [&t = *t]() { t.log_stats(); });
+			do_signals_stats();
+		});
+	};
+	do_signals_stats();
+#endif
 
-	if (is_server)
-		tcp2udp.run(transport);
-	if (is_client)
-		udp2tcp.run(transport);
+#if defined(SIGUSR2)
+	// Write the capture ring to the file on user request, the file is written
+	// by a separate thread, so the worker threads are not stalled
+	asio::signal_set signals_capture(*iocs.front());
+	std::thread capture_thread;
+	std::atomic<bool> capture_running{ false };
+	std::function<void()> do_signals_capture = [&]() {
+		signals_capture.async_wait([&](const auto & ec, int) {
+			if (ec)
+				return;
+			if (capture_running.exchange(true)) {
+				BOOST_LOG_TRIVIAL(warning) << "capture: Dump already in progress";
+			} else {
+				if (capture_thread.joinable())
+					capture_thread.join();
+				capture_thread = std::thread([&]() {
+					try {
+						const auto count = wg::tunnel::capture::dump(capture_file);
+						BOOST_LOG_TRIVIAL(info) << "capture: Datagrams written to " << capture_file
+						                        << ": count=" << count;
+					} catch (const std::exception & e) {
+						BOOST_LOG_TRIVIAL(error) << "capture: " << e.what();
+					}
+					capture_running = false;
+				});
+			}
+			do_signals_capture();
+		});
+	};
+	if (!capture_file.empty()) {
+		signals_capture.add(SIGUSR2);
+		do_signals_capture();
+	}
+#endif
 
-	try {
-		ioc.run();
-	} catch (const std::exception & e) {
-		std::cerr << PROJECT_NAME << ": " << e.what() << "\n";
-		goto restart;
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+	// Wait for the new process which will take over our sockets
+	asio::local::stream_protocol::acceptor upgrade_acceptor(*iocs.front());
+	std::function<void()> do_upgrade_accept;
+	// Capture the state of every tunnel by the thread which serves it, the
+	// handler is called by the first thread with the merged state
+	const auto capture = [&](auto && what, std::function<void(wg::tunnel::handoff &)> handler) {
+		auto states = std::make_shared<std::vector<wg::tunnel::handoff>>(tunnels.size());
+		auto pending = std::make_shared<size_t>(tunnels.size());
+		// Handlers are posted to the first context by other threads, so it must
+		// not run out of work until all tunnels are captured
+		auto work = asio::make_work_guard(*iocs.front());
+		const auto done = [states, pending, work, handler = std::move(handler)]() {
+			if (--*pending > 0)
+				return;
+			wg::tunnel::handoff state;
+			for (auto & s : *states)
+				state.merge(s);
+			handler(state);
+		};
+		for (size_t i = 0; i < tunnels.size(); i++)
+			asio::post(tunnels[i]->ioc(), [&, what, i, states, done]() {
+				what(*tunnels[i], (*states)[i], [&, done]() { asio::post(*iocs.front(), done); });
+			});
+	};
+	using upgrade_peer = std::shared_ptr<asio::local::stream_protocol::socket>;
+	const auto do_upgrade_sessions = [&](const upgrade_peer & peer) {
+		BOOST_LOG_TRIVIAL(info) << "upgrade: Passing sessions to new process";
+		boost::system::error_code ec;
+		upgrade_acceptor.close(ec);
+#	if defined(SIGUSR1)
+		signals_stats.cancel();
+#	endif
+#	if defined(SIGUSR2)
+		signals_capture.cancel();
+#	endif
+		const auto what = [](auto & t, auto & state, auto handler) {
+			t.handoff_sessions(state, handler);
+		};
+		capture(what, [&, peer](wg::tunnel::handoff & state) {
+			try {
+				state.send(peer->native_handle());
+			} catch (const std::exception & e) {
+				std::cerr << PROJECT_NAME << ": " << e.what() << "\n";
+			}
+			// Serve remaining sessions until they are closed
+			const auto deadline = std::chrono::steady_clock::now() + upgrade_drain_max;
+			for (auto & ioc : iocs)
+				asio::post(*ioc, [&, deadline]() { drain(*ioc, tunnels, deadline); });
+		});
+	};
+	const auto do_upgrade_confirm = [&](const upgrade_peer & peer) {
+		// Keep serving until the new process has set up all tunnels, if
+		// it fails, the connection is closed without the confirmation
+		auto byte = std::make_shared<char>();
+		auto timer = std::make_shared<asio::steady_timer>(peer->get_executor(),
+		                                                  upgrade_confirm_max);
+		timer->async_wait([peer](const auto & ec) {
+			if (ec)
+				return;
+			BOOST_LOG_TRIVIAL(warning) << "upgrade: New process did not confirm in time";
+			boost::system::error_code ec2;
+			peer->close(ec2);
+		});
+		const auto handler = [&, peer, byte, timer](const auto & ec, size_t) {
+			timer->cancel();
+			if (ec || *byte != wg::tunnel::handoff::confirmation) {
+				BOOST_LOG_TRIVIAL(warning) << "upgrade: New process did not take over";
+				do_upgrade_accept();
+				return;
+			}
+			do_upgrade_sessions(peer);
+		};
+		asio::async_read(*peer, asio::buffer(byte.get(), 1), handler);
+	};
+	const auto do_upgrade = [&](asio::local::stream_protocol::socket socket) {
+		BOOST_LOG_TRIVIAL(info) << "upgrade: Passing sockets to new process";
+		auto peer = std::make_shared<decltype(socket)>(std::move(socket));
+		const auto what = [](auto & t, auto & state, auto handler) {
+			t.handoff(state);
+			handler();
+		};
+		capture(what, [&, peer](wg::tunnel::handoff & state) {
+			try {
+				state.send(peer->native_handle());
+			} catch (const std::exception & e) {
+				BOOST_LOG_TRIVIAL(error) << "upgrade: " << e.what();
+				do_upgrade_accept();
+				return;
+			}
+			do_upgrade_confirm(peer);
+		});
+	};
+	do_upgrade_accept = [&]() {
+		upgrade_acceptor.async_accept([&](const auto & ec, auto peer) {
+			if (ec)
+				return;
+			if (!upgrade_peer_allowed(peer)) {
+				do_upgrade_accept();
+				return;
+			}
+			do_upgrade(std::move(peer));
+		});
+	};
+	if (!upgrade_socket.empty()) {
+		try {
+			std::remove(upgrade_socket.c_str());
+			upgrade_acceptor.open();
+			upgrade_acceptor.bind(upgrade_socket);
+			upgrade_acceptor.listen();
+		} catch (const std::exception & e) {
+			std::cerr << PROJECT_NAME << ": upgrade: " << e.what() << "\n";
+			return EXIT_FAILURE;
+		}
+		do_upgrade_accept();
 	}
+#endif
+
+	const auto run = [&tunnels, &settings, busy_poll](asio::io_context & ioc, size_t index) {
+		if (!settings.cpus.empty()) {
+			const auto cpu = settings.cpus[index];
+			if (auto err = wg::tunnel::pin_thread(cpu))
+				BOOST_LOG_TRIVIAL(warning) << "cpu-affinity: Couldn't pin thread to CPU " << cpu
+				                           << ": " << std::generic_category().message(err);
+		}
+		// Ring is allocated by the thread which writes to it
+		wg::tunnel::capture::attach();
+		for (auto & t : tunnels)
+			if (&t->ioc() == &ioc)
+				t->run();
+		// Failures are handled by the session which hit them, so an exception
+		// which escapes a handler must not restart the tunnels of other sessions
+		for (;;) {
+			try {
+				if (busy_poll > 0)
+					wg::tunnel::run_busy_poll(ioc, std::chrono::microseconds(busy_poll));
+				else
+					ioc.run();
+				return;
+			} catch (const std::exception & e) {
+				std::cerr << PROJECT_NAME << ": " << e.what() << "\n";
+			}
+		}
+	};
+
+	// Take the data path logging off the worker threads
+	const wg::tunnel::log::drain log_drain;
+	std::vector<std::thread> workers;
+	for (size_t i = 1; i < iocs.size(); i++)
+		workers.emplace_back(run, std::ref(*iocs[i]), i);
+	run(*iocs.front(), 0);
+	for (auto & worker : workers)
+		worker.join();
+#if defined(SIGUSR2)
+	if (capture_thread.joinable())
+		capture_thread.join();
+#endif
 
 	return EXIT_SUCCESS;
 }
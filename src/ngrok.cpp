@@ -85,6 +85,15 @@ auto endpoint::address() const -> asio::ip::address {
 	return {};
 }
 
+auto endpoint::tcp_endpoints() const -> std::vector<asio::ip::tcp::endpoint> {
+	asio::io_context ioc;
+	asio::ip::tcp::resolver resolver(ioc);
+	std::vector<asio::ip::tcp::endpoint> eps;
+	for (auto & ep : resolver.resolve(host, std::to_string(port)))
+		eps.push_back(ep.endpoint());
+	return eps;
+}
+
 auto endpoint::uri() const -> std::string {
 	return protocol_to_string(proto) + "://" + host + ":" + std::to_string(port);
 }
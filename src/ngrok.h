@@ -36,6 +36,8 @@ struct endpoint {
 	etype type;
 
 	[[nodiscard]] auto address() const -> asio::ip::address;
+	// Get all TCP endpoints the host name resolves to
+	[[nodiscard]] auto tcp_endpoints() const -> std::vector<asio::ip::tcp::endpoint>;
 	[[nodiscard]] auto uri() const -> std::string;
 
 	friend auto operator<<(std::ostream & os, const endpoint & ep) -> std::ostream & {
@@ -0,0 +1,41 @@
+// wg-tcp-tunnel - ping.cpp
+// SPDX-FileCopyrightText: 2023-2025 Arkadiusz Bokowy and contributors
+// SPDX-License-Identifier: MIT
+
+#include "ping.h"
+
+#include <chrono>
+#include <cstdint>
+
+#include "utils.hpp"
+
+namespace wg::tunnel {
+
+auto ping_tracker::timestamp() -> uint64_t {
+	const auto now = clock::now().time_since_epoch();
+	return std::chrono::duration_cast<std::chrono::microseconds>(now).count();
+}
+
+auto ping_tracker::ping() -> utils::ctrl::ping {
+	m_missed++;
+	return { timestamp() };
+}
+
+auto ping_tracker::pong(const utils::ctrl::ping & body) -> clock::duration {
+	const auto now = timestamp();
+	// Ignore pongs which do not echo our timestamp
+	if (body.m_timestamp > now)
+		return m_rtt;
+	m_missed = 0;
+	m_rtt = std::chrono::microseconds(now - body.m_timestamp);
+	// Smooth the RTT the same way as TCP does (RFC 6298)
+	m_srtt = m_srtt.count() == 0 ? m_rtt : (7 * m_srtt + m_rtt) / 8;
+	return m_rtt;
+}
+
+auto ping_tracker::reset() -> void {
+	m_missed = 0;
+	m_rtt = m_srtt = clock::duration::zero();
+}
+
+}; // namespace wg::tunnel
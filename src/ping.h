@@ -0,0 +1,41 @@
+// wg-tcp-tunnel - ping.h
+// SPDX-FileCopyrightText: 2023-2025 Arkadiusz Bokowy and contributors
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+#include "utils.hpp"
+
+namespace wg::tunnel {
+
+// Tracker of the in-band ping/pong exchange used for RTT measurement
+class ping_tracker {
+public:
+	using clock = std::chrono::steady_clock;
+
+	// Get the body of the next ping and count it as outstanding
+	auto ping() -> utils::ctrl::ping;
+	// Process the pong echoed by the peer, return the measured RTT
+	auto pong(const utils::ctrl::ping & body) -> clock::duration;
+	// Reset the state, e.g. after reconnection
+	auto reset() -> void;
+
+	// Number of consecutive pings which were not answered
+	[[nodiscard]] auto missed() const -> unsigned int { return m_missed; }
+	[[nodiscard]] auto rtt() const -> clock::duration { return m_rtt; }
+	[[nodiscard]] auto srtt() const -> clock::duration { return m_srtt; }
+
+	// Get the current timestamp for the ping body
+	static auto timestamp() -> uint64_t;
+
+private:
+	unsigned int m_missed = 0;
+	// Last and smoothed round-trip time
+	clock::duration m_rtt{ 0 };
+	clock::duration m_srtt{ 0 };
+};
+
+}; // namespace wg::tunnel
@@ -0,0 +1,43 @@
+// wg-tcp-tunnel - probe.h
+// SPDX-FileCopyrightText: 2023-2025 Arkadiusz Bokowy and contributors
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+#if ENABLE_USDT
+#	include <sys/sdt.h>
+#endif
+
+namespace wg::tunnel::probe {
+
+// Identifier of the session passed to the probes
+template <typename T> auto id(const T * session) -> std::uintptr_t {
+	return reinterpret_cast<std::uintptr_t>(session);
+}
+
+// Time point in nanoseconds, on Linux the steady clock is CLOCK_MONOTONIC,
+// so it can be compared with the nsecs builtin of bpftrace
+inline auto ns(std::chrono::steady_clock::time_point time) -> std::int64_t {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+}
+
+// Reference probe arguments, so they are not reported as unused
+template <typename... T> auto unused(const T &...) -> void {}
+
+}; // namespace wg::tunnel::probe
+
+// USDT static tracepoint of the wg_tcp_tunnel provider. The probe is a single
+// NOP instruction when no tracer is attached, arguments shall be cheap to get.
+// Without USDT support the arguments are not evaluated at all.
+#if ENABLE_USDT
+#	define WGTT_PROBE(name, ...) STAP_PROBEV(wg_tcp_tunnel, name, __VA_ARGS__)
+#else
+#	define WGTT_PROBE(name, ...)                         \
+		do {                                              \
+			if (false)                                    \
+				::wg::tunnel::probe::unused(__VA_ARGS__); \
+		} while (0)
+#endif
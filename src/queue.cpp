@@ -0,0 +1,213 @@
+// wg-tcp-tunnel - queue.cpp
+// SPDX-FileCopyrightText: 2023-2025 Arkadiusz Bokowy and contributors
+// SPDX-License-Identifier: MIT
+
+#include "queue.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <deque>
+#include <utility>
+#include <vector>
+
+#include "utils.hpp"
+
+namespace wg::tunnel {
+
+auto packet::frame(size_t payload_length) -> void {
+	offset = header_size;
+	length = payload_length;
+	priority = utils::wireguard::is_control_message(buffer.data() + offset, length);
+	timestamp = clock::now();
+}
+
+auto packet::frame(size_t payload_length, uint16_t src_port, uint16_t dst_port) -> void {
+	frame(payload_length);
+	utils::ip::udp::header header(src_port, dst_port, static_cast<uint16_t>(payload_length));
+	std::memcpy(buffer.data(), &header, sizeof(header));
+	offset = 0;
+	length += header_size;
+	// Tunnel control packets (no payload) shall not wait behind the data
+	priority = priority || payload_length == 0;
+}
+
+auto packet::frame(utils::ctrl::type type, const void * body, size_t body_length) -> void {
+	if (body_length > 0)
+		std::memcpy(buffer.data() + header_size, body, body_length);
+	frame(0, 0, static_cast<uint16_t>(type));
+	length += body_length;
+}
+
+// Buffers which can be reused for new packets. The pool is shared by all
+// queues served by the same thread, so it does not require any locking.
+static thread_local std::vector<packet> free_pool;
+
+auto egress_queue::acquire() -> packet {
+	if (free_pool.empty()) {
+		packet pkt;
+		pkt.buffer.resize(packet::header_size + packet::payload_size_max);
+		return pkt;
+	}
+	auto pkt = std::move(free_pool.back());
+	free_pool.pop_back();
+	return pkt;
+}
+
+auto egress_queue::release(packet && pkt) -> void {
+	// Excess buffers are freed, so the memory footprint stays bounded
+	if (free_pool.size() < free_max)
+		free_pool.push_back(std::move(pkt));
+}
+
+auto egress_queue::push(packet && pkt) -> bool {
+	if (pkt.priority) {
+		// Control messages are small and rare, so they are never dropped
+		// unless the control lane itself went out of bounds.
+		if (m_bytes + pkt.length > 2 * m_limit) {
+			m_dropped++;
+			release(std::move(pkt));
+			return false;
+		}
+		m_bytes += pkt.length;
+		m_lane_ctrl.push_back(std::move(pkt));
+		return true;
+	}
+	if (m_bytes + pkt.length > m_limit ||
+	    (m_budget != nullptr && !m_budget->reserve(pkt.buffer.size()))) {
+		m_dropped++;
+		release(std::move(pkt));
+		return false;
+	}
+	m_bytes += pkt.length;
+	m_lane_data.push_back(std::move(pkt));
+	return true;
+}
+
+auto egress_queue::dequeue_data() -> packet {
+	auto pkt = std::move(m_lane_data.front());
+	m_lane_data.pop_front();
+	m_bytes -= pkt.length;
+	if (m_budget != nullptr)
+		m_budget->release(pkt.buffer.size());
+	return pkt;
+}
+
+auto egress_queue::pop(std::vector<packet> & batch) -> void {
+	if (m_codel.target.count() > 0)
+		codel_dequeue();
+	size_t length = 0;
+	while (!m_lane_ctrl.empty()) {
+		auto & pkt = m_lane_ctrl.front();
+		if (!batch.empty() && length + pkt.length > m_coalesce)
+			return;
+		length += pkt.length;
+		m_bytes -= pkt.length;
+		batch.push_back(std::move(pkt));
+		m_lane_ctrl.pop_front();
+	}
+	while (!m_lane_data.empty()) {
+		if (!batch.empty() && length + m_lane_data.front().length > m_coalesce)
+			return;
+		length += m_lane_data.front().length;
+		batch.push_back(dequeue_data());
+	}
+}
+
+auto egress_queue::codel_ok_to_drop(packet::clock::time_point now) -> bool {
+	const auto & pkt = m_lane_data.front();
+	// Do not drop if the packet was not delayed or the queue holds less than
+	// a single maximum-size packet, because there is no standing queue then.
+	if (now - pkt.timestamp < m_codel.target ||
+	    m_bytes <= packet::header_size + packet::payload_size_max) {
+		m_codel.first_above_time = {};
+		return false;
+	}
+	if (m_codel.first_above_time == packet::clock::time_point()) {
+		m_codel.first_above_time = now + m_codel.interval;
+		return false;
+	}
+	return now >= m_codel.first_above_time;
+}
+
+auto egress_queue::codel_control_law(packet::clock::time_point time) const
+    -> packet::clock::time_point {
+	const auto interval = std::chrono::duration<double>(m_codel.interval);
+	return time + std::chrono::duration_cast<packet::clock::duration>(
+	                  interval / std::sqrt(static_cast<double>(m_codel.count)));
+}
+
+auto egress_queue::codel_dequeue() -> void {
+
+	const auto now = packet::clock::now();
+	const auto drop = [this]() {
+		release(dequeue_data());
+		m_codel.dropped++;
+	};
+
+	if (m_lane_data.empty()) {
+		m_codel.first_above_time = {};
+		m_codel.dropping = false;
+		return;
+	}
+
+	auto ok_to_drop = codel_ok_to_drop(now);
+	if (m_codel.dropping) {
+		if (!ok_to_drop) {
+			// Sojourn time below target, leave the dropping state
+			m_codel.dropping = false;
+			return;
+		}
+		while (m_codel.dropping && now >= m_codel.drop_next) {
+			drop();
+			m_codel.count++;
+			if (m_lane_data.empty() || !codel_ok_to_drop(now)) {
+				m_codel.dropping = false;
+				return;
+			}
+			m_codel.drop_next = codel_control_law(m_codel.drop_next);
+		}
+		return;
+	}
+
+	if (ok_to_drop) {
+		drop();
+		m_codel.dropping = true;
+		// If we were recently in the dropping state, start with the drop rate
+		// close to the one which was previously controlling the queue.
+		const auto delta = m_codel.count - m_codel.count_last;
+		if (delta > 1 && now - m_codel.drop_next < 16 * m_codel.interval)
+			m_codel.count = delta;
+		else
+			m_codel.count = 1;
+		m_codel.count_last = m_codel.count;
+		m_codel.drop_next = codel_control_law(now);
+	}
+}
+
+auto egress_queue::clear() -> void {
+	while (!m_lane_data.empty())
+		release(dequeue_data());
+	for (auto & pkt : m_lane_ctrl)
+		release(std::move(pkt));
+	m_lane_ctrl.clear();
+	m_bytes = 0;
+}
+
+auto egress_queue::clear_ctrl_frames() -> void {
+	std::deque<packet> kept;
+	for (auto & pkt : m_lane_ctrl) {
+		utils::ip::udp::header header(0, 0, 0);
+		if (pkt.offset == 0 && pkt.length >= sizeof(header))
+			std::memcpy(&header, pkt.buffer.data(), sizeof(header));
+		if (utils::ctrl::get_type(header) == utils::ctrl::type::none) {
+			kept.push_back(std::move(pkt));
+			continue;
+		}
+		m_bytes -= pkt.length;
+		release(std::move(pkt));
+	}
+	m_lane_ctrl = std::move(kept);
+}
+
+}; // namespace wg::tunnel
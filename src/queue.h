@@ -0,0 +1,171 @@
+// wg-tcp-tunnel - queue.h
+// SPDX-FileCopyrightText: 2023-2025 Arkadiusz Bokowy and contributors
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <deque>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include "utils.hpp"
+
+namespace wg::tunnel {
+
+namespace asio = boost::asio;
+using std::size_t;
+
+// Datagram waiting in the egress queue for the TCP write
+struct packet {
+
+	using clock = std::chrono::steady_clock;
+
+	// Maximum size of the datagram payload
+	static constexpr size_t payload_size_max = 4096;
+	static constexpr size_t header_size = sizeof(utils::ip::udp::header);
+
+	// Buffer for the payload with a space reserved for the framing header
+	std::vector<char> buffer;
+	// Offset and length of the data which shall be written
+	size_t offset = header_size;
+	size_t length = 0;
+	// Time at which the packet was enqueued
+	clock::time_point timestamp;
+	// Whether the packet shall be sent ahead of the bulk data
+	bool priority = false;
+
+	[[nodiscard]] auto payload() -> asio::mutable_buffer {
+		return asio::buffer(buffer.data() + header_size, payload_size_max);
+	}
+	[[nodiscard]] auto data() const -> asio::const_buffer {
+		return asio::buffer(buffer.data() + offset, length);
+	}
+
+	// Prepare packet with the given payload length for sending without framing
+	auto frame(size_t payload_length) -> void;
+	// Prepare packet with the given payload length for sending with framing header
+	auto frame(size_t payload_length, uint16_t src_port, uint16_t dst_port) -> void;
+	// Prepare extended control frame with the given body
+	auto frame(utils::ctrl::type type, const void * body, size_t body_length) -> void;
+};
+
+// Memory budget shared by multiple egress queues, the accounting is atomic,
+// so queues can be served by different worker threads
+class memory_budget {
+public:
+	// Set the budget size, zero for unlimited
+	auto limit(size_t bytes) -> void { m_limit = bytes; }
+	[[nodiscard]] auto limit() const -> size_t { return m_limit; }
+	[[nodiscard]] auto used() const -> size_t { return m_used.load(std::memory_order_relaxed); }
+
+	// Check whether the given amount of memory can be reserved
+	[[nodiscard]] auto available(size_t bytes) const -> bool {
+		return m_limit == 0 || used() + bytes <= m_limit;
+	}
+	// Reserve memory, return false if the budget would be exceeded
+	auto reserve(size_t bytes) -> bool {
+		auto used = m_used.load(std::memory_order_relaxed);
+		do {
+			if (m_limit != 0 && used + bytes > m_limit)
+				return false;
+		} while (!m_used.compare_exchange_weak(used, used + bytes, std::memory_order_relaxed));
+		return true;
+	}
+	auto release(size_t bytes) -> void { m_used.fetch_sub(bytes, std::memory_order_relaxed); }
+	// Account memory which can not be refused, e.g. buffers held by the kernel
+	auto add(size_t bytes) -> void { m_used.fetch_add(bytes, std::memory_order_relaxed); }
+
+private:
+	size_t m_limit = 0;
+	std::atomic<size_t> m_used{ 0 };
+};
+
+// Egress queue with a strict-priority lane for WireGuard control messages
+class egress_queue {
+public:
+	// Maximum number of buffers kept for reuse by all queues of a single thread
+	static constexpr size_t free_max = 256;
+
+	// Limit for not sent bytes in the kernel socket buffer when AQM is enabled,
+	// so the standing queue builds up in user space where it can be managed
+	static constexpr int aqm_notsent_lowat = 16 * 1024;
+
+	egress_queue() = default;
+	~egress_queue() { clear(); }
+
+	// Get an empty packet, possibly reusing a previously released buffer
+	static auto acquire() -> packet;
+	// Return packet buffer for later reuse
+	static auto release(packet && pkt) -> void;
+
+	// Enqueue the packet, return false if it was dropped
+	auto push(packet && pkt) -> bool;
+	// Dequeue packets up to the coalescing size (at least one packet)
+	auto pop(std::vector<packet> & batch) -> void;
+	// Drop all queued packets
+	auto clear() -> void;
+	// Drop queued extended control frames, which are valid only for the
+	// connection on which they were about to be sent
+	auto clear_ctrl_frames() -> void;
+
+	[[nodiscard]] auto empty() const -> bool { return m_lane_ctrl.empty() && m_lane_data.empty(); }
+	[[nodiscard]] auto bytes() const -> size_t { return m_bytes; }
+	[[nodiscard]] auto dropped() const -> size_t { return m_dropped; }
+	[[nodiscard]] auto dropped_aqm() const -> size_t { return m_codel.dropped; }
+
+	// Set the limit for the number of queued bytes
+	auto limit(size_t bytes) -> void { m_limit = bytes; }
+	// Account buffers of the queued data packets in the shared budget
+	auto budget(memory_budget * budget) -> void { m_budget = budget; }
+	// Set the maximum number of bytes coalesced into a single write
+	auto coalesce(size_t bytes) -> void { m_coalesce = bytes; }
+	[[nodiscard]] auto coalesce() const -> size_t { return m_coalesce; }
+	// Enable CoDel active queue management, zero target disables AQM
+	auto aqm_codel(packet::clock::duration target, packet::clock::duration interval) -> void {
+		m_codel.target = target;
+		m_codel.interval = interval;
+	}
+
+private:
+	// State of the CoDel (RFC 8289) controller for the data lane
+	struct codel {
+		packet::clock::duration target{ 0 };
+		packet::clock::duration interval{ 0 };
+		packet::clock::time_point first_above_time;
+		packet::clock::time_point drop_next;
+		unsigned int count = 0;
+		unsigned int count_last = 0;
+		bool dropping = false;
+		// Number of packets dropped by the controller
+		size_t dropped = 0;
+	};
+
+	// Check whether the data lane head shall be dropped due to its sojourn time
+	auto codel_ok_to_drop(packet::clock::time_point now) -> bool;
+	auto codel_control_law(packet::clock::time_point time) const -> packet::clock::time_point;
+	// Drop packets from the data lane head according to the CoDel controller
+	auto codel_dequeue() -> void;
+	// Remove packet from the head of the data lane
+	auto dequeue_data() -> packet;
+
+	// Strict-priority lane for handshake and cookie messages
+	std::deque<packet> m_lane_ctrl;
+	// Lane for the bulk transport data
+	std::deque<packet> m_lane_data;
+	// Number of bytes currently queued
+	size_t m_bytes = 0;
+	// Maximum number of queued bytes
+	size_t m_limit = 256 * 1024;
+	// Maximum number of bytes dequeued at once
+	size_t m_coalesce = 64 * 1024;
+	// Number of packets dropped due to the queue limit
+	size_t m_dropped = 0;
+	codel m_codel;
+	memory_budget * m_budget = nullptr;
+};
+
+}; // namespace wg::tunnel
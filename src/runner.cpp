@@ -0,0 +1,90 @@
+// wg-tcp-tunnel - runner.cpp
+// SPDX-FileCopyrightText: 2023-2025 Arkadiusz Bokowy and contributors
+// SPDX-License-Identifier: MIT
+
+#include "runner.h"
+
+#include <cerrno>
+#include <chrono>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#if defined(__linux__)
+#	include <pthread.h>
+#	include <sched.h>
+#endif
+
+namespace wg::tunnel {
+
+auto run_busy_poll(asio::io_context & ioc, std::chrono::microseconds idle) -> void {
+	using clock = std::chrono::steady_clock;
+	auto last = clock::now();
+	for (;;) {
+		if (ioc.poll() > 0) {
+			last = clock::now();
+			continue;
+		}
+		// Context was stopped or it has run out of work
+		if (ioc.stopped())
+			return;
+		if (clock::now() - last < idle) {
+			// On an isolated CPU yield returns immediately, otherwise it lets
+			// other threads run instead of burning the whole time slice
+			std::this_thread::yield();
+			continue;
+		}
+		// Nothing to do for a while, so block until the next event
+		if (ioc.run_one() == 0)
+			return;
+		last = clock::now();
+	}
+}
+
+auto pin_thread(unsigned int cpu) -> int {
+#if defined(__linux__)
+	if (cpu >= CPU_SETSIZE)
+		return EINVAL;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return ::pthread_setaffinity_np(::pthread_self(), sizeof(set), &set);
+#else
+	(void)cpu;
+	return ENOTSUP;
+#endif
+}
+
+auto parse_cpu_list(const std::string & list) -> std::vector<unsigned int> {
+	// Upper bound, so the typo in the range does not blow up the list
+	constexpr unsigned long cpu_max = 65536;
+	std::vector<unsigned int> cpus;
+	std::istringstream is(list);
+	std::string item;
+	while (std::getline(is, item, ',')) {
+		size_t pos = 0;
+		const auto first = std::stoul(item, &pos);
+		if (first >= cpu_max)
+			throw std::invalid_argument("Invalid CPU list: " + list);
+		auto last = first;
+		if (pos < item.size()) {
+			if (item[pos] != '-')
+				throw std::invalid_argument("Invalid CPU list: " + list);
+			const auto rest = item.substr(pos + 1);
+			last = std::stoul(rest, &pos);
+			if (pos != rest.size() || last < first || last >= cpu_max)
+				throw std::invalid_argument("Invalid CPU list: " + list);
+		}
+		for (auto cpu = first; cpu <= last; cpu++)
+			cpus.push_back(static_cast<unsigned int>(cpu));
+	}
+	if (cpus.empty())
+		throw std::invalid_argument("Invalid CPU list: " + list);
+	return cpus;
+}
+
+}; // namespace wg::tunnel
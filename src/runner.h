@@ -0,0 +1,29 @@
+// wg-tcp-tunnel - runner.h
+// SPDX-FileCopyrightText: 2023-2025 Arkadiusz Bokowy and contributors
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+namespace wg::tunnel {
+
+namespace asio = boost::asio;
+
+// Run the I/O context in the busy-polling mode. Ready handlers are polled
+// without sleeping in the reactor, so the wakeup latency is not paid for
+// every packet. Once nothing was ready for the given idle time, the thread
+// falls back to the blocking wait until the next event.
+auto run_busy_poll(asio::io_context & ioc, std::chrono::microseconds idle) -> void;
+
+// Pin the calling thread to the given CPU, return errno on failure
+auto pin_thread(unsigned int cpu) -> int;
+
+// Parse list of CPUs given as comma-separated numbers or ranges, e.g. "2,4-7"
+auto parse_cpu_list(const std::string & list) -> std::vector<unsigned int>;
+
+}; // namespace wg::tunnel
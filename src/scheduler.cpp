@@ -0,0 +1,223 @@
+// wg-tcp-tunnel - scheduler.cpp
+// SPDX-FileCopyrightText: 2023-2025 Arkadiusz Bokowy and contributors
+// SPDX-License-Identifier: MIT
+
+#include "scheduler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include <boost/asio.hpp>
+
+namespace wg::tunnel {
+
+token_bucket::token_bucket(size_t rate, size_t burst)
+    : m_rate(static_cast<double>(rate)), m_burst(static_cast<double>(burst)), m_tokens(m_burst),
+      m_last(clock::now()) {}
+
+auto token_bucket::consume(size_t bytes) -> clock::duration {
+	if (!enabled())
+		return clock::duration::zero();
+	const auto now = clock::now();
+	const auto elapsed = std::chrono::duration<double>(now - m_last).count();
+	m_tokens = std::min(m_burst, m_tokens + elapsed * m_rate);
+	m_last = now;
+	// Allow the bucket to go into debt, so the packet which does not fit
+	// into the bucket can be sent after the debt is paid off.
+	m_tokens -= static_cast<double>(bytes);
+	if (m_tokens >= 0)
+		return clock::duration::zero();
+	return std::chrono::duration_cast<clock::duration>(
+	    std::chrono::duration<double>(-m_tokens / m_rate));
+}
+
+auto rate_limit::from_string(const std::string_view str) -> rate_limit {
+
+	rate_limit rl;
+	const auto at = str.find('@');
+	auto rate = str.substr(0, at);
+
+	size_t multiplier = 1;
+	switch (rate.empty() ? '\0' : rate.back()) {
+	case 'k':
+	case 'K':
+		multiplier = 1000;
+		break;
+	case 'm':
+	case 'M':
+		multiplier = 1000 * 1000;
+		break;
+	case 'g':
+	case 'G':
+		multiplier = 1000 * 1000 * 1000;
+		break;
+	}
+	if (multiplier != 1)
+		rate.remove_suffix(1);
+
+	size_t pos = 0;
+	const auto value = std::stoull(std::string(rate), &pos);
+	if (pos != rate.size() || value == 0)
+		throw std::invalid_argument("Invalid rate: " + std::string(rate));
+	rl.rate = value * multiplier / 8;
+
+	if (at == std::string_view::npos)
+		return rl;
+
+	auto prefix = str.substr(at + 1);
+	auto slash = prefix.find('/');
+	rl.prefix = asio::ip::make_address(std::string(prefix.substr(0, slash)));
+	const unsigned int length_max = rl.prefix.is_v4() ? 32 : 128;
+	rl.prefix_length = length_max;
+	if (slash != std::string_view::npos)
+		rl.prefix_length = std::stoul(std::string(prefix.substr(slash + 1)));
+	if (rl.prefix_length > length_max)
+		throw std::invalid_argument("Invalid prefix length: " + std::string(prefix));
+
+	return rl;
+}
+
+auto rate_limit::match(const asio::ip::address & addr) const -> bool {
+
+	// Rate limit without prefix matches all addresses
+	if (prefix.is_unspecified())
+		return true;
+
+	auto address = addr;
+	if (address.is_v6() && address.to_v6().is_v4_mapped())
+		address = address.to_v6().to_v4();
+	if (address.is_v4() != prefix.is_v4())
+		return false;
+
+	const auto compare = [this](const auto & a, const auto & b) {
+		auto bits = prefix_length;
+		for (size_t i = 0; i < a.size() && bits > 0; i++, bits -= std::min(bits, 8U)) {
+			const auto mask = static_cast<unsigned char>(0xFF << (8 - std::min(bits, 8U)));
+			if ((a[i] & mask) != (b[i] & mask))
+				return false;
+		}
+		return true;
+	};
+
+	if (address.is_v4())
+		return compare(address.to_v4().to_bytes(), prefix.to_v4().to_bytes());
+	return compare(address.to_v6().to_bytes(), prefix.to_v6().to_bytes());
+}
+
+auto drr_scheduler::schedule(std::shared_ptr<flow> f, size_t cost) -> void {
+	f->m_drr_cost = cost;
+	if (auto wait = f->m_drr_rate.consume(cost); wait.count() > 0) {
+		f->m_drr_throttled += cost;
+		m_throttled += cost;
+		f->m_drr_rate_timer.expires_after(wait);
+		f->m_drr_rate_timer.async_wait([this, f](const auto & ec) {
+			if (!ec)
+				activate(f);
+		});
+		return;
+	}
+	activate(std::move(f));
+}
+
+auto drr_scheduler::activate(std::shared_ptr<flow> f) -> void {
+	// Every flow has at most one packet waiting, so the flow which was not
+	// re-activated shortly after its last dispatch has become idle, and it
+	// must not keep the unused deficit
+	f->m_drr_rearmed = recent(*f);
+	if (!f->m_drr_rearmed)
+		f->m_drr_deficit = 0;
+	if (m_running) {
+		m_active.push_back(std::move(f));
+		return;
+	}
+	m_running = true;
+	const auto served = m_served[0] + m_served[1];
+	if (served - std::min<size_t>(served, counted(*f) ? 1 : 0) == 0) {
+		// Without any competition the flow is served right away, flows which
+		// are activated during the dispatch wait for the next round
+		next_round();
+		f->m_drr_deficit = 0;
+		dispatch(*f);
+		if (m_active.empty()) {
+			m_running = false;
+			return;
+		}
+	} else {
+		m_active.push_back(std::move(f));
+	}
+	asio::post(m_io_context, [this]() { run(); });
+}
+
+auto drr_scheduler::dispatch(flow & f) -> void {
+	f.m_drr_round = m_round;
+	f.m_drr_backlogged = f.m_drr_rearmed;
+	if (f.m_drr_backlogged)
+		m_served[0]++;
+	f.drr_dispatch();
+}
+
+auto drr_scheduler::next_round() -> size_t {
+	size_t rearmed = 0;
+	for (const auto & f : m_active)
+		rearmed += counted(*f) ? 1 : 0;
+	const auto served = m_served[0] + m_served[1];
+	m_round++;
+	m_served[1] = m_served[0];
+	m_served[0] = 0;
+	return served - std::min(served, rearmed);
+}
+
+auto drr_scheduler::run() -> void {
+
+	// Flows which were served recently and are still reading their next
+	// packet compete for the bandwidth as well, e.g. the flow sending small
+	// packets must not lose its turn just because it was not fast enough
+	const auto reading = next_round();
+	const auto count = m_active.size();
+	const bool competition = count + reading > 1;
+
+	// Skip rounds in which no flow would be served, so the quantum can be
+	// much smaller than the maximum packet without spinning
+	size_t rounds = 1;
+	if (count > 1 && reading == 0) {
+		rounds = std::numeric_limits<size_t>::max();
+		for (const auto & f : m_active) {
+			const auto needed = f->m_drr_cost - std::min(f->m_drr_cost, f->m_drr_deficit);
+			rounds = std::min(rounds, std::max<size_t>(1, (needed + m_quantum - 1) / m_quantum));
+		}
+	}
+
+	// Serve every flow which was active at the beginning of the round. Flows
+	// which are dispatched start asynchronous operations, so they will not
+	// be re-activated before the next round.
+	for (auto n = count; n > 0; n--) {
+		auto f = std::move(m_active.front());
+		m_active.pop_front();
+		f->m_drr_deficit += rounds * m_quantum;
+		// Without any competition there is no need to wait for the deficit
+		if (f->m_drr_deficit < f->m_drr_cost && competition) {
+			m_active.push_back(std::move(f));
+			continue;
+		}
+		// Unused deficit is kept as long as the flow stays backlogged, but not
+		// more than a single quantum, so it can not be saved up for a burst
+		f->m_drr_deficit -= std::min(f->m_drr_deficit, f->m_drr_cost);
+		f->m_drr_deficit = std::min(f->m_drr_deficit, m_quantum);
+		dispatch(*f);
+	}
+
+	if (m_active.empty()) {
+		m_running = false;
+		return;
+	}
+
+	// Let other handlers run before the next round
+	asio::post(m_io_context, [this]() { run(); });
+}
+
+}; // namespace wg::tunnel
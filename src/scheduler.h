@@ -0,0 +1,139 @@
+// wg-tcp-tunnel - scheduler.h
+// SPDX-FileCopyrightText: 2023-2025 Arkadiusz Bokowy and contributors
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <ostream>
+#include <string_view>
+
+#include <boost/asio.hpp>
+
+namespace wg::tunnel {
+
+namespace asio = boost::asio;
+using std::size_t;
+
+// Token bucket rate limiter
+class token_bucket {
+public:
+	using clock = std::chrono::steady_clock;
+
+	token_bucket() = default;
+	// Create rate limiter with the rate given in bytes per second
+	token_bucket(size_t rate, size_t burst);
+
+	// Consume tokens and return the time to wait before the data can be sent
+	auto consume(size_t bytes) -> clock::duration;
+	[[nodiscard]] auto enabled() const -> bool { return m_rate > 0; }
+
+private:
+	// Refill rate in bytes per second and the bucket capacity
+	double m_rate = 0;
+	double m_burst = 0;
+	double m_tokens = 0;
+	clock::time_point m_last;
+};
+
+// Rate limit applied to sessions from the given address prefix
+struct rate_limit {
+
+	// Parse "RATE[@ADDRESS/PREFIX]" where RATE is given in bits per second
+	// with an optional k, M or G suffix
+	static auto from_string(const std::string_view str) -> rate_limit;
+
+	// Check whether the given address matches the prefix
+	[[nodiscard]] auto match(const asio::ip::address & addr) const -> bool;
+
+	// Rate in bytes per second
+	size_t rate = 0;
+	asio::ip::address prefix;
+	unsigned int prefix_length = 0;
+
+	friend auto operator<<(std::ostream & os, const rate_limit & rl) -> std::ostream & {
+		os << rl.rate * 8 << "bps";
+		if (!rl.prefix.is_unspecified())
+			os << "@" << rl.prefix.to_string() << "/" << rl.prefix_length;
+		return os;
+	}
+};
+
+// Deficit round-robin scheduler
+class drr_scheduler {
+public:
+	class flow {
+	public:
+		explicit flow(asio::io_context & ioc) : m_drr_rate_timer(ioc) {}
+		virtual ~flow() = default;
+
+		// Called by the scheduler when the flow was granted its turn
+		virtual auto drr_dispatch() -> void = 0;
+
+		auto drr_rate_limit(const token_bucket & rate) -> void { m_drr_rate = rate; }
+		[[nodiscard]] auto drr_throttled() const -> size_t { return m_drr_throttled; }
+
+	protected:
+		// Cancel pending rate limiter wait, e.g. when the flow is closed
+		auto drr_cancel() -> void { m_drr_rate_timer.cancel(); }
+
+	private:
+		friend class drr_scheduler;
+		size_t m_drr_deficit = 0;
+		size_t m_drr_cost = 0;
+		// Round in which the flow was dispatched last time, and whether the flow
+		// was backlogged at that time, i.e. it was re-activated right after the
+		// previous dispatch, so it is expected to be re-activated again soon
+		size_t m_drr_round = 0;
+		bool m_drr_backlogged = false;
+		bool m_drr_rearmed = false;
+		token_bucket m_drr_rate;
+		asio::steady_timer m_drr_rate_timer;
+		// Number of bytes which were delayed by the rate limiter
+		size_t m_drr_throttled = 0;
+	};
+
+	drr_scheduler(asio::io_context & ioc, size_t quantum)
+	    : m_io_context(ioc), m_quantum(quantum) {}
+	~drr_scheduler() = default;
+
+	// Schedule flow dispatch for the data of the given size
+	auto schedule(std::shared_ptr<flow> f, size_t cost) -> void;
+
+	[[nodiscard]] auto throttled() const -> size_t { return m_throttled; }
+
+private:
+	auto activate(std::shared_ptr<flow> f) -> void;
+	// Whether the flow was served in one of the last two rounds
+	[[nodiscard]] auto recent(const flow & f) const -> bool {
+		return m_round - f.m_drr_round <= 1;
+	}
+	// Whether the flow is counted in the recently served backlogged flows
+	[[nodiscard]] auto counted(const flow & f) const -> bool {
+		return f.m_drr_backlogged && recent(f);
+	}
+	// Start the next round and return the number of backlogged flows which
+	// were served recently, but which are not active
+	auto next_round() -> size_t;
+	auto dispatch(flow & f) -> void;
+	auto run() -> void;
+
+	asio::io_context & m_io_context;
+	// Number of bytes granted to every active flow in each round
+	size_t m_quantum;
+	// Flows waiting for their turn
+	std::deque<std::shared_ptr<flow>> m_active;
+	bool m_running = false;
+	// Number of the current round, and the number of backlogged flows served
+	// in the last two rounds, which might be still reading their next packet
+	size_t m_round = 0;
+	std::array<size_t, 2> m_served = {};
+	// Total number of bytes which were delayed by the rate limiters
+	size_t m_throttled = 0;
+};
+
+}; // namespace wg::tunnel
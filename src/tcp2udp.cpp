@@ -4,14 +4,22 @@
 
 #include "tcp2udp.h"
 
+#include <algorithm>
 #include <array>
+#include <chrono>
 #include <cstddef>
+#include <cstring>
 #include <functional>
 #include <memory>
+#include <random>
+#include <sstream>
+#include <string>
 
 #include <boost/asio.hpp>
-#include <boost/log/trivial.hpp>
 
+#include "capture.h"
+#include "log.h"
+#include "probe.h"
 #include "utils.hpp"
 
 namespace wg::tunnel {
@@ -22,101 +30,746 @@ namespace beast = boost::beast;
 namespace ws = beast::websocket;
 #endif
 using namespace std::placeholders;
-#define LOG(lvl) BOOST_LOG_TRIVIAL(lvl) << "tcp2udp::"
+#define LOG(lvl) WGTT_LOG(lvl) << "tcp2udp::"
 
 auto tcp2udp::run(utils::transport transport) -> void {
 	LOG(info) << "run: " << utils::to_string(m_ep_tcp_acc) << " >> "
 	          << utils::to_string(m_ep_udp_dest);
 	m_transport = transport;
+	// Options below are specific to TCP
+	const bool local = utils::is_local(m_ep_tcp_acc);
+	if (m_fast_open && !local) {
+		LOG(debug) << "tcp-fast-open [" << utils::to_string(m_ep_tcp_acc)
+		           << "]: qlen=" << fast_open_qlen;
+		if (auto err = utils::socket_set_fast_open(m_tcp_acceptor, fast_open_qlen))
+			LOG(warning) << "tcp-fast-open: Couldn't set TCP_FASTOPEN: " << err;
+	}
+	if (m_defer_accept_time > 0 && !local) {
+		LOG(debug) << "tcp-defer-accept [" << utils::to_string(m_ep_tcp_acc)
+		           << "]: time=" << m_defer_accept_time;
+		if (auto err = utils::socket_set_defer_accept(m_tcp_acceptor, m_defer_accept_time))
+			LOG(warning) << "tcp-defer-accept: Couldn't set TCP_DEFER_ACCEPT: " << err;
+	}
+	// Clients with application keep-alive send something at least that often
+	if (m_idle_timeout == 0 && m_app_keep_alive_idle_time > 0)
+		m_idle_timeout = 3 * m_app_keep_alive_idle_time;
+	// Synchronous accept shall not block, so pending connections can be
+	// accepted in batches without waiting for the next wakeup
+	m_tcp_acceptor.non_blocking(true);
 	do_accept();
 }
 
 auto tcp2udp::do_accept() -> void {
-	auto socket = std::make_shared<asio::ip::tcp::socket>(m_io_context);
 	m_tcp_acceptor.async_accept(m_io_context, [this](const auto & ec, auto && peer) {
 		do_accept_handler(ec, std::forward<decltype(peer)>(peer));
 	});
 }
 
-auto tcp2udp::do_accept_handler(const boost::system::error_code & ec, asio::ip::tcp::socket peer)
+auto tcp2udp::do_accept_handler(const boost::system::error_code & ec, utils::stream_socket peer)
     -> void {
+	// Listening socket was passed to the new process
+	if (ec == asio::error::operation_aborted && !m_tcp_acceptor.is_open())
+		return;
 	if (ec) {
 		LOG(error) << "accept [" << utils::to_string(m_ep_tcp_acc) << "]: " << ec.message();
 	} else {
+		do_wait(std::move(peer));
+		// Accept other pending connections right away
+		for (unsigned int i = 1; i < accept_batch_max; i++) {
+			boost::system::error_code ec2;
+			auto next = m_tcp_acceptor.accept(m_io_context, ec2);
+			if (ec2) {
+				if (ec2 != asio::error::would_block)
+					LOG(error) << "accept [" << utils::to_string(m_ep_tcp_acc)
+					           << "]: " << ec2.message();
+				break;
+			}
+			do_wait(std::move(next));
+		}
+	}
+	// Handle next TCP connection
+	do_accept();
+}
+
+auto tcp2udp::do_wait(utils::stream_socket peer) -> void {
+	while (!m_limits->available()) {
+		if (!do_evict()) {
+			LOG(warning) << "accept [" << utils::to_string(m_ep_tcp_acc)
+			             << "]: Session limit reached";
+			return;
+		}
+	}
+	// Destination probes of the client close the connection without sending
+	// anything, so the session is set up only once the first bytes arrive
+	auto conn = std::make_shared<pending_connection>(std::move(peer), m_limits);
+	m_pending.insert(conn);
+	conn->timer.expires_after(first_data_timeout);
+	conn->timer.async_wait([this, conn](const auto & ec) {
+		if (ec || m_pending.erase(conn) == 0)
+			return;
 		LOG(debug) << "accept [" << utils::to_string(m_ep_tcp_acc)
-		           << "]: New connection: peer=" << utils::to_string(peer.remote_endpoint());
-		if (m_tcp_keep_alive_idle_time > 0) {
-			// Setup TCP keep-alive on the session socket
-			LOG(debug) << "tcp-keepalive [" << utils::to_string(peer.remote_endpoint())
-			           << "]: idle=" << m_tcp_keep_alive_idle_time;
-			utils::socket_set_keep_alive_idle(peer, m_tcp_keep_alive_idle_time);
-			peer.set_option(asio::socket_base::keep_alive(true));
-			peer.set_option(asio::socket_base::linger(true, 0));
+		           << "]: No data received in time";
+		boost::system::error_code ec2;
+		conn->socket.close(ec2);
+	});
+	conn->socket.async_wait(utils::stream_socket::wait_read, [this, conn](const auto & ec) {
+		// Connection was closed on timeout or during the handoff
+		if (ec || m_pending.erase(conn) == 0)
+			return;
+		conn->timer.cancel();
+		conn->release();
+		boost::system::error_code ec2;
+		if (conn->socket.available(ec2) == 0) {
+			LOG(trace) << "accept [" << utils::to_string(m_ep_tcp_acc)
+			           << "]: Connection closed without data";
+			return;
 		}
-		// Start handling TCP packets
-		switch (m_transport) {
-		case utils::transport::raw:
-			std::make_shared<tcp::session_raw>(*this, std::move(peer))->run();
-			break;
+		do_session(std::move(conn->socket));
+	});
+}
+
+auto tcp2udp::do_session(utils::stream_socket peer) -> void {
+	// Connection might have been reset by the peer before it was accepted
+	boost::system::error_code ec;
+	const auto ep_remote = peer.remote_endpoint(ec);
+	if (ec) {
+		LOG(debug) << "accept [" << utils::to_string(m_ep_tcp_acc) << "]: " << ec.message();
+		return;
+	}
+	LOG(debug) << "accept [" << utils::to_string(m_ep_tcp_acc)
+	           << "]: New connection: peer=" << utils::to_string(ep_remote);
+	if (m_incoming_cpu)
+		LOG(debug) << "incoming-cpu [" << utils::to_string(ep_remote)
+		           << "]: cpu=" << utils::socket_get_incoming_cpu(peer);
+	// Options below are specific to TCP
+	const bool local = utils::is_local(m_ep_tcp_acc);
+	if (m_tcp_keep_alive_idle_time > 0 && !local) {
+		// Setup TCP keep-alive on the session socket
+		LOG(debug) << "tcp-keepalive [" << utils::to_string(ep_remote)
+		           << "]: idle=" << m_tcp_keep_alive_idle_time;
+		utils::socket_set_keep_alive_idle(peer, m_tcp_keep_alive_idle_time);
+		peer.set_option(asio::socket_base::keep_alive(true), ec);
+		if (!ec)
+			peer.set_option(asio::socket_base::linger(true, 0), ec);
+		if (ec)
+			LOG(warning) << "tcp-keepalive: Couldn't set SO_KEEPALIVE: " << ec.message();
+	}
+	if (m_aqm_codel_target > 0 && !local) {
+		// Keep the kernel send buffer shallow for the AQM to be effective
+		LOG(debug) << "aqm-codel [" << utils::to_string(ep_remote)
+		           << "]: target=" << m_aqm_codel_target << " interval=" << m_aqm_codel_interval;
+		if (auto err = utils::socket_set_notsent_lowat(peer, egress_queue::aqm_notsent_lowat))
+			LOG(warning) << "aqm-codel: Couldn't set TCP_NOTSENT_LOWAT: " << err;
+	}
+	m_socket_tuning.apply(peer);
+	// Forget sessions which are already gone
+	m_sessions.erase(std::remove_if(m_sessions.begin(), m_sessions.end(),
+	                                [](const auto & s) { return s.expired(); }),
+	                 m_sessions.end());
+	// Make room for the new session, only sessions of this tunnel can be
+	// evicted, because other tunnels are served by other workers
+	while (!m_limits->available() || !m_limits->memory().available(session_memory)) {
+		if (!do_evict()) {
+			LOG(warning) << "accept [" << utils::to_string(m_ep_tcp_acc)
+			             << "]: Session limit reached: peer=" << utils::to_string(ep_remote);
+			return;
+		}
+	}
+	std::shared_ptr<tcp::session> session;
+	switch (m_transport) {
+	case utils::transport::raw:
+		session = std::make_shared<tcp::session_raw>(*this, std::move(peer), ep_remote);
+		break;
 #if ENABLE_WEBSOCKET
-		case utils::transport::websocket:
-			std::make_shared<tcp::session_ws>(*this, std::move(peer))->run();
-			break;
+	case utils::transport::websocket:
+		session = std::make_shared<tcp::session_ws>(*this, std::move(peer), ep_remote);
+		break;
+#endif
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+	case utils::transport::seqpacket:
+		session = std::make_shared<tcp::session_seqpacket>(*this, std::move(peer), ep_remote);
+		break;
 #endif
+	}
+	if (auto err = session->connect()) {
+		LOG(error) << "accept [" << utils::to_string(ep_remote)
+		           << "]: Couldn't connect UDP socket: " << err.message();
+		return;
+	}
+	m_sessions.emplace_back(session);
+	WGTT_PROBE(tcp2udp_accept, session->id());
+	// Start handling TCP packets
+	session->run();
+}
+
+auto tcp2udp::do_evict() -> bool {
+
+	// Parked sessions are idle by definition, so they go first
+	auto parked = std::min_element(m_parked.begin(), m_parked.end(), [](auto & a, auto & b) {
+		return a.second->timer.expiry() < b.second->timer.expiry();
+	});
+	if (parked != m_parked.end()) {
+		boost::system::error_code ec;
+		LOG(debug) << "evict: Parked session: udp="
+		           << utils::to_string(parked->second->socket.local_endpoint(ec));
+		m_parked.erase(parked);
+		return true;
+	}
+
+	std::shared_ptr<tcp::session> oldest;
+	for (const auto & ptr : m_sessions)
+		if (auto session = ptr.lock(); session && session->is_open())
+			if (!oldest || session->idle_time() > oldest->idle_time())
+				oldest = std::move(session);
+	if (!oldest)
+		return false;
+
+	LOG(info) << "evict: " << oldest->stats();
+	oldest->evict();
+	return true;
+}
+
+auto tcp2udp::handoff(class handoff & state) -> void {
+	LOG(info) << "handoff [" << utils::to_string(m_ep_tcp_acc) << "]: Passing listening socket";
+	state.add_socket(m_handoff_key, handoff::duplicate(m_tcp_acceptor.native_handle()));
+}
+
+auto tcp2udp::handoff_sessions(class handoff & state, std::function<void()> handler) -> void {
+
+	LOG(info) << "handoff [" << utils::to_string(m_ep_tcp_acc) << "]: Passing sessions";
+	// Connections which arrive from now on will be accepted by the new process
+	boost::system::error_code ec;
+	m_tcp_acceptor.close(ec);
+	// Clients of connections which have not sent anything yet will reconnect
+	// to the new process
+	if (!m_pending.empty())
+		LOG(debug) << "handoff: Closing pending connections: count=" << m_pending.size();
+	for (const auto & conn : m_pending) {
+		conn->socket.close(ec);
+		conn->timer.cancel();
+	}
+	m_pending.clear();
+
+	const auto key = m_handoff_key;
+	auto pending = std::make_shared<size_t>(1);
+	const auto done = [pending, handler = std::move(handler)]() {
+		if (--*pending == 0)
+			handler();
+	};
+
+	for (const auto & ptr : m_sessions) {
+		auto session = ptr.lock();
+		if (!session || !session->is_open())
+			continue;
+		++*pending;
+		const auto captured = session->handoff([&state, key, done](auto s) {
+			if (s)
+				state.add_session(key, std::move(*s));
+			done();
+		});
+		if (!captured) {
+			LOG(debug) << "handoff: Session left for draining: " << session->stats();
+			done();
 		}
 	}
-	// Handle next TCP connection
-	do_accept();
+
+	done();
+}
+
+auto tcp2udp::adopt(std::vector<handoff::session> sessions) -> void {
+	for (auto & state : sessions) {
+		utils::stream_socket socket(m_io_context, m_ep_tcp_acc.protocol(), state.tcp);
+		// Peer might have disconnected during the handoff
+		boost::system::error_code ec;
+		const auto ep_remote = socket.remote_endpoint(ec);
+		if (ec) {
+			LOG(debug) << "adopt [" << utils::to_string(m_ep_tcp_acc) << "]: " << ec.message();
+			asio::ip::udp::socket udp(m_io_context, m_ep_udp_dest.protocol(), state.udp);
+			continue;
+		}
+		auto session = std::make_shared<tcp::session_raw>(*this, std::move(socket), ep_remote);
+		m_sessions.emplace_back(session);
+		session->run(std::move(state));
+	}
+}
+
+auto tcp2udp::sessions() const -> size_t {
+	return std::count_if(m_sessions.begin(), m_sessions.end(), [](const auto & s) {
+		auto session = s.lock();
+		return session && session->is_open();
+	});
+}
+
+auto tcp2udp::log_stats() -> void {
+	LOG(info) << "stats [" << utils::to_string(m_ep_tcp_acc) << "]: sessions=" << m_sessions.size()
+	          << " parked=" << m_parked.size() << " memory=" << m_limits->memory().used()
+	          << " throttled=" << m_scheduler.throttled();
+	for (const auto & ptr : m_sessions)
+		if (auto session = ptr.lock())
+			LOG(info) << "stats: " << session->stats();
+}
+
+auto tcp2udp::rate_limit_bucket(const asio::ip::address & addr) const -> token_bucket {
+	const rate_limit * match = nullptr;
+	for (const auto & rl : m_rate_limits)
+		if (rl.match(addr) && (match == nullptr || rl.prefix_length >= match->prefix_length))
+			match = &rl;
+	if (match == nullptr)
+		return {};
+	LOG(debug) << "rate-limit [" << addr.to_string() << "]: " << *match;
+	// Allow bursts of at least 100 ms worth of data
+	return { match->rate, std::max<size_t>(match->rate / 10, 64 * 1024) };
+}
+
+auto tcp2udp::park(const utils::ctrl::session & token, asio::ip::udp::socket socket) -> void {
+	auto & parked = m_parked[token.m_token];
+	parked = std::make_unique<parked_session>(std::move(socket), m_limits);
+	parked->timer.expires_after(std::chrono::seconds(m_resume_grace_time));
+	parked->timer.async_wait([this, key = token.m_token](const auto & ec) {
+		if (ec)
+			return;
+		// The session might have been resumed and parked again in the meantime
+		auto it = m_parked.find(key);
+		const auto now = asio::steady_timer::clock_type::now();
+		if (it == m_parked.end() || it->second->timer.expiry() > now)
+			return;
+		boost::system::error_code ec2;
+		LOG(debug) << "resume: Parked session expired: udp="
+		           << utils::to_string(it->second->socket.local_endpoint(ec2));
+		m_parked.erase(it);
+	});
+}
+
+auto tcp2udp::unpark(const utils::ctrl::session & token)
+    -> std::optional<asio::ip::udp::socket> {
+	auto it = m_parked.find(token.m_token);
+	if (it == m_parked.end())
+		return std::nullopt;
+	auto socket = std::move(it->second->socket);
+	m_parked.erase(it);
+	return socket;
+}
+
+auto tcp2udp::tcp::session::stats() -> std::string {
+	std::ostringstream str;
+	str << utils::to_string(m_socket_ep_remote) << " queue=" << m_queue.bytes()
+	    << " dropped=" << m_queue.dropped() << " aqm-dropped=" << m_queue.dropped_aqm()
+	    << " throttled=" << drr_throttled() << m_socket_ops << m_zerocopy;
+	boost::system::error_code ec;
+	if (auto sample = tcp_info_sample::sample(m_socket, ec); !ec)
+		str << " " << sample;
+	if (m_auto_tune)
+		str << " " << m_auto_tuner;
+	if (m_ping.srtt().count() > 0)
+		str << " ping-rtt="
+		    << std::chrono::duration_cast<std::chrono::microseconds>(m_ping.srtt()).count()
+		    << "us";
+	return str.str();
+}
+
+auto tcp2udp::tcp::session::connect() -> boost::system::error_code {
+	boost::system::error_code ec;
+	m_socket_udp_dest.connect(m_tcp2udp.m_ep_udp_dest, ec);
+	if (!ec)
+		do_describe();
+	return ec;
+}
+
+auto tcp2udp::tcp::session::do_describe() -> void {
+	// Sockets might be already closed, e.g. by the peer
+	boost::system::error_code ec;
+	const auto ep_tcp_local = m_socket.local_endpoint(ec);
+	const auto ep_udp_local = m_socket_udp_dest.local_endpoint(ec);
+	m_socket_ops.add(2);
+	// UDP socket is connected to the tunnel destination
+	const auto & ep_udp_remote = m_tcp2udp.m_ep_udp_dest;
+	m_desc.src_port = ep_udp_remote.port();
+	m_desc.dst_port = ep_udp_local.port();
+	m_desc.udp_local = ep_udp_local;
+	m_desc.name = utils::to_string(m_socket_ep_remote) + " >> " + utils::to_string(ep_udp_remote);
+	m_desc.name_verbose = utils::to_string(m_socket_ep_remote) + " -> " +
+	                      utils::to_string(ep_tcp_local) + " >> " +
+	                      utils::to_string(ep_udp_local) + " -> " +
+	                      utils::to_string(ep_udp_remote);
+}
+
+auto tcp2udp::tcp::session::do_close() -> void {
+	WGTT_PROBE(tcp2udp_close, id(), m_queue.bytes(), m_queue.dropped());
+	// Packets of zero-copy sends are held until the kernel completes them
+	m_zerocopy.retire(m_socket);
+	boost::system::error_code ec;
+	m_socket.close(ec);
+	// Stop UDP receiver if there is no TCP session
+	m_socket_udp_dest.cancel(ec);
+	m_auto_tune_timer.cancel();
+	m_ping_timer.cancel();
+	drr_cancel();
+	m_idle_timer.cancel();
+	// Keep the UDP socket, so the WireGuard peer will see the same endpoint
+	// if the client resumes the session
+	if (m_resume && m_socket_udp_dest.is_open()) {
+		LOG(debug) << "resume: Parking session: peer=" << utils::to_string(m_socket_ep_remote)
+		           << " udp=" << utils::to_string(m_socket_udp_dest.local_endpoint(ec))
+		           << " grace=" << m_tcp2udp.m_resume_grace_time;
+		m_tcp2udp.park(*m_resume, std::move(m_socket_udp_dest));
+	}
+	do_release();
+}
+
+auto tcp2udp::tcp::session::do_release() -> void {
+	m_queue.clear();
+	m_zerocopy.reset();
+	if (std::exchange(m_memory_reserved, false))
+		m_tcp2udp.m_limits->memory().release(session_memory);
+	if (std::exchange(m_counted, false))
+		m_tcp2udp.m_limits->remove();
+}
+
+auto tcp2udp::tcp::session::evict() -> void {
+	// Evicted session shall not hold the UDP socket for resumption
+	m_resume.reset();
+	do_close();
+}
+
+auto tcp2udp::tcp::session::do_idle(std::shared_ptr<session> self) -> void {
+	m_idle_timer.expires_at(m_last_activity + std::chrono::seconds(m_idle_timeout));
+	m_idle_timer.async_wait([self = std::move(self)](const auto & ec) {
+		self->do_idle_handler(ec, self);
+	});
+}
+
+auto tcp2udp::tcp::session::do_idle_handler(const boost::system::error_code & ec,
+                                            std::shared_ptr<session> self) -> void {
+
+	if (ec) {
+		if (ec == asio::error::operation_aborted)
+			return;
+		LOG(error) << "idle [" << utils::to_string(m_socket_ep_remote) << "]: " << ec.message();
+		return;
+	}
+
+	if (idle_time() >= std::chrono::seconds(m_idle_timeout)) {
+		LOG(info) << "idle [" << utils::to_string(m_socket_ep_remote)
+		          << "]: Closing idle session: timeout=" << m_idle_timeout;
+		do_close();
+		return;
+	}
+
+	// Activity was recorded in the meantime
+	do_idle(std::move(self));
+}
+
+auto tcp2udp::tcp::session::do_auto_tune(std::shared_ptr<session> self) -> void {
+	m_auto_tune_timer.expires_after(bdp_tuner::interval);
+	m_auto_tune_timer.async_wait([self = std::move(self)](const auto & ec) {
+		self->do_auto_tune_handler(ec, self);
+	});
+}
+
+auto tcp2udp::tcp::session::do_auto_tune_handler(const boost::system::error_code & ec,
+                                                 std::shared_ptr<session> self) -> void {
+
+	if (ec) {
+		if (ec == asio::error::operation_aborted)
+			return;
+		LOG(error) << "auto-tune [" << to_string() << "]: " << ec.message();
+		return;
+	}
+
+	boost::system::error_code ec2;
+	m_tcp_info = tcp_info_sample::sample(m_socket, ec2);
+	if (ec2) {
+		LOG(debug) << "auto-tune [" << utils::to_string(m_socket_ep_remote)
+		           << "]: Couldn't sample TCP info: " << ec2.message();
+		return;
+	}
+
+	LOG(trace) << "auto-tune [" << utils::to_string(m_socket_ep_remote) << "]: " << m_tcp_info;
+	if (m_auto_tuner.update(m_tcp_info)) {
+		LOG(debug) << "auto-tune [" << utils::to_string(m_socket_ep_remote)
+		           << "]: " << m_auto_tuner;
+		m_socket.set_option(asio::socket_base::send_buffer_size(m_auto_tuner.sndbuf()), ec2);
+		m_queue.limit(m_auto_tuner.queue_limit());
+		// Coalescing is disabled for message-oriented transports
+		if (m_queue.coalesce() != 0)
+			m_queue.coalesce(m_auto_tuner.coalesce());
+	}
+
+	// Schedule next sample
+	do_auto_tune(std::move(self));
 }
 
 auto tcp2udp::tcp::session_raw::run() -> void {
 	LOG(info) << "session-raw::run: " << to_string();
+	if (m_auto_tune)
+		do_auto_tune(shared_from_this());
+	if (m_idle_timeout > 0)
+		do_idle(shared_from_this());
+#if ENABLE_TLS
+	if (m_tcp2udp.m_tls_context) {
+		try {
+			m_tls = std::make_shared<tls::stream>(m_socket, *m_tcp2udp.m_tls_context,
+			                                      asio::ssl::stream_base::server);
+		} catch (const std::exception & e) {
+			LOG(error) << "session-raw::tls [" << to_string() << "]: " << e.what();
+			do_close();
+			return;
+		}
+		m_tls->async_handshake([self = shared_from_this()](const auto & ec) {
+			self->do_tls_handshake_handler(ec);
+		});
+		return;
+	}
+#endif
+	// Unix domain sockets do not support MSG_ZEROCOPY
+	if (m_tcp2udp.m_zerocopy_threshold > 0 && !utils::is_local(m_tcp2udp.m_ep_tcp_acc))
+		if (auto err = m_zerocopy.enable(m_socket, m_tcp2udp.m_zerocopy_threshold))
+			LOG(warning) << "session-raw::zerocopy [" << to_string()
+			             << "]: Couldn't set SO_ZEROCOPY: " << err;
 	// Start handling TCP packets
 	do_send_init();
 }
 
+#if ENABLE_TLS
+auto tcp2udp::tcp::session_raw::do_tls_handshake_handler(const boost::system::error_code & ec)
+    -> void {
+
+	if (ec) {
+		if (ec == asio::error::operation_aborted)
+			return;
+		LOG(error) << "session-raw::tls [" << to_string() << "]: Handshake: " << ec.message();
+		do_close();
+		return;
+	}
+
+	LOG(debug) << "session-raw::tls [" << to_string() << "]: " << m_tls->description();
+	// Start handling TCP packets
+	do_send_init();
+}
+#endif
+
+auto tcp2udp::tcp::session_raw::run(handoff::session && state) -> void {
+	m_socket_udp_dest = asio::ip::udp::socket(m_tcp2udp.m_io_context,
+	                                          m_tcp2udp.m_ep_udp_dest.protocol(), state.udp);
+	do_describe();
+	LOG(info) << "session-raw::run: " << to_string() << " (handoff)";
+	m_ctrl_ext = state.ctrl_ext;
+	m_ctrl_type = state.read_ctrl_type;
+	m_initialized = state.initialized;
+	m_resume = state.resume;
+	// Zero-copy is not enabled, because the kernel continues numbering the
+	// sends issued by the previous process
+
+	// Data not written by the previous process goes first, so it must
+	// not be dropped or reordered by the AQM
+	for (size_t offset = 0; offset < state.write.size();) {
+		auto pkt = m_queue.acquire();
+		const auto length = std::min(state.write.size() - offset, pkt.buffer.size());
+		std::memcpy(pkt.buffer.data(), state.write.data() + offset, length);
+		pkt.offset = 0;
+		pkt.length = length;
+		pkt.priority = true;
+		pkt.timestamp = packet::clock::now();
+		m_queue.push(std::move(pkt));
+		offset += length;
+	}
+	do_recv_buffer();
+
+	if (m_auto_tune)
+		do_auto_tune(shared_from_this());
+	if (m_idle_timeout > 0)
+		do_idle(shared_from_this());
+	if (m_ctrl_ext && m_ping_interval > 0)
+		do_ping();
+	if (m_initialized)
+		do_recv();
+
+	// Continue reading the frame where the previous process has stopped
+	m_buffer_send.consume(m_buffer_send.size());
+	m_buffer_send.commit(asio::buffer_copy(m_buffer_send.prepare(state.read.size()),
+	                                       asio::buffer(state.read)));
+	do_send_read(state.read_length, state.read_header);
+}
+
+auto tcp2udp::tcp::session_raw::handoff(
+    std::function<void(std::optional<handoff::session>)> handler) -> bool {
+#if ENABLE_TLS
+	// Record layer state is kept by OpenSSL, so it can not be passed
+	if (m_tls)
+		return false;
+#endif
+	m_handoff = std::move(handler);
+	// Stop all pending operations, data which was not read yet will be
+	// read by the new process from the kernel socket buffers
+	boost::system::error_code ec;
+	m_socket.cancel(ec);
+	m_socket_udp_dest.cancel(ec);
+	m_auto_tune_timer.cancel();
+	m_ping_timer.cancel();
+	// Completions of zero-copy sends would be delivered to both processes, so
+	// further writes are copied and the pending ones are waited for
+	m_zerocopy.stop();
+	m_idle_timer.expires_after(handoff_zerocopy_timeout);
+	m_idle_timer.async_wait([self = shared_from_this()](const auto & ec2) {
+		self->do_handoff_timeout(ec2);
+	});
+	do_handoff();
+	return true;
+}
+
+auto tcp2udp::tcp::session_raw::do_handoff_timeout(const boost::system::error_code & ec)
+    -> void {
+	if (ec || !m_handoff)
+		return;
+	LOG(warning) << "session-raw::handoff [" << to_string()
+	             << "]: Zero-copy sends not completed in time";
+	auto handler = std::move(m_handoff);
+	do_close();
+	handler(std::nullopt);
+}
+
+auto tcp2udp::tcp::session_raw::do_handoff() -> void {
+
+	// Wait for cancelled operations and for the frame waiting in the scheduler
+	if (!m_handoff || m_send_reading || m_queue_writing)
+		return;
+	// Buffers of zero-copy sends can be released only by this process
+	if (!m_zerocopy.idle()) {
+		m_zerocopy.on_drained([self = weak_from_this()]() {
+			if (auto s = self.lock())
+				asio::post(s->m_socket.get_executor(), [s]() { s->do_handoff(); });
+		});
+		m_zerocopy.async_wait(m_socket, shared_from_this());
+		return;
+	}
+	m_idle_timer.cancel();
+
+	handoff::session state;
+	state.ctrl_ext = m_ctrl_ext;
+	state.initialized = m_initialized;
+	state.resume = m_resume;
+	state.read_header = m_send_ctrl;
+	state.read_ctrl_type = m_ctrl_type;
+	state.read_length = m_send_length;
+	state.read.resize(m_buffer_send.size());
+	asio::buffer_copy(asio::buffer(state.read), m_buffer_send.data());
+	state.write = std::move(m_handoff_write);
+	std::vector<packet> batch;
+	while (!m_queue.empty()) {
+		m_queue.pop(batch);
+		for (auto & pkt : batch) {
+			const auto data = static_cast<const char *>(pkt.data().data());
+			state.write.insert(state.write.end(), data, data + pkt.length);
+			m_queue.release(std::move(pkt));
+		}
+		batch.clear();
+	}
+
+	auto handler = std::move(m_handoff);
+	try {
+		state.tcp = handoff::duplicate(m_socket.native_handle());
+		state.udp = handoff::duplicate(m_socket_udp_dest.native_handle());
+	} catch (const std::exception & e) {
+		LOG(error) << "session-raw::handoff [" << to_string() << "]: " << e.what();
+		handler(std::nullopt);
+		return;
+	}
+
+	LOG(debug) << "session-raw::handoff [" << utils::to_string(m_socket_ep_remote)
+	           << "]: Session captured: read=" << state.read.size() << "/" << state.read_length
+	           << " write=" << state.write.size();
+	// The UDP socket is owned by the new process now, so it must not be parked
+	m_resume.reset();
+	do_close();
+	handler(std::move(state));
+}
+
 auto tcp2udp::tcp::session_raw::do_send_init() -> void {
 	do_send(sizeof(utils::ip::udp::header), true);
 }
 
 auto tcp2udp::tcp::session_raw::do_send(size_t rlen, bool ctrl) -> void {
 	m_buffer_send.consume(m_buffer_send.size()); // Clean any previous data
-	asio::async_read(m_socket, m_buffer_send, asio::transfer_exactly(rlen),
-	                 [self = shared_from_this(), ctrl](const auto & ec, size_t length) {
-		                 self->do_send_handler(ec, length, ctrl);
-	                 });
+	do_send_read(rlen, ctrl);
+}
+
+auto tcp2udp::tcp::session_raw::do_send_read(size_t rlen, bool ctrl) -> void {
+
+	m_send_length = rlen;
+	m_send_ctrl = ctrl;
+	if (m_handoff) {
+		// Stop at the frame boundary
+		do_handoff();
+		return;
+	}
+
+	const auto buffered = m_buffer_send.size();
+	if (buffered >= rlen) {
+		// The whole frame was already read by the previous process
+		do_send_handler({}, buffered, ctrl);
+		return;
+	}
+
+	m_send_reading = true;
+	with_stream([this, rlen, buffered, ctrl](auto & stream) {
+		asio::async_read(stream, m_buffer_send, asio::transfer_exactly(rlen - buffered),
+		                 [self = shared_from_this(), ctrl](const auto & ec, size_t) {
+			                 self->m_send_reading = false;
+			                 self->m_socket_ops.add(1);
+			                 self->do_send_handler(ec, self->m_buffer_send.size(), ctrl);
+		                 });
+	});
 }
 
 auto tcp2udp::tcp::session_raw::do_send_handler(const boost::system::error_code & ec,
                                                 size_t length, bool ctrl) -> void {
 
 	if (ec) {
-		if (ec == asio::error::eof || ec == asio::error::connection_reset) {
-			LOG(debug) << "session-raw::send: Connection closed: peer="
-			           << utils::to_string(m_socket_ep_remote);
-			// Stop UDP receiver if there is no TCP session
-			m_socket_udp_dest.cancel();
+		if (ec == asio::error::operation_aborted) {
+			do_handoff();
 			return;
 		}
-		LOG(error) << "session-raw::send [" << to_string() << "]: " << ec.message();
-		// Try to recover from error
-		do_send_init();
+		if (ec == asio::error::eof || ec == asio::error::connection_reset ||
+		    ec == asio::error::connection_aborted)
+			LOG(debug) << "session-raw::send: Connection closed: peer="
+			           << utils::to_string(m_socket_ep_remote)
+			           << " throttled=" << drr_throttled();
+		else
+			// Framing can not be recovered, so only this session is closed
+			LOG(error) << "session-raw::send [" << to_string() << "]: " << ec.message();
+		do_close();
+		// There is nothing to pass to the new process
+		if (auto handler = std::exchange(m_handoff, nullptr))
+			handler(std::nullopt);
 		return;
 	}
 
 	LOG(trace) << "session-raw::send [" << to_string(true) << "]: len=" << length;
+	do_activity();
 
 	if (ctrl) {
 		auto header =
 		    reinterpret_cast<const utils::ip::udp::header *>(m_buffer_send.data().data());
 		if (!header->valid()) {
 			LOG(warning) << "session-raw::send [" << to_string() << "]: Invalid UDP header";
+			WGTT_PROBE(tcp2udp_invalid_header, id());
 			// Handle next TCP packet
 			do_send_init();
 			return;
 		}
+		m_ctrl_type = utils::ctrl::get_type(*header);
+		WGTT_PROBE(tcp2udp_frame_decode, id(), header->m_length,
+		           static_cast<int>(m_ctrl_type));
 		// Check if the packet is a control packet
 		if (header->m_length == 0) {
+			const auto size = utils::ctrl::get_body_size(m_ctrl_type);
+			if (size > 0 && m_ctrl_ext) {
+				// Handle control frame body
+				do_send(size);
+				return;
+			}
+			if (size == 0 && m_ctrl_type != utils::ctrl::type::none)
+				do_ctrl_handler(m_ctrl_type, nullptr);
 			// Handle next TCP packet
 			do_send_init();
 			return;
@@ -126,25 +779,230 @@ auto tcp2udp::tcp::session_raw::do_send_handler(const boost::system::error_code
 		return;
 	}
 
+	if (m_ctrl_type != utils::ctrl::type::none) {
+		do_ctrl_handler(m_ctrl_type, m_buffer_send.data().data());
+		// Handle next TCP packet
+		do_send_init();
+		return;
+	}
+
 	// At this point we know that the control header was valid
 	if (!std::exchange(m_initialized, true)) {
 		// Start handling UDP packets
 		do_recv();
 	}
 
-	m_socket_udp_dest.send(m_buffer_send.data());
+	m_send_decoded = capture::stamp();
+	// Wait for our turn before forwarding the packet
+	m_scheduler.schedule(shared_from_this(), length);
+}
+
+auto tcp2udp::tcp::session_raw::drr_dispatch() -> void {
+
+	// Session was closed (or passed to the new process) while waiting
+	if (!m_socket.is_open())
+		return;
+
+	// Datagram is lost if it can not be delivered, e.g. because the ICMP port
+	// unreachable was received, but the session shall keep running
+	boost::system::error_code ec;
+	const auto dispatched = capture::stamp();
+	m_socket_udp_dest.send(m_buffer_send.data(), 0, ec);
+	m_socket_ops.add(1, 1);
+	WGTT_PROBE(tcp2udp_udp_send, id(), m_buffer_send.size(), ec.value());
+	if (ec)
+		LOG(debug) << "session-raw::send [" << to_string() << "]: " << ec.message();
+	else
+		capture::record(capture::point::tcp2udp_rx, m_buffer_send.data(), m_desc.udp_local,
+		                m_tcp2udp.m_ep_udp_dest, m_send_decoded, dispatched);
 
 	// Handle next TCP packet
 	do_send_init();
 }
 
+auto tcp2udp::tcp::session_raw::do_ctrl(utils::ctrl::type type, const void * body,
+                                        size_t length) -> void {
+	auto pkt = m_queue.acquire();
+	pkt.frame(type, body, length);
+	m_queue.push(std::move(pkt));
+	do_recv_buffer();
+}
+
+auto tcp2udp::tcp::session_raw::do_ctrl_handler(utils::ctrl::type type, const void * body)
+    -> void {
+	switch (type) {
+	case utils::ctrl::type::none:
+		break;
+	case utils::ctrl::type::hello:
+		if (std::exchange(m_ctrl_ext, true))
+			break;
+		LOG(debug) << "session-raw::ctrl [" << utils::to_string(m_socket_ep_remote)
+		           << "]: Extended control frames enabled";
+		// Let the peer know that we support extended control frames
+		do_ctrl(utils::ctrl::type::hello, nullptr, 0);
+		if (m_ping_interval > 0)
+			do_ping();
+		if (m_tcp2udp.m_resume_grace_time > 0) {
+			utils::ctrl::session token;
+			std::random_device rd;
+			std::generate(token.m_token.begin(), token.m_token.end(),
+			              [&rd]() { return static_cast<uint8_t>(rd()); });
+			m_resume = token;
+			do_ctrl(utils::ctrl::type::session, &token, sizeof(token));
+		}
+		break;
+	case utils::ctrl::type::session:
+		// Session tokens are issued by the server only
+		break;
+	case utils::ctrl::type::resume: {
+		utils::ctrl::session token;
+		std::memcpy(&token, body, sizeof(token));
+		// Resumed session takes over the UDP socket, so it must not be
+		// used by this session yet
+		if (m_initialized) {
+			LOG(warning) << "session-raw::resume [" << utils::to_string(m_socket_ep_remote)
+			             << "]: Session already initialized";
+			break;
+		}
+		auto socket = m_tcp2udp.unpark(token);
+		if (!socket) {
+			LOG(debug) << "session-raw::resume [" << utils::to_string(m_socket_ep_remote)
+			           << "]: Session not found";
+			break;
+		}
+		m_socket_udp_dest = std::move(*socket);
+		do_describe();
+		LOG(info) << "session-raw::resume [" << utils::to_string(m_socket_ep_remote)
+		          << "]: Session resumed: " << to_string(true);
+		m_resume = token;
+		do_ctrl(utils::ctrl::type::session, &token, sizeof(token));
+		// Forward datagrams which arrived while the session was parked
+		m_initialized = true;
+		do_recv();
+	} break;
+	case utils::ctrl::type::ping:
+		do_ctrl(utils::ctrl::type::pong, body, sizeof(utils::ctrl::ping));
+		break;
+	case utils::ctrl::type::pong: {
+		utils::ctrl::ping pong;
+		std::memcpy(&pong, body, sizeof(pong));
+		const auto rtt = std::chrono::duration_cast<std::chrono::microseconds>(m_ping.pong(pong));
+		LOG(trace) << "session-raw::ping [" << utils::to_string(m_socket_ep_remote)
+		           << "]: rtt=" << rtt.count() << "us";
+	} break;
+	}
+}
+
+auto tcp2udp::tcp::session_raw::do_ping() -> void {
+	m_ping_timer.expires_after(std::chrono::milliseconds(m_ping_interval));
+	m_ping_timer.async_wait(
+	    [self = shared_from_this()](const auto & ec) { self->do_ping_handler(ec); });
+}
+
+auto tcp2udp::tcp::session_raw::do_ping_handler(const boost::system::error_code & ec) -> void {
+
+	if (ec) {
+		if (ec == asio::error::operation_aborted)
+			return;
+		LOG(error) << "session-raw::ping [" << to_string() << "]: " << ec.message();
+		return;
+	}
+
+	if (m_ping.missed() >= static_cast<unsigned int>(m_ping_count)) {
+		LOG(warning) << "session-raw::ping [" << utils::to_string(m_socket_ep_remote)
+		             << "]: Peer not responding: missed=" << m_ping.missed();
+		do_close();
+		return;
+	}
+
+	const auto body = m_ping.ping();
+	do_ctrl(utils::ctrl::type::ping, &body, sizeof(body));
+
+	// Schedule next ping
+	do_ping();
+}
+
 auto tcp2udp::tcp::session_raw::do_recv() -> void {
-	m_socket_udp_dest.async_receive(asio::buffer(m_buffer_recv),
+	if (m_handoff)
+		return;
+	m_buffer_recv = m_queue.acquire();
+	m_socket_udp_dest.async_receive(m_buffer_recv.payload(),
 	                                [self = shared_from_this()](const auto & ec, size_t length) {
 		                                self->do_recv_handler(ec, length);
 	                                });
 }
 
+auto tcp2udp::tcp::session_raw::do_recv_buffer() -> void {
+
+	if (m_queue_writing || m_queue.empty() || m_handoff)
+		return;
+
+	m_queue.pop(m_queue_batch);
+	m_queue_batch_buffers.clear();
+	for (const auto & pkt : m_queue_batch)
+		m_queue_batch_buffers.push_back(pkt.data());
+	m_queue_writing = true;
+	m_queue_dequeued = capture::stamp();
+
+	if (m_zerocopy.eligible(asio::buffer_size(m_queue_batch_buffers))) {
+		m_zerocopy.async_write(m_socket, m_queue_batch_buffers,
+		                       [self = shared_from_this()](const auto & ec, size_t length) {
+			                       self->do_recv_buffer_handler(ec, length);
+		                       });
+		return;
+	}
+
+	with_stream([this](auto & stream) {
+		asio::async_write(stream, m_queue_batch_buffers,
+		                  [self = shared_from_this()](const auto & ec, size_t length) {
+			                  self->do_recv_buffer_handler(ec, length);
+		                  });
+	});
+}
+
+auto tcp2udp::tcp::session_raw::do_recv_buffer_handler(const boost::system::error_code & ec,
+                                                       size_t length) -> void {
+
+	m_queue_writing = false;
+	const auto enqueued = m_queue_batch.front().timestamp;
+	auto written = length;
+	for (auto & pkt : m_queue_batch) {
+		// Keep the data which was not written, so the new process can write it
+		if (m_handoff && written < pkt.length) {
+			const auto data = static_cast<const char *>(pkt.data().data());
+			m_handoff_write.insert(m_handoff_write.end(), data + written, data + pkt.length);
+		}
+		written -= std::min(written, pkt.length);
+	}
+	if (!ec)
+		capture::record(capture::point::tcp2udp_tx, m_queue_batch, m_tcp2udp.m_ep_udp_dest,
+		                m_desc.udp_local, m_queue_dequeued);
+	m_zerocopy.release(m_queue_batch);
+
+	if (ec) {
+		if (ec == asio::error::operation_aborted) {
+			do_handoff();
+			return;
+		}
+		LOG(error) << "session-raw::recv [" << utils::to_string(m_socket_ep_remote)
+		           << "]: " << ec.message();
+		// Pending handoff still captures the state for the caller
+		if (m_handoff)
+			do_handoff();
+		else
+			do_close();
+		return;
+	}
+
+	LOG(trace) << "session-raw::recv [" << to_string(true) << "]: write=" << length;
+	WGTT_PROBE(tcp2udp_tcp_write, id(), length, probe::ns(enqueued));
+	m_socket_ops.add(1);
+	m_zerocopy.async_wait(m_socket, shared_from_this());
+
+	// Write next batch of queued packets
+	do_recv_buffer();
+}
+
 auto tcp2udp::tcp::session_raw::do_recv_handler(const boost::system::error_code & ec,
                                                 size_t length) -> void {
 
@@ -158,13 +1016,15 @@ auto tcp2udp::tcp::session_raw::do_recv_handler(const boost::system::error_code
 	}
 
 	LOG(trace) << "session-raw::recv [" << to_string(true) << "]: len=" << length;
+	WGTT_PROBE(tcp2udp_udp_recv, id(), length);
+	m_socket_ops.add(1, 1);
 	// Send payload with attached UDP header
-	utils::ip::udp::header header(m_socket_udp_dest.remote_endpoint().port(),
-	                              m_socket_udp_dest.local_endpoint().port(),
-	                              static_cast<uint16_t>(length));
-	const std::array<asio::const_buffer, 2> iovec{ asio::buffer(&header, sizeof(header)),
-		                                           asio::buffer(m_buffer_recv, length) };
-	m_socket.send(iovec);
+	m_buffer_recv.frame(length, m_desc.src_port, m_desc.dst_port);
+	WGTT_PROBE(tcp2udp_frame_encode, id(), m_buffer_recv.length, m_buffer_recv.priority);
+	if (!m_queue.push(std::move(m_buffer_recv)))
+		LOG(debug) << "session-raw::recv [" << to_string() << "]: Queue full: dropped="
+		           << m_queue.dropped();
+	do_recv_buffer();
 
 	// Handle next UDP packet
 	do_recv();
@@ -174,6 +1034,8 @@ auto tcp2udp::tcp::session_raw::do_recv_handler(const boost::system::error_code
 
 auto tcp2udp::tcp::session_ws::run() -> void {
 	LOG(info) << "session-ws::run: " << to_string();
+	if (m_idle_timeout > 0)
+		do_idle(shared_from_this());
 	// Ensure that the WebSocket stream will be binary
 	m_ws.binary(true);
 	// Start handling WebSocket handshake
@@ -201,6 +1063,8 @@ auto tcp2udp::tcp::session_ws::do_accept_handler(const boost::system::error_code
 	}
 	LOG(debug) << "session-ws::accept: Handshake accepted: peer="
 	           << utils::to_string(m_socket_ep_remote);
+	if (m_auto_tune)
+		do_auto_tune(shared_from_this());
 	// Start handling WebSocket packets
 	do_send();
 	// Start handling UDP packets
@@ -220,37 +1084,100 @@ auto tcp2udp::tcp::session_ws::do_send_handler(const boost::system::error_code &
 	if (ec) {
 		if (ec == asio::error::operation_aborted)
 			return;
-		if (ec == asio::error::eof || ec == asio::error::connection_reset) {
+		if (ec == asio::error::eof || ec == asio::error::connection_reset ||
+		    ec == asio::error::connection_aborted || ec == ws::error::closed)
 			LOG(debug) << "session-ws::send: Connection closed: peer="
-			           << utils::to_string(m_socket_ep_remote);
-			// Stop UDP receiver if there is no TCP session
-			m_socket_udp_dest.cancel();
-			return;
-		}
-		LOG(error) << "session-ws::send [" << to_string() << "]: " << ec.message();
-		// Try to recover from error
-		do_send();
+			           << utils::to_string(m_socket_ep_remote)
+			           << " throttled=" << drr_throttled();
+		else
+			LOG(error) << "session-ws::send [" << to_string() << "]: " << ec.message();
+		do_close();
 		return;
 	}
 
-	try {
-		LOG(trace) << "session-ws::send [" << to_string(true) << "]: len=" << length;
-		m_socket_udp_dest.send(m_buffer_send.data());
-	} catch (const std::exception & e) {
-		LOG(error) << "session-ws::send [" << to_string() << "]: " << e.what();
-	}
+	LOG(trace) << "session-ws::send [" << to_string(true) << "]: len=" << length;
+	WGTT_PROBE(tcp2udp_frame_decode, id(), length, 0);
+	m_socket_ops.add(1);
+	do_activity();
+	m_send_decoded = capture::stamp();
+	// Wait for our turn before forwarding the packet
+	m_scheduler.schedule(shared_from_this(), length);
+}
+
+auto tcp2udp::tcp::session_ws::drr_dispatch() -> void {
+
+	// Session was closed while waiting
+	if (!m_socket.is_open())
+		return;
+
+	boost::system::error_code ec;
+	const auto dispatched = capture::stamp();
+	m_socket_udp_dest.send(m_buffer_send.data(), 0, ec);
+	m_socket_ops.add(1, 1);
+	WGTT_PROBE(tcp2udp_udp_send, id(), m_buffer_send.size(), ec.value());
+	if (ec)
+		LOG(debug) << "session-ws::send [" << to_string() << "]: " << ec.message();
+	else
+		capture::record(capture::point::tcp2udp_rx, m_buffer_send.data(), m_desc.udp_local,
+		                m_tcp2udp.m_ep_udp_dest, m_send_decoded, dispatched);
 
 	// Handle next WebSocket packet
 	do_send();
 }
 
 auto tcp2udp::tcp::session_ws::do_recv() -> void {
-	m_socket_udp_dest.async_receive(asio::buffer(m_buffer_recv),
+	m_buffer_recv = m_queue.acquire();
+	m_socket_udp_dest.async_receive(m_buffer_recv.payload(),
 	                                [self = shared_from_this()](const auto & ec, size_t length) {
 		                                self->do_recv_handler(ec, length);
 	                                });
 }
 
+auto tcp2udp::tcp::session_ws::do_recv_buffer() -> void {
+
+	if (m_queue_writing || m_queue.empty())
+		return;
+
+	// Every WebSocket message carries exactly one datagram
+	m_queue.pop(m_queue_batch);
+	m_queue_writing = true;
+	m_queue_dequeued = capture::stamp();
+
+	m_ws.async_write(m_queue_batch.front().data(),
+	                 [self = shared_from_this()](const auto & ec, size_t length) {
+		                 self->do_recv_buffer_handler(ec, length);
+	                 });
+}
+
+auto tcp2udp::tcp::session_ws::do_recv_buffer_handler(const boost::system::error_code & ec,
+                                                      size_t length) -> void {
+
+	m_queue_writing = false;
+	const auto enqueued = m_queue_batch.front().timestamp;
+	if (!ec)
+		capture::record(capture::point::tcp2udp_tx, m_queue_batch, m_tcp2udp.m_ep_udp_dest,
+		                m_desc.udp_local, m_queue_dequeued);
+	for (auto & pkt : m_queue_batch)
+		m_queue.release(std::move(pkt));
+	m_queue_batch.clear();
+
+	if (ec) {
+		if (ec == asio::error::operation_aborted)
+			return;
+		LOG(error) << "session-ws::recv [" << utils::to_string(m_socket_ep_remote)
+		           << "]: " << ec.message();
+		do_close();
+		return;
+	}
+
+	LOG(trace) << "session-ws::recv [" << to_string(true) << "]: write=" << length;
+	WGTT_PROBE(tcp2udp_tcp_write, id(), length, probe::ns(enqueued));
+	m_socket_ops.add(1);
+
+	// Write next queued packet
+	do_recv_buffer();
+}
+
 auto tcp2udp::tcp::session_ws::do_recv_handler(const boost::system::error_code & ec, size_t length)
     -> void {
 
@@ -264,7 +1191,14 @@ auto tcp2udp::tcp::session_ws::do_recv_handler(const boost::system::error_code &
 	}
 
 	LOG(trace) << "session-ws::recv [" << to_string(true) << "]: len=" << length;
-	m_ws.write(asio::buffer(m_buffer_recv, length));
+	WGTT_PROBE(tcp2udp_udp_recv, id(), length);
+	m_socket_ops.add(1, 1);
+	m_buffer_recv.frame(length);
+	WGTT_PROBE(tcp2udp_frame_encode, id(), m_buffer_recv.length, m_buffer_recv.priority);
+	if (!m_queue.push(std::move(m_buffer_recv)))
+		LOG(debug) << "session-ws::recv [" << to_string() << "]: Queue full: dropped="
+		           << m_queue.dropped();
+	do_recv_buffer();
 
 	// Handle next UDP packet
 	do_recv();
@@ -272,15 +1206,158 @@ auto tcp2udp::tcp::session_ws::do_recv_handler(const boost::system::error_code &
 
 #endif
 
-auto tcp2udp::tcp::session::to_string(bool verbose) -> std::string {
-	std::string str = utils::to_string(m_socket_ep_remote);
-	if (verbose)
-		str += " -> " + utils::to_string(m_socket.local_endpoint());
-	str += " >> ";
-	if (verbose)
-		str += utils::to_string(m_socket_udp_dest.local_endpoint()) + " -> ";
-	str += utils::to_string(m_socket_udp_dest.remote_endpoint());
-	return str;
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+
+auto tcp2udp::tcp::session_seqpacket::run() -> void {
+	LOG(info) << "session-seqpacket::run: " << to_string();
+	if (m_idle_timeout > 0)
+		do_idle(shared_from_this());
+	// Start handling Unix socket messages
+	do_send();
+	// Start handling UDP packets
+	do_recv();
+}
+
+auto tcp2udp::tcp::session_seqpacket::do_send() -> void {
+	m_socket.async_receive(asio::buffer(m_buffer_send),
+	                       [self = shared_from_this()](const auto & ec, size_t length) {
+		                       self->do_send_handler(ec, length);
+	                       });
+}
+
+auto tcp2udp::tcp::session_seqpacket::do_send_handler(const boost::system::error_code & ec,
+                                                      size_t length) -> void {
+
+	if (ec) {
+		if (ec == asio::error::operation_aborted)
+			return;
+		if (ec == asio::error::eof || ec == asio::error::connection_reset ||
+		    ec == asio::error::connection_aborted)
+			LOG(debug) << "session-seqpacket::send: Connection closed: peer="
+			           << utils::to_string(m_socket_ep_remote)
+			           << " throttled=" << drr_throttled();
+		else
+			LOG(error) << "session-seqpacket::send [" << to_string() << "]: " << ec.message();
+		do_close();
+		return;
+	}
+
+	LOG(trace) << "session-seqpacket::send [" << to_string(true) << "]: len=" << length;
+	WGTT_PROBE(tcp2udp_frame_decode, id(), length, 0);
+	m_socket_ops.add(1);
+	do_activity();
+	m_send_length = length;
+	m_send_decoded = capture::stamp();
+	// Wait for our turn before forwarding the packet
+	m_scheduler.schedule(shared_from_this(), length);
+}
+
+auto tcp2udp::tcp::session_seqpacket::drr_dispatch() -> void {
+
+	// Session was closed while waiting
+	if (!m_socket.is_open())
+		return;
+
+	boost::system::error_code ec;
+	const auto dispatched = capture::stamp();
+	m_socket_udp_dest.send(asio::buffer(m_buffer_send.data(), m_send_length), 0, ec);
+	m_socket_ops.add(1, 1);
+	WGTT_PROBE(tcp2udp_udp_send, id(), m_send_length, ec.value());
+	if (ec)
+		LOG(debug) << "session-seqpacket::send [" << to_string() << "]: " << ec.message();
+	else
+		capture::record(capture::point::tcp2udp_rx,
+		                asio::buffer(m_buffer_send.data(), m_send_length), m_desc.udp_local,
+		                m_tcp2udp.m_ep_udp_dest, m_send_decoded, dispatched);
+
+	// Handle next Unix socket message
+	do_send();
+}
+
+auto tcp2udp::tcp::session_seqpacket::do_recv() -> void {
+	m_buffer_recv = m_queue.acquire();
+	m_socket_udp_dest.async_receive(m_buffer_recv.payload(),
+	                                [self = shared_from_this()](const auto & ec, size_t length) {
+		                                self->do_recv_handler(ec, length);
+	                                });
+}
+
+auto tcp2udp::tcp::session_seqpacket::do_recv_buffer() -> void {
+
+	if (m_queue_writing || m_queue.empty())
+		return;
+
+	// Every message carries exactly one datagram
+	m_queue.pop(m_queue_batch);
+	m_queue_writing = true;
+	m_queue_dequeued = capture::stamp();
+
+	m_socket.async_send(m_queue_batch.front().data(),
+	                    [self = shared_from_this()](const auto & ec, size_t length) {
+		                    self->do_recv_buffer_handler(ec, length);
+	                    });
 }
 
+auto tcp2udp::tcp::session_seqpacket::do_recv_buffer_handler(const boost::system::error_code & ec,
+                                                             size_t length) -> void {
+
+	m_queue_writing = false;
+	const auto enqueued = m_queue_batch.front().timestamp;
+	if (!ec)
+		capture::record(capture::point::tcp2udp_tx, m_queue_batch, m_tcp2udp.m_ep_udp_dest,
+		                m_desc.udp_local, m_queue_dequeued);
+	for (auto & pkt : m_queue_batch)
+		m_queue.release(std::move(pkt));
+	m_queue_batch.clear();
+
+	if (ec) {
+		if (ec == asio::error::operation_aborted)
+			return;
+		LOG(error) << "session-seqpacket::recv [" << utils::to_string(m_socket_ep_remote)
+		           << "]: " << ec.message();
+		do_close();
+		return;
+	}
+
+	LOG(trace) << "session-seqpacket::recv [" << to_string(true) << "]: write=" << length;
+	WGTT_PROBE(tcp2udp_tcp_write, id(), length, probe::ns(enqueued));
+	m_socket_ops.add(1);
+
+	// Write next queued packet
+	do_recv_buffer();
+}
+
+auto tcp2udp::tcp::session_seqpacket::do_recv_handler(const boost::system::error_code & ec,
+                                                      size_t length) -> void {
+
+	if (ec) {
+		if (ec == asio::error::operation_aborted)
+			return;
+		LOG(error) << "session-seqpacket::recv [" << to_string() << "]: " << ec.message();
+		// Try to recover from error
+		do_recv();
+		return;
+	}
+
+	LOG(trace) << "session-seqpacket::recv [" << to_string(true) << "]: len=" << length;
+	WGTT_PROBE(tcp2udp_udp_recv, id(), length);
+	m_socket_ops.add(1, 1);
+	// Empty message would be taken by the peer for the end of the connection
+	if (length == 0) {
+		do_recv();
+		return;
+	}
+	m_buffer_recv.frame(length);
+	WGTT_PROBE(tcp2udp_frame_encode, id(), m_buffer_recv.length, m_buffer_recv.priority);
+	if (!m_queue.push(std::move(m_buffer_recv)))
+		LOG(debug) << "session-seqpacket::recv [" << to_string() << "]: Queue full: dropped="
+		           << m_queue.dropped();
+	do_recv_buffer();
+
+	// Handle next UDP packet
+	do_recv();
+}
+
+#endif
+
 }; // namespace wg::tunnel
@@ -4,18 +4,35 @@
 
 #pragma once
 
-#include <array>
+#include <atomic>
+#include <chrono>
 #include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
 #include <memory>
+#include <optional>
+#include <set>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include <boost/asio.hpp>
 #if ENABLE_WEBSOCKET
 #	include <boost/beast/websocket.hpp>
 #endif
 
+#include "handoff.h"
+#include "ping.h"
+#include "probe.h"
+#include "queue.h"
+#include "scheduler.h"
+#if ENABLE_TLS
+#	include "tls.h"
+#endif
+#include "tuning.h"
 #include "utils.hpp"
+#include "zerocopy.h"
 
 namespace wg::tunnel {
 
@@ -26,71 +43,307 @@ namespace ws = beast::websocket;
 #endif
 using std::size_t;
 
+// Limits of the server sessions shared by all tunnels of the process, the
+// accounting is atomic, because tunnels are served by different workers
+class session_limits {
+public:
+	// Set the maximum number of active and parked sessions, zero for unlimited
+	auto max_sessions(size_t count) -> void { m_max_sessions = count; }
+	[[nodiscard]] auto max_sessions() const -> size_t { return m_max_sessions; }
+	[[nodiscard]] auto sessions() const -> size_t {
+		return m_sessions.load(std::memory_order_relaxed);
+	}
+	// Check whether there is room for another session
+	[[nodiscard]] auto available() const -> bool {
+		return m_max_sessions == 0 || sessions() < m_max_sessions;
+	}
+	auto add() -> void { m_sessions.fetch_add(1, std::memory_order_relaxed); }
+	auto remove() -> void { m_sessions.fetch_sub(1, std::memory_order_relaxed); }
+
+	// Memory budget of all sessions
+	[[nodiscard]] auto memory() -> memory_budget & { return m_memory; }
+
+private:
+	size_t m_max_sessions = 0;
+	std::atomic<size_t> m_sessions{ 0 };
+	memory_budget m_memory;
+};
+
 class tcp2udp {
 public:
-	tcp2udp(asio::io_context & ioc, asio::ip::tcp::endpoint ep_tcp_acc,
+	// Use already bound listening socket, e.g. inherited from other process,
+	// the socket can be a TCP or a Unix domain socket
+	tcp2udp(asio::io_context & ioc, utils::stream_acceptor acceptor,
 	        asio::ip::udp::endpoint ep_udp_dest)
-	    : m_io_context(ioc), m_ep_tcp_acc(std::move(ep_tcp_acc)),
-	      m_ep_udp_dest(std::move(ep_udp_dest)), m_tcp_acceptor(ioc, m_ep_tcp_acc) {}
+	    : m_io_context(ioc), m_ep_tcp_acc(acceptor.local_endpoint()),
+	      m_ep_udp_dest(std::move(ep_udp_dest)), m_tcp_acceptor(std::move(acceptor)),
+	      m_handoff_key(utils::to_string(m_ep_tcp_acc)), m_scheduler(ioc, scheduler_quantum) {}
 	~tcp2udp() = default;
 
 	auto run(utils::transport transport) -> void;
 
+	// Pass the listening socket to the new process, connections are accepted
+	// until the new process confirms that it has taken over
+	auto handoff(class handoff & state) -> void;
+	// Stop accepting connections and pass raw transport sessions to the new
+	// process. The handler is called once the state of all sessions was
+	// captured. Other sessions are left running until closed.
+	auto handoff_sessions(class handoff & state, std::function<void()> handler) -> void;
+	// Continue sessions passed by the previous process
+	auto adopt(std::vector<handoff::session> sessions) -> void;
+	// Number of open sessions
+	[[nodiscard]] auto sessions() const -> size_t;
+
 	auto keep_alive_app(int idle_time) -> void { m_app_keep_alive_idle_time = idle_time; }
 	auto keep_alive_tcp(int idle_time) -> void { m_tcp_keep_alive_idle_time = idle_time; }
+	auto aqm_codel(int target, int interval) -> void {
+		m_aqm_codel_target = target;
+		m_aqm_codel_interval = interval;
+	}
+	auto rate_limits(std::vector<rate_limit> limits) -> void { m_rate_limits = std::move(limits); }
+	auto tuning(socket_tuning tuning) -> void { m_socket_tuning = std::move(tuning); }
+	auto auto_tune(bool enabled) -> void { m_auto_tune = enabled; }
+	auto fast_open(bool enabled) -> void { m_fast_open = enabled; }
+	auto defer_accept(int time) -> void { m_defer_accept_time = time; }
+	// Write batches of at least the given size with MSG_ZEROCOPY, 0 to disable
+	auto zerocopy_threshold(size_t bytes) -> void { m_zerocopy_threshold = bytes; }
+	// Report the CPU which received every accepted connection
+	auto incoming_cpu(bool enabled) -> void { m_incoming_cpu = enabled; }
+	// Pass the state under the given key instead of the listening endpoint,
+	// e.g. when the endpoint is shared by the SO_REUSEPORT group
+	auto handoff_key(std::string key) -> void { m_handoff_key = std::move(key); }
+	auto resume_grace(int time) -> void { m_resume_grace_time = time; }
+	auto idle_timeout(int time) -> void { m_idle_timeout = time; }
+	// Account sessions in the limits shared with other tunnels
+	auto limits(std::shared_ptr<session_limits> limits) -> void { m_limits = std::move(limits); }
+	auto ping(int interval, int count) -> void {
+		m_ping_interval = interval;
+		m_ping_count = count;
+	}
 #if ENABLE_WEBSOCKET
 	auto ws_headers(utils::http::headers headers) { m_ws_headers = std::move(headers); }
 #endif
+#if ENABLE_TLS
+	// Wrap raw transport sessions in TLS with the given server context
+	auto tls(asio::ssl::context ctx) -> void { m_tls_context.emplace(std::move(ctx)); }
+#endif
+
+	// Log statistics of all active sessions
+	auto log_stats() -> void;
 
 private:
 	union tcp {
-		class session {
+		class session : public drr_scheduler::flow {
 		public:
-			session(tcp2udp & tcp2udp, asio::ip::tcp::socket socket)
-			    : m_socket(std::move(socket)), m_socket_udp_dest(tcp2udp.m_io_context),
-			      m_socket_ep_remote(m_socket.remote_endpoint()) {
-				m_socket_udp_dest.connect(tcp2udp.m_ep_udp_dest);
+			using clock = std::chrono::steady_clock;
+
+			session(tcp2udp & tcp2udp, utils::stream_socket socket,
+			        utils::stream_endpoint ep_remote)
+			    : flow(tcp2udp.m_io_context), m_tcp2udp(tcp2udp), m_socket(std::move(socket)),
+			      m_socket_udp_dest(tcp2udp.m_io_context),
+			      m_socket_ep_remote(std::move(ep_remote)),
+			      m_scheduler(tcp2udp.m_scheduler),
+			      // TCP info is not available for Unix domain sockets
+			      m_auto_tune(tcp2udp.m_auto_tune && !utils::is_local(tcp2udp.m_ep_tcp_acc)),
+			      m_auto_tune_timer(tcp2udp.m_io_context),
+			      m_ping_interval(tcp2udp.m_ping_interval), m_ping_count(tcp2udp.m_ping_count),
+			      m_ping_timer(tcp2udp.m_io_context), m_idle_timeout(tcp2udp.m_idle_timeout),
+			      m_idle_timer(tcp2udp.m_io_context), m_last_activity(clock::now()) {
+				drr_rate_limit(
+				    tcp2udp.rate_limit_bucket(utils::to_tcp(m_socket_ep_remote).address()));
+				m_queue.aqm_codel(std::chrono::milliseconds(tcp2udp.m_aqm_codel_target),
+				                  std::chrono::milliseconds(tcp2udp.m_aqm_codel_interval));
+				m_queue.budget(&tcp2udp.m_limits->memory());
+				m_zerocopy.budget(std::shared_ptr<memory_budget>(tcp2udp.m_limits,
+				                                                 &tcp2udp.m_limits->memory()));
+				m_memory_reserved = tcp2udp.m_limits->memory().reserve(session_memory);
+				tcp2udp.m_limits->add();
+			}
+			~session() override { do_release(); }
+
+			// Get session statistics in a printable form
+			auto stats() -> std::string;
+
+			// Time elapsed since the last frame was received from the client
+			[[nodiscard]] auto idle_time() const -> clock::duration {
+				return clock::now() - m_last_activity;
+			}
+			[[nodiscard]] auto is_open() const -> bool { return m_socket.is_open(); }
+			// Identifier of the session passed to the tracepoints
+			[[nodiscard]] auto id() const -> std::uintptr_t { return probe::id(this); }
+			// Connect the UDP socket to the tunnel destination
+			auto connect() -> boost::system::error_code;
+			virtual auto run() -> void = 0;
+			// Close the session to make room for other sessions
+			auto evict() -> void;
+			// Capture the session state for the new process and close the session,
+			// return false if the transport does not support the handoff
+			virtual auto handoff(std::function<void(std::optional<handoff::session>)>)
+			    -> bool {
+				return false;
 			}
 
 		protected:
-			auto to_string(bool verbose = false) -> std::string;
+			// Endpoints of the session resolved once, so the data path does not
+			// have to query them from the kernel
+			struct descriptor {
+				// Ports of the framing header written to the client
+				uint16_t src_port = 0;
+				uint16_t dst_port = 0;
+				// Local endpoint of the UDP socket
+				asio::ip::udp::endpoint udp_local;
+				std::string name;
+				std::string name_verbose;
+			};
+
+			[[nodiscard]] auto to_string(bool verbose = false) const -> const std::string & {
+				return verbose ? m_desc.name_verbose : m_desc.name;
+			}
+			// Update the descriptor, e.g. after the UDP socket was replaced
+			auto do_describe() -> void;
+
+			// Close the session and cancel all pending operations
+			auto do_close() -> void;
+			// Return memory reserved for the session to the budget
+			auto do_release() -> void;
 
-			asio::ip::tcp::socket m_socket;
+			// Record the client activity, so the session will not be reaped
+			auto do_activity() -> void { m_last_activity = clock::now(); }
+			auto do_idle(std::shared_ptr<session> self) -> void;
+			auto do_idle_handler(const boost::system::error_code & ec,
+			                     std::shared_ptr<session> self) -> void;
+
+			auto do_auto_tune(std::shared_ptr<session> self) -> void;
+			auto do_auto_tune_handler(const boost::system::error_code & ec,
+			                          std::shared_ptr<session> self) -> void;
+
+			tcp2udp & m_tcp2udp;
+			utils::stream_socket m_socket;
 			asio::ip::udp::socket m_socket_udp_dest;
 			// Saved remote endpoint of the TCP socket, so we can get
 			// the address after the socket is disconnected
-			asio::ip::tcp::endpoint m_socket_ep_remote;
+			utils::stream_endpoint m_socket_ep_remote;
+			descriptor m_desc;
+			utils::socket_op_counter m_socket_ops;
+			// Scheduler for forwarding packets to the UDP destination
+			drr_scheduler & m_scheduler;
+			// Queue of packets waiting for the TCP write
+			egress_queue m_queue;
+			// Packets being currently written to the TCP socket
+			std::vector<packet> m_queue_batch;
+			std::vector<asio::const_buffer> m_queue_batch_buffers;
+			bool m_queue_writing = false;
+			// Time at which the batch was taken from the queue and the time at
+			// which the datagram was decoded from the tunnel, for the capture
+			packet::clock::time_point m_queue_dequeued;
+			packet::clock::time_point m_send_decoded;
+			// Zero-copy writes of the raw transport
+			zerocopy m_zerocopy;
+			// Buffer sizes auto-tuning based on the TCP_INFO samples
+			bool m_auto_tune;
+			asio::steady_timer m_auto_tune_timer;
+			bdp_tuner m_auto_tuner;
+			tcp_info_sample m_tcp_info;
+			// In-band RTT probing
+			int m_ping_interval;
+			int m_ping_count;
+			asio::steady_timer m_ping_timer;
+			ping_tracker m_ping;
+			// Token which allows the client to resume the session
+			std::optional<utils::ctrl::session> m_resume;
+			// Idle timeout in seconds, 0 to disable
+			int m_idle_timeout;
+			asio::steady_timer m_idle_timer;
+			clock::time_point m_last_activity;
+			bool m_memory_reserved = false;
+			bool m_counted = true;
 		};
 
 		class session_raw : public session, public std::enable_shared_from_this<session_raw> {
 		public:
-			session_raw(tcp2udp & tcp2udp, asio::ip::tcp::socket socket)
-			    : session(tcp2udp, std::move(socket)) {}
+			session_raw(tcp2udp & tcp2udp, utils::stream_socket socket,
+			            utils::stream_endpoint ep_remote)
+			    : session(tcp2udp, std::move(socket), std::move(ep_remote)) {}
 
-			auto run() -> void;
+			auto run() -> void override;
+			// Continue the session passed by the previous process
+			auto run(handoff::session && state) -> void;
+			auto drr_dispatch() -> void override;
+			auto handoff(std::function<void(std::optional<handoff::session>)> handler)
+			    -> bool override;
 
 		private:
+			// Call the function with the stream carrying the framed data
+			template <typename F> auto with_stream(F && f) -> void {
+#if ENABLE_TLS
+				if (m_tls) {
+					f(*m_tls);
+					return;
+				}
+#endif
+				f(m_socket);
+			}
+
+#if ENABLE_TLS
+			auto do_tls_handshake_handler(const boost::system::error_code & ec) -> void;
+#endif
+
+			// Capture the state once the pending reads and writes were stopped
+			auto do_handoff() -> void;
+			auto do_handoff_timeout(const boost::system::error_code & ec) -> void;
+
+			auto do_ctrl(utils::ctrl::type type, const void * body, size_t length) -> void;
+			auto do_ctrl_handler(utils::ctrl::type type, const void * body) -> void;
+
+			auto do_ping() -> void;
+			auto do_ping_handler(const boost::system::error_code & ec) -> void;
+
 			auto do_send_init() -> void;
 			auto do_send(size_t rlen, bool ctrl = false) -> void;
+			// Read the rest of the frame, which might be partially buffered
+			auto do_send_read(size_t rlen, bool ctrl) -> void;
 			auto do_send_handler(const boost::system::error_code & ec, size_t length, bool ctrl)
 			    -> void;
 
 			auto do_recv() -> void;
+			auto do_recv_buffer() -> void;
+			auto do_recv_buffer_handler(const boost::system::error_code & ec, size_t length)
+			    -> void;
 			auto do_recv_handler(const boost::system::error_code & ec, size_t length) -> void;
 
 			asio::streambuf m_buffer_send;
-			std::array<char, 4096> m_buffer_recv;
+			// Length of the frame being read and whether it is the framing header
+			size_t m_send_length = 0;
+			bool m_send_ctrl = true;
+			bool m_send_reading = false;
+			packet m_buffer_recv;
 			bool m_initialized = false;
+			// Whether the peer supports extended control frames
+			bool m_ctrl_ext = false;
+			// Type of the control frame which body is being read
+			utils::ctrl::type m_ctrl_type = utils::ctrl::type::none;
+			// Pending handoff to the new process
+			std::function<void(std::optional<handoff::session>)> m_handoff;
+			// Data which could not be written to the client before the handoff
+			std::vector<char> m_handoff_write;
+#if ENABLE_TLS
+			std::shared_ptr<tls::stream> m_tls;
+#endif
 		};
 
 #if ENABLE_WEBSOCKET
 		class session_ws : public session, public std::enable_shared_from_this<session_ws> {
 		public:
-			session_ws(tcp2udp & tcp2udp, asio::ip::tcp::socket socket)
-			    : session(tcp2udp, std::move(socket)), m_ws(m_socket),
-			      m_ws_headers(tcp2udp.m_ws_headers) {}
+			session_ws(tcp2udp & tcp2udp, utils::stream_socket socket,
+			           utils::stream_endpoint ep_remote)
+			    : session(tcp2udp, std::move(socket), std::move(ep_remote)), m_ws(m_socket),
+			      m_ws_headers(tcp2udp.m_ws_headers) {
+				// Every WebSocket message carries exactly one datagram
+				m_queue.coalesce(0);
+			}
 
-			auto run() -> void;
+			auto run() -> void override;
+			auto drr_dispatch() -> void override;
 
 		private:
 			auto do_accept() -> void;
@@ -100,34 +353,170 @@ private:
 			auto do_send_handler(const boost::system::error_code & ec, size_t length) -> void;
 
 			auto do_recv() -> void;
+			auto do_recv_buffer() -> void;
+			auto do_recv_buffer_handler(const boost::system::error_code & ec, size_t length)
+			    -> void;
 			auto do_recv_handler(const boost::system::error_code & ec, size_t length) -> void;
 
-			ws::stream<asio::ip::tcp::socket &> m_ws;
+			ws::stream<utils::stream_socket &> m_ws;
 			utils::http::headers & m_ws_headers;
 			beast::flat_buffer m_buffer_send;
-			std::array<char, 4096> m_buffer_recv;
+			packet m_buffer_recv;
+		};
+#endif
+
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+		class session_seqpacket : public session,
+		                          public std::enable_shared_from_this<session_seqpacket> {
+		public:
+			session_seqpacket(tcp2udp & tcp2udp, utils::stream_socket socket,
+			                  utils::stream_endpoint ep_remote)
+			    : session(tcp2udp, std::move(socket), std::move(ep_remote)),
+			      m_buffer_send(packet::payload_size_max) {
+				// Every message carries exactly one datagram
+				m_queue.coalesce(0);
+			}
+
+			auto run() -> void override;
+			auto drr_dispatch() -> void override;
+
+		private:
+			auto do_send() -> void;
+			auto do_send_handler(const boost::system::error_code & ec, size_t length) -> void;
+
+			auto do_recv() -> void;
+			auto do_recv_buffer() -> void;
+			auto do_recv_buffer_handler(const boost::system::error_code & ec, size_t length)
+			    -> void;
+			auto do_recv_handler(const boost::system::error_code & ec, size_t length) -> void;
+
+			std::vector<char> m_buffer_send;
+			size_t m_send_length = 0;
+			packet m_buffer_recv;
 		};
 #endif
 	};
 
+	// Quantum of the scheduler, well below the maximum-size packet, so sessions
+	// sending large packets wait more rounds than sessions sending small ones
+	static constexpr size_t scheduler_quantum = 128;
+	// Estimated memory used by a session (receive buffers), excluding packets
+	// in the egress queue, which are accounted separately
+	static constexpr size_t session_memory =
+	    4 * (packet::header_size + packet::payload_size_max);
+
+	// Maximum number of pending TCP Fast Open requests
+	static constexpr int fast_open_qlen = 256;
+	// Maximum number of connections accepted on a single wakeup
+	static constexpr unsigned int accept_batch_max = 16;
+	// Maximum time to wait for the zero-copy completions before the handoff
+	static constexpr std::chrono::seconds handoff_zerocopy_timeout{ 5 };
+	// Maximum time to wait for the first bytes of the new connection
+	static constexpr std::chrono::seconds first_data_timeout{ 10 };
+
 	auto do_accept() -> void;
-	auto do_accept_handler(const boost::system::error_code & ec, asio::ip::tcp::socket peer)
+	auto do_accept_handler(const boost::system::error_code & ec, utils::stream_socket peer)
 	    -> void;
+	// Wait for the first bytes of the new connection
+	auto do_wait(utils::stream_socket peer) -> void;
+	// Setup the new connection and start the session
+	auto do_session(utils::stream_socket peer) -> void;
+	// Close the longest idle session, return false if there is none
+	auto do_evict() -> bool;
+
+	// Get rate limiter for the session with the given remote address
+	auto rate_limit_bucket(const asio::ip::address & addr) const -> token_bucket;
+
+	// UDP socket of the closed session waiting for the client to resume it
+	struct parked_session {
+		parked_session(asio::ip::udp::socket socket_, std::shared_ptr<session_limits> limits_)
+		    : socket(std::move(socket_)), timer(socket.get_executor()),
+		      limits(std::move(limits_)) {
+			limits->add();
+		}
+		~parked_session() { limits->remove(); }
+		asio::ip::udp::socket socket;
+		asio::steady_timer timer;
+		std::shared_ptr<session_limits> limits;
+	};
+
+	// Connection waiting for the first bytes, counted as a session, so idle
+	// connections can not exhaust file descriptors
+	struct pending_connection {
+		pending_connection(utils::stream_socket socket_,
+		                   std::shared_ptr<session_limits> limits_)
+		    : socket(std::move(socket_)), timer(socket.get_executor()),
+		      limits(std::move(limits_)) {
+			limits->add();
+		}
+		~pending_connection() { release(); }
+		// Give the slot back to the session which takes over the connection
+		auto release() -> void {
+			if (auto l = std::exchange(limits, nullptr))
+				l->remove();
+		}
+		utils::stream_socket socket;
+		asio::steady_timer timer;
+		std::shared_ptr<session_limits> limits;
+	};
+
+	// Keep the UDP socket of the closed session for the grace period
+	auto park(const utils::ctrl::session & token, asio::ip::udp::socket socket) -> void;
+	// Take over the UDP socket of the parked session
+	auto unpark(const utils::ctrl::session & token) -> std::optional<asio::ip::udp::socket>;
 
 	asio::io_context & m_io_context;
-	asio::ip::tcp::endpoint m_ep_tcp_acc;
+	utils::stream_endpoint m_ep_tcp_acc;
 	asio::ip::udp::endpoint m_ep_udp_dest;
-	asio::ip::tcp::acceptor m_tcp_acceptor;
+	utils::stream_acceptor m_tcp_acceptor;
+	std::string m_handoff_key;
+	// Fair scheduler shared by all sessions
+	drr_scheduler m_scheduler;
+	// Per-session rate limits, the longest matching prefix is used
+	std::vector<rate_limit> m_rate_limits;
 	// Transport protocol used for the TCP connection
 	utils::transport m_transport = utils::transport::raw;
 	// Application keep-alive idle time in seconds, 0 to disable
 	int m_app_keep_alive_idle_time = 0;
 	// TCP keep-alive idle time in seconds, 0 to disable
 	int m_tcp_keep_alive_idle_time = 0;
+	// CoDel target and interval in milliseconds, 0 target to disable
+	int m_aqm_codel_target = 0;
+	int m_aqm_codel_interval = 100;
+	// Accept data carried in the SYN with TCP Fast Open
+	bool m_fast_open = false;
+	// TCP deferred accept timeout in seconds, 0 to disable
+	int m_defer_accept_time = 0;
+	bool m_incoming_cpu = false;
+	// Minimum size of the zero-copy write, 0 to disable
+	size_t m_zerocopy_threshold = 0;
+	// Time in seconds for which closed sessions can be resumed, 0 to disable
+	int m_resume_grace_time = 0;
+	std::map<decltype(utils::ctrl::session::m_token), std::unique_ptr<parked_session>> m_parked;
+	// Connections which have not sent anything yet
+	std::set<std::shared_ptr<pending_connection>> m_pending;
+	// Options applied to every tunnel TCP socket
+	socket_tuning m_socket_tuning;
+	// Adapt buffer sizes to the measured bandwidth-delay product
+	bool m_auto_tune = false;
+	// Ping interval in milliseconds, 0 to disable, and the number of missed
+	// pongs after which the peer is considered dead
+	int m_ping_interval = 0;
+	int m_ping_count = 3;
+	// Active sessions used for statistics reporting and eviction
+	std::vector<std::weak_ptr<tcp::session>> m_sessions;
+	// Idle timeout in seconds, 0 to disable
+	int m_idle_timeout = 0;
+	// Session count and memory budget, possibly shared with other tunnels
+	std::shared_ptr<session_limits> m_limits = std::make_shared<session_limits>();
 #if ENABLE_WEBSOCKET
 	// List of WebSocket custom headers used during the handshake
 	utils::http::headers m_ws_headers;
 #endif
+#if ENABLE_TLS
+	// Context of the TLS transport, raw transport is not wrapped if not set
+	std::optional<asio::ssl::context> m_tls_context;
+#endif
 };
 
 }; // namespace wg::tunnel
@@ -0,0 +1,144 @@
+// wg-tcp-tunnel - tls.cpp
+// SPDX-FileCopyrightText: 2023-2025 Arkadiusz Bokowy and contributors
+// SPDX-License-Identifier: MIT
+
+#include "tls.h"
+
+#include <cerrno>
+#include <string>
+
+#include <boost/asio.hpp>
+#include <boost/asio/ssl.hpp>
+#include <openssl/bio.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+namespace wg::tunnel::tls {
+
+namespace asio = boost::asio;
+
+namespace {
+
+auto context(asio::ssl::context::method method) -> asio::ssl::context {
+	asio::ssl::context ctx(method);
+	ctx.set_options(asio::ssl::context::default_workarounds | asio::ssl::context::no_sslv2 |
+	                asio::ssl::context::no_sslv3 | asio::ssl::context::no_tlsv1 |
+	                asio::ssl::context::no_tlsv1_1);
+#if defined(SSL_OP_ENABLE_KTLS)
+	// Hand the session keys to the kernel once the handshake is done
+	SSL_CTX_set_options(ctx.native_handle(), SSL_OP_ENABLE_KTLS);
+#endif
+#if defined(SSL_OP_IGNORE_UNEXPECTED_EOF)
+	// Tunnel ends close the connection without the close_notify alert, so
+	// treat it as a regular end of stream, the same way as the raw transport
+	SSL_CTX_set_options(ctx.native_handle(), SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+	return ctx;
+}
+
+auto ssl_error(unsigned long err) -> boost::system::error_code {
+	return { static_cast<int>(err), asio::error::get_ssl_category() };
+}
+
+}; // namespace
+
+auto server_context(const std::string & cert, const std::string & key) -> asio::ssl::context {
+	auto ctx = context(asio::ssl::context::tls_server);
+	ctx.use_certificate_chain_file(cert);
+	ctx.use_private_key_file(key, asio::ssl::context::pem);
+	// Session tickets are sent after the handshake, the client would have to
+	// process them in user space, which is not possible with kTLS receive
+	SSL_CTX_set_num_tickets(ctx.native_handle(), 0);
+	return ctx;
+}
+
+auto client_context(const std::string & ca) -> asio::ssl::context {
+	auto ctx = context(asio::ssl::context::tls_client);
+	if (ca.empty())
+		ctx.set_default_verify_paths();
+	else
+		ctx.load_verify_file(ca);
+	ctx.set_verify_mode(asio::ssl::verify_peer);
+	return ctx;
+}
+
+stream::stream(utils::stream_socket & socket, asio::ssl::context & ctx,
+               asio::ssl::stream_base::handshake_type type, const std::string & server_name)
+    : m_socket(socket), m_ssl(SSL_new(ctx.native_handle())) {
+	if (m_ssl == nullptr)
+		throw boost::system::system_error(ssl_error(ERR_get_error()), "SSL_new");
+	// OpenSSL calls shall not block, readiness is waited for by the socket
+	boost::system::error_code ec;
+	m_socket.native_non_blocking(true, ec);
+	// Records are read one by one, so nothing is buffered by OpenSSL when
+	// the receive path is switched to the kernel
+	SSL_set_read_ahead(m_ssl, 0);
+	if (ec || SSL_set_fd(m_ssl, m_socket.native_handle()) != 1) {
+		SSL_free(m_ssl);
+		throw boost::system::system_error(ec ? ec : ssl_error(ERR_get_error()), "SSL_set_fd");
+	}
+	if (type == asio::ssl::stream_base::server) {
+		SSL_set_accept_state(m_ssl);
+		return;
+	}
+	SSL_set_connect_state(m_ssl);
+	if (!server_name.empty()) {
+		// Send SNI and check the server certificate against the name
+		SSL_set_tlsext_host_name(m_ssl, server_name.c_str());
+		SSL_set1_host(m_ssl, server_name.c_str());
+	}
+}
+
+auto stream::description() const -> std::string {
+	std::string str = SSL_get_version(m_ssl);
+	str += " ";
+	str += SSL_get_cipher_name(m_ssl);
+	str += " ktls=";
+	if (!m_kernel_send && !m_kernel_recv)
+		return str + "none";
+	if (m_kernel_send)
+		str += m_kernel_recv ? "tx,rx" : "tx";
+	else
+		str += "rx";
+	return str;
+}
+
+auto stream::do_result(int ret, boost::system::error_code & ec,
+                       asio::socket_base::wait_type & wait) -> bool {
+	if (ret > 0)
+		return false;
+	const int err = SSL_get_error(m_ssl, ret);
+	switch (err) {
+	case SSL_ERROR_WANT_READ:
+		wait = asio::socket_base::wait_read;
+		return true;
+	case SSL_ERROR_WANT_WRITE:
+		wait = asio::socket_base::wait_write;
+		return true;
+	case SSL_ERROR_ZERO_RETURN:
+		ec = asio::error::eof;
+		break;
+	case SSL_ERROR_SYSCALL:
+		if (const auto e = ERR_peek_error(); e != 0)
+			ec = ssl_error(e);
+		else if (errno != 0)
+			ec = boost::system::error_code(errno, asio::error::get_system_category());
+		else
+			ec = asio::error::eof;
+		break;
+	default:
+		ec = ssl_error(ERR_peek_error() != 0 ? ERR_peek_error() : err);
+	}
+	// Errors left in the thread queue would be reported by the next call
+	ERR_clear_error();
+	return false;
+}
+
+auto stream::do_offload() -> void {
+#if defined(SSL_OP_ENABLE_KTLS)
+	m_kernel_send = BIO_get_ktls_send(SSL_get_wbio(m_ssl)) != 0;
+	m_kernel_recv = BIO_get_ktls_recv(SSL_get_rbio(m_ssl)) != 0;
+#endif
+}
+
+}; // namespace wg::tunnel::tls
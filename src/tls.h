@@ -0,0 +1,158 @@
+// wg-tcp-tunnel - tls.h
+// SPDX-FileCopyrightText: 2023-2025 Arkadiusz Bokowy and contributors
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/asio/ssl.hpp>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include "utils.hpp"
+
+namespace wg::tunnel::tls {
+
+namespace asio = boost::asio;
+using std::size_t;
+
+// Create context for the server side with the given certificate chain
+// and private key (PEM files)
+auto server_context(const std::string & cert, const std::string & key) -> asio::ssl::context;
+// Create context for the client side which verifies the server certificate
+// with the given CA file, or with the system default CA paths if empty
+auto client_context(const std::string & ca) -> asio::ssl::context;
+
+// TLS stream driven by OpenSSL directly on the socket descriptor. After the
+// handshake, OpenSSL hands the session keys to the kernel (kTLS) if it is
+// supported, in which case the data path uses plain socket reads and writes.
+// Otherwise, records are encrypted and decrypted by OpenSSL in user space.
+// Pending operations keep the stream alive, so it shall be shared.
+class stream : public std::enable_shared_from_this<stream> {
+public:
+	using executor_type = utils::stream_socket::executor_type;
+
+	stream(utils::stream_socket & socket, asio::ssl::context & ctx,
+	       asio::ssl::stream_base::handshake_type type, const std::string & server_name = "");
+	stream(const stream &) = delete;
+	auto operator=(const stream &) -> stream & = delete;
+	~stream() { SSL_free(m_ssl); }
+
+	auto get_executor() -> executor_type { return m_socket.get_executor(); }
+
+	template <typename Handler> auto async_handshake(Handler && handler) -> void {
+		do_io([this]() { return SSL_do_handshake(m_ssl); },
+		      [this, self = shared_from_this(),
+		       handler = std::forward<Handler>(handler)](const auto & ec, int) mutable {
+			      if (!ec)
+				      do_offload();
+			      handler(ec);
+		      });
+	}
+
+	template <typename Buffers, typename Handler>
+	auto async_read_some(const Buffers & buffers, Handler && handler) -> void {
+		if (m_kernel_recv) {
+			m_socket.async_read_some(buffers, std::forward<Handler>(handler));
+			return;
+		}
+		asio::mutable_buffer buffer;
+		for (auto it = asio::buffer_sequence_begin(buffers);
+		     it != asio::buffer_sequence_end(buffers) && buffer.size() == 0; ++it)
+			buffer = *it;
+		do_io([this, buffer]() { return SSL_read(m_ssl, buffer.data(), buffer_size(buffer)); },
+		      [handler = std::forward<Handler>(handler)](const auto & ec, int n) mutable {
+			      handler(ec, static_cast<size_t>(n));
+		      });
+	}
+
+	template <typename Buffers, typename Handler>
+	auto async_write_some(const Buffers & buffers, Handler && handler) -> void {
+		if (m_kernel_send) {
+			m_socket.async_write_some(buffers, std::forward<Handler>(handler));
+			return;
+		}
+		// Gather buffers into a single record, so small datagrams are not
+		// encrypted and sent one by one
+		m_write.resize(record_size_max);
+		m_write.resize(asio::buffer_copy(asio::buffer(m_write), buffers));
+		do_io([this]() { return SSL_write(m_ssl, m_write.data(), buffer_size(m_write)); },
+		      [handler = std::forward<Handler>(handler)](const auto & ec, int n) mutable {
+			      handler(ec, static_cast<size_t>(n));
+		      });
+	}
+
+	// Whether the record encryption or decryption is offloaded to the kernel
+	[[nodiscard]] auto kernel_send() const -> bool { return m_kernel_send; }
+	[[nodiscard]] auto kernel_recv() const -> bool { return m_kernel_recv; }
+	// Negotiated protocol version and cipher in a printable form
+	[[nodiscard]] auto description() const -> std::string;
+
+private:
+	// Maximum size of the TLS record payload
+	static constexpr size_t record_size_max = 16 * 1024;
+
+	template <typename T> static auto buffer_size(const T & buffer) -> int {
+		return static_cast<int>(std::min(buffer.size(), record_size_max));
+	}
+
+	// Translate result of the OpenSSL call, return true if the operation shall
+	// be retried once the socket is ready for the returned wait type
+	auto do_result(int ret, boost::system::error_code & ec, asio::socket_base::wait_type & wait)
+	    -> bool;
+	// Call the OpenSSL operation with the error state cleared, as required
+	// for the SSL_get_error() to report the error of that operation
+	template <typename Operation> static auto do_call(Operation & op) -> int {
+		ERR_clear_error();
+		errno = 0;
+		return op();
+	}
+	// Check whether kTLS was enabled for the session
+	auto do_offload() -> void;
+
+	// Call the OpenSSL operation until it completes, the handler is always
+	// invoked through the executor, as required by the composed operations
+	template <typename Operation, typename Handler>
+	auto do_io(Operation && op, Handler && handler) -> void {
+		boost::system::error_code ec;
+		asio::socket_base::wait_type wait = asio::socket_base::wait_read;
+		int ret = 0;
+		// The socket might have been closed and its descriptor reused
+		if (m_socket.native_handle() != SSL_get_fd(m_ssl))
+			ec = asio::error::operation_aborted;
+		else if (do_result(ret = do_call(op), ec, wait)) {
+			m_socket.async_wait(wait, [this, self = shared_from_this(),
+			                           op = std::forward<Operation>(op),
+			                           handler = std::forward<Handler>(handler)](
+			                              const auto & ec2) mutable {
+				if (ec2) {
+					handler(ec2, 0);
+					return;
+				}
+				do_io(std::move(op), std::move(handler));
+			});
+			return;
+		}
+		asio::post(m_socket.get_executor(),
+		           [handler = std::forward<Handler>(handler), ec, ret]() mutable {
+			           handler(ec, ec ? 0 : ret);
+		           });
+	}
+
+	utils::stream_socket & m_socket;
+	SSL * m_ssl;
+	// Data being written by OpenSSL, it must not change between retries
+	std::vector<char> m_write;
+	bool m_kernel_send = false;
+	bool m_kernel_recv = false;
+};
+
+}; // namespace wg::tunnel::tls
@@ -0,0 +1,257 @@
+// wg-tcp-tunnel - tuning.cpp
+// SPDX-FileCopyrightText: 2023-2025 Arkadiusz Bokowy and contributors
+// SPDX-License-Identifier: MIT
+
+#include "tuning.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+#include <boost/asio.hpp>
+
+#include "log.h"
+#include "utils.hpp"
+
+namespace wg::tunnel {
+
+namespace asio = boost::asio;
+#define LOG(lvl) WGTT_LOG(lvl) << "tuning::"
+
+#if defined(__linux__)
+// Layout of the Linux kernel tcp_info structure. The structure provided by
+// the C library is outdated and lacks the delivery rate field.
+struct kernel_tcp_info {
+	uint8_t state;
+	uint8_t ca_state;
+	uint8_t retransmits;
+	uint8_t probes;
+	uint8_t backoff;
+	uint8_t options;
+	uint8_t wscale;
+	uint8_t flags;
+	uint32_t rto;
+	uint32_t ato;
+	uint32_t snd_mss;
+	uint32_t rcv_mss;
+	uint32_t unacked;
+	uint32_t sacked;
+	uint32_t lost;
+	uint32_t retrans;
+	uint32_t fackets;
+	uint32_t last_data_sent;
+	uint32_t last_ack_sent;
+	uint32_t last_data_recv;
+	uint32_t last_ack_recv;
+	uint32_t pmtu;
+	uint32_t rcv_ssthresh;
+	uint32_t rtt;
+	uint32_t rttvar;
+	uint32_t snd_ssthresh;
+	uint32_t snd_cwnd;
+	uint32_t advmss;
+	uint32_t reordering;
+	uint32_t rcv_rtt;
+	uint32_t rcv_space;
+	uint32_t total_retrans;
+	uint64_t pacing_rate;
+	uint64_t max_pacing_rate;
+	uint64_t bytes_acked;
+	uint64_t bytes_received;
+	uint32_t segs_out;
+	uint32_t segs_in;
+	uint32_t notsent_bytes;
+	uint32_t min_rtt;
+	uint32_t data_segs_in;
+	uint32_t data_segs_out;
+	uint64_t delivery_rate;
+};
+#endif
+
+auto socket_tuning::profile(const std::string_view name) -> socket_tuning {
+	socket_tuning tuning;
+	if (name == "custom")
+		return tuning;
+	// Packets are already coalesced in user space, so there is no point in
+	// delaying small writes with Nagle's algorithm.
+	tuning.nodelay = true;
+	if (name == "default")
+		return tuning;
+	if (name == "latency") {
+		tuning.notsent_lowat = 16 * 1024;
+		return tuning;
+	}
+	if (name == "throughput") {
+		tuning.sndbuf = 4 * 1024 * 1024;
+		tuning.rcvbuf = 4 * 1024 * 1024;
+		tuning.congestion = "bbr";
+		return tuning;
+	}
+	throw std::invalid_argument("Unknown socket tuning profile: " + std::string(name));
+}
+
+auto socket_tuning::apply(utils::stream_socket & socket) const -> void {
+
+	boost::system::error_code ec;
+	const auto peer = utils::to_string(socket.remote_endpoint(ec));
+	const auto family = socket.local_endpoint(ec).protocol().family();
+	const bool ip = family == AF_INET || family == AF_INET6;
+	ec.clear();
+	std::ostringstream granted;
+
+	const auto check = [&](const char * name) {
+		if (!ec)
+			return true;
+		LOG(warning) << "apply [" << peer << "]: Couldn't set " << name << ": " << ec.message();
+		granted << " " << name << "=?";
+		ec.clear();
+		return false;
+	};
+
+	// Set the option and read back the value which was granted by the kernel
+	const auto set = [&](const char * name, auto option) {
+		socket.set_option(option, ec);
+		if (!ec)
+			socket.get_option(option, ec);
+		if (check(name))
+			granted << " " << name << "=" << option.value();
+	};
+
+	if (nodelay && ip)
+		set("nodelay", asio::ip::tcp::no_delay(*nodelay));
+
+	if (notsent_lowat && ip) {
+		if (auto err = utils::socket_set_notsent_lowat(socket, *notsent_lowat))
+			ec.assign(err, boost::system::system_category());
+		if (check("notsent-lowat"))
+			granted << " notsent-lowat=" << *notsent_lowat;
+	}
+
+	if (sndbuf)
+		set("sndbuf", asio::socket_base::send_buffer_size(*sndbuf));
+	if (rcvbuf)
+		set("rcvbuf", asio::socket_base::receive_buffer_size(*rcvbuf));
+
+	if (congestion && ip) {
+#if defined(TCP_CONGESTION)
+		const auto fd = socket.native_handle();
+		if (::setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, congestion->data(),
+		                 static_cast<socklen_t>(congestion->size())) == -1)
+			ec.assign(errno, boost::system::system_category());
+		if (check("congestion")) {
+			char name[16] = {};
+			socklen_t len = sizeof(name) - 1;
+			if (::getsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, name, &len) == 0)
+				granted << " congestion=" << name;
+		}
+#else
+		ec = asio::error::operation_not_supported;
+		check("congestion");
+#endif
+	}
+
+	if (busy_poll && ip) {
+#if defined(SO_BUSY_POLL)
+		using busy_poll_option = asio::detail::socket_option::integer<SOL_SOCKET, SO_BUSY_POLL>;
+		set("busy-poll", busy_poll_option(*busy_poll));
+#else
+		ec = asio::error::operation_not_supported;
+		check("busy-poll");
+#endif
+	}
+
+	if (prefer_busy_poll && ip) {
+#if defined(SO_PREFER_BUSY_POLL)
+		using prefer_busy_poll_option =
+		    asio::detail::socket_option::boolean<SOL_SOCKET, SO_PREFER_BUSY_POLL>;
+		set("prefer-busy-poll", prefer_busy_poll_option(*prefer_busy_poll));
+#else
+		ec = asio::error::operation_not_supported;
+		check("prefer-busy-poll");
+#endif
+	}
+
+	if (tos && ip) {
+#if defined(IP_TOS) && defined(IPV6_TCLASS)
+		if (family == AF_INET6)
+			set("tos", asio::detail::socket_option::integer<IPPROTO_IPV6, IPV6_TCLASS>(*tos));
+		else
+			set("tos", asio::detail::socket_option::integer<IPPROTO_IP, IP_TOS>(*tos));
+#else
+		ec = asio::error::operation_not_supported;
+		check("tos");
+#endif
+	}
+
+	if (const auto str = granted.str(); !str.empty())
+		LOG(debug) << "apply [" << peer << "]:" << str;
+}
+
+auto tcp_info_sample::sample(utils::stream_socket & socket, boost::system::error_code & ec)
+    -> tcp_info_sample {
+	tcp_info_sample sample;
+#if defined(__linux__)
+	kernel_tcp_info info = {};
+	socklen_t len = sizeof(info);
+	if (::getsockopt(socket.native_handle(), IPPROTO_TCP, TCP_INFO, &info, &len) == -1) {
+		ec.assign(errno, boost::system::system_category());
+		return sample;
+	}
+	sample.rtt = std::chrono::microseconds(info.rtt);
+	sample.rtt_var = std::chrono::microseconds(info.rttvar);
+	sample.cwnd = info.snd_cwnd;
+	sample.mss = info.snd_mss;
+	sample.retransmits = info.total_retrans;
+	// Older kernels do not report all fields
+	if (len >= offsetof(kernel_tcp_info, notsent_bytes) + sizeof(info.notsent_bytes))
+		sample.notsent_bytes = info.notsent_bytes;
+	if (len >= offsetof(kernel_tcp_info, delivery_rate) + sizeof(info.delivery_rate))
+		sample.delivery_rate = info.delivery_rate;
+#else
+	(void)socket;
+	ec = asio::error::operation_not_supported;
+#endif
+	return sample;
+}
+
+auto tcp_info_sample::bdp() const -> size_t {
+	const auto rtt_s = std::chrono::duration<double>(rtt).count();
+	// Prefer the delivery rate, since the congestion window might not be
+	// fully utilized if the tunnel is application-limited.
+	if (delivery_rate > 0)
+		return static_cast<size_t>(static_cast<double>(delivery_rate) * rtt_s);
+	return static_cast<size_t>(cwnd) * mss;
+}
+
+auto bdp_tuner::update(const tcp_info_sample & sample) -> bool {
+
+	const auto bdp = static_cast<double>(sample.bdp());
+	if (bdp == 0)
+		return false;
+
+	// Smooth the estimate, so a single sample will not cause oscillations
+	m_bdp = m_bdp == 0 ? bdp : 0.75 * m_bdp + 0.25 * bdp;
+
+	const auto bdp_bytes = static_cast<size_t>(m_bdp);
+	// Kernel needs twice the BDP to keep the pipe full during the recovery
+	const auto sndbuf = std::clamp<size_t>(2 * bdp_bytes, 64 * 1024, 16 * 1024 * 1024);
+	const auto queue_limit = std::clamp<size_t>(bdp_bytes, 64 * 1024, 4 * 1024 * 1024);
+	const auto coalesce = std::clamp<size_t>(bdp_bytes / 8, 16 * 1024, 256 * 1024);
+
+	// Apply new sizes only if they differ significantly from the current ones
+	const auto differs = [](size_t a, size_t b) { return 4 * (a > b ? a - b : b - a) > b; };
+	if (!differs(sndbuf, m_sndbuf) && !differs(queue_limit, m_queue_limit) &&
+	    !differs(coalesce, m_coalesce))
+		return false;
+
+	m_sndbuf = sndbuf;
+	m_queue_limit = queue_limit;
+	m_coalesce = coalesce;
+	return true;
+}
+
+}; // namespace wg::tunnel
@@ -0,0 +1,105 @@
+// wg-tcp-tunnel - tuning.h
+// SPDX-FileCopyrightText: 2023-2025 Arkadiusz Bokowy and contributors
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <string_view>
+
+#include <boost/asio.hpp>
+
+#include "utils.hpp"
+
+namespace wg::tunnel {
+
+namespace asio = boost::asio;
+using std::size_t;
+
+// Set of socket options applied to the tunnel TCP sockets
+struct socket_tuning {
+
+	// Get predefined tuning profile: default, latency, throughput or custom
+	static auto profile(const std::string_view name) -> socket_tuning;
+
+	// Apply options to the socket and log the values granted by the kernel,
+	// TCP and IP options are not applied to Unix domain sockets
+	auto apply(utils::stream_socket & socket) const -> void;
+
+	// Disable Nagle's algorithm
+	std::optional<bool> nodelay;
+	// Limit for not sent bytes in the kernel send buffer
+	std::optional<int> notsent_lowat;
+	// Kernel send and receive buffer sizes
+	std::optional<int> sndbuf;
+	std::optional<int> rcvbuf;
+	// Congestion control algorithm, e.g. "bbr"
+	std::optional<std::string> congestion;
+	// Busy polling time in microseconds
+	std::optional<int> busy_poll;
+	// Prefer busy polling over the softirq processing of the device queue
+	std::optional<bool> prefer_busy_poll;
+	// IP type of service (traffic class for IPv6), DSCP is in the upper 6 bits
+	std::optional<int> tos;
+};
+
+// Snapshot of the TCP connection state sampled from the kernel
+struct tcp_info_sample {
+
+	// Sample TCP_INFO of the given socket
+	static auto sample(utils::stream_socket & socket, boost::system::error_code & ec)
+	    -> tcp_info_sample;
+
+	// Bandwidth-delay product estimate in bytes
+	[[nodiscard]] auto bdp() const -> size_t;
+
+	std::chrono::microseconds rtt{ 0 };
+	std::chrono::microseconds rtt_var{ 0 };
+	unsigned int cwnd = 0;
+	unsigned int mss = 0;
+	unsigned int retransmits = 0;
+	unsigned int notsent_bytes = 0;
+	// Recent delivery rate in bytes per second, 0 if not available
+	uint64_t delivery_rate = 0;
+
+	friend auto operator<<(std::ostream & os, const tcp_info_sample & s) -> std::ostream & {
+		os << "rtt=" << s.rtt.count() << "us rttvar=" << s.rtt_var.count()
+		   << "us cwnd=" << s.cwnd << " mss=" << s.mss << " retrans=" << s.retransmits
+		   << " notsent=" << s.notsent_bytes << " rate=" << s.delivery_rate * 8 << "bps";
+		return os;
+	}
+};
+
+// Buffer sizes adapted to the measured bandwidth-delay product
+class bdp_tuner {
+public:
+	// Interval between consecutive TCP_INFO samples
+	static constexpr std::chrono::seconds interval{ 1 };
+
+	// Update the estimate, return true if the tuned sizes have changed
+	auto update(const tcp_info_sample & sample) -> bool;
+
+	[[nodiscard]] auto sndbuf() const -> size_t { return m_sndbuf; }
+	[[nodiscard]] auto queue_limit() const -> size_t { return m_queue_limit; }
+	[[nodiscard]] auto coalesce() const -> size_t { return m_coalesce; }
+
+	friend auto operator<<(std::ostream & os, const bdp_tuner & t) -> std::ostream & {
+		os << "bdp=" << static_cast<size_t>(t.m_bdp) << " sndbuf=" << t.m_sndbuf
+		   << " queue-limit=" << t.m_queue_limit << " coalesce=" << t.m_coalesce;
+		return os;
+	}
+
+private:
+	// Smoothed bandwidth-delay product estimate
+	double m_bdp = 0;
+	size_t m_sndbuf = 0;
+	size_t m_queue_limit = 0;
+	size_t m_coalesce = 0;
+};
+
+}; // namespace wg::tunnel
@@ -4,17 +4,24 @@
 
 #include "udp2tcp.h"
 
+#include <algorithm>
 #include <array>
 #include <chrono>
+#include <cstring>
 #include <functional>
 #include <memory>
 #include <regex>
+#include <sstream>
 #include <stdexcept>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include <boost/asio.hpp>
-#include <boost/log/trivial.hpp>
 
+#include "capture.h"
+#include "log.h"
+#include "probe.h"
 #include "utils.hpp"
 
 namespace wg::tunnel {
@@ -25,16 +32,27 @@ namespace beast = boost::beast;
 namespace ws = beast::websocket;
 #endif
 using namespace std::placeholders;
-#define LOG(lvl) BOOST_LOG_TRIVIAL(lvl) << "udp2tcp::"
+#define LOG(lvl) WGTT_LOG(lvl) << "udp2tcp::"
 
 auto udp2tcp::run(utils::transport transport) -> void {
-	m_ep_tcp_dest_cache = asio::ip::tcp::endpoint();
+	m_ep_tcp_dest_cache = utils::stream_endpoint();
 	LOG(info) << "run: " << utils::to_string(m_ep_udp_acc) << " >> "
 	          << utils::to_string(m_ep_tcp_dest_cache);
 	m_transport = transport;
+	m_ep_tcp_dest_provider.tcp_dest_migrate_handler([this]() { do_migrate(); });
+	m_queue.aqm_codel(std::chrono::milliseconds(m_aqm_codel_target),
+	                  std::chrono::milliseconds(m_aqm_codel_interval));
 #if ENABLE_WEBSOCKET
 	// Ensure that the WebSocket stream will be binary
 	m_ws.binary(true);
+	// Every WebSocket message carries exactly one datagram
+	if (m_transport == utils::transport::websocket)
+		m_queue.coalesce(0);
+#endif
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+	// The same goes for the sequenced-packet socket messages
+	if (m_transport == utils::transport::seqpacket)
+		m_queue.coalesce(0);
 #endif
 	do_send();
 }
@@ -45,43 +63,199 @@ auto udp2tcp::to_string(bool verbose) -> std::string {
 		str += " -> " + utils::to_string(m_ep_udp_acc);
 	str += " >> ";
 	if (verbose)
-		str += utils::to_string(m_socket_tcp_dest.local_endpoint()) + " -> ";
-	str += utils::to_string(m_socket_tcp_dest.remote_endpoint());
+		str += utils::to_string(m_ep_tcp_src) + " -> ";
+	str += utils::to_string(m_ep_tcp_dest_cache);
 	return str;
 }
 
 auto udp2tcp::do_connect() -> void {
+
+	// Connection is already being established
+	if (m_connecting)
+		return;
+
 	try {
-		m_socket_tcp_dest.async_connect(m_ep_tcp_dest_cache = m_ep_tcp_dest_provider.tcp_dest_ep(),
-		                                [this](const auto & ec) { do_connect_handler(ec); });
+		m_connect_candidates = m_ep_tcp_dest_provider.tcp_dest_eps();
 	} catch (const std::exception & e) {
 		LOG(error) << "connect: Get destination TCP endpoint: " << e.what();
-		// Handle next UDP packet
-		do_send();
+		return;
+	}
+
+	if (m_connect_candidates.empty()) {
+		LOG(error) << "connect: No destination TCP endpoint";
+		return;
 	}
+
+	m_connecting = true;
+	m_connect_race++;
+	m_connect_failed = 0;
+	m_connect_sockets.clear();
+	// Sockets must not be relocated while connecting
+	m_connect_sockets.reserve(m_connect_candidates.size());
+	do_connect_attempt();
+}
+
+auto udp2tcp::do_connect_attempt() -> void {
+
+	const auto index = m_connect_sockets.size();
+	if (!m_connecting || index >= m_connect_candidates.size())
+		return;
+
+	const auto & ep = m_connect_candidates[index];
+	LOG(debug) << "connect: Trying: peer=" << utils::to_string(ep);
+
+	auto & socket = m_connect_sockets.emplace_back(m_socket_tcp_dest.get_executor());
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+	if (m_transport == utils::transport::seqpacket) {
+		// Connect would open a stream socket otherwise
+		boost::system::error_code ec;
+		utils::socket_open(socket, ep.protocol(), SOCK_SEQPACKET, ec);
+		if (ec)
+			LOG(warning) << "connect: Couldn't open SOCK_SEQPACKET socket: " << ec.message();
+	}
+#endif
+	// With TCP Fast Open the connection completes immediately if the server
+	// cookie is known, and the SYN is sent with the first write. Such attempt
+	// would always win the race, so it is used for the only candidate.
+	if (m_fast_open && m_connect_candidates.size() == 1 && !utils::is_local(ep)) {
+		boost::system::error_code ec;
+		socket.open(ep.protocol(), ec);
+		if (auto err = ec ? ec.value() : utils::socket_set_fast_open_connect(socket))
+			LOG(warning) << "tcp-fast-open: Couldn't set TCP_FASTOPEN_CONNECT: " << err;
+	}
+	socket.async_connect(ep, [this, race = m_connect_race, index](const auto & ec) {
+		do_connect_attempt_handler(ec, race, index);
+	});
+
+	// Start next attempt if this one will not complete in time
+	if (index + 1 < m_connect_candidates.size()) {
+		m_connect_timer.expires_after(connect_attempt_delay);
+		m_connect_timer.async_wait([this, race = m_connect_race](const auto & ec) {
+			if (!ec && race == m_connect_race)
+				do_connect_attempt();
+		});
+	}
+}
+
+auto udp2tcp::do_connect_attempt_handler(const boost::system::error_code & ec,
+                                         unsigned int race, size_t index) -> void {
+
+	// Ignore attempts which have lost the race
+	if (race != m_connect_race || !m_connecting)
+		return;
+
+	if (ec) {
+		LOG(debug) << "connect [" << utils::to_string(m_connect_candidates[index])
+		           << "]: " << ec.message();
+		boost::system::error_code ec2;
+		m_connect_sockets[index].close(ec2);
+		if (++m_connect_failed < m_connect_candidates.size()) {
+			// Do not wait for the delay to elapse, try next candidate right away
+			if (m_connect_failed == m_connect_sockets.size()) {
+				m_connect_timer.cancel();
+				do_connect_attempt();
+			}
+			return;
+		}
+		m_connecting = false;
+		m_ep_tcp_dest_cache = m_connect_candidates[index];
+		do_connect_handler(ec);
+		return;
+	}
+
+	m_connecting = false;
+	m_connect_timer.cancel();
+	boost::system::error_code ec2;
+	for (size_t i = 0; i < m_connect_sockets.size(); i++)
+		if (i != index)
+			m_connect_sockets[i].close(ec2);
+
+	m_socket_tcp_dest = std::move(m_connect_sockets[index]);
+	m_ep_tcp_dest_cache = m_connect_candidates[index];
+	do_connect_handler(ec);
 }
 
 auto udp2tcp::do_connect_handler(const boost::system::error_code & ec) -> void {
 
+	WGTT_PROBE(udp2tcp_connect, probe::id(this), ec.value());
+
 	if (ec) {
 		LOG(error) << "connect [" << utils::to_string(m_ep_tcp_dest_cache)
 		           << "]: " << ec.message();
-		m_socket_tcp_dest.close();
-		// Handle next UDP packet
-		do_send();
+		do_close();
 		return;
 	}
 
 	LOG(debug) << "connect: Connected: peer=" << utils::to_string(m_ep_tcp_dest_cache);
+	// Resolve the local endpoint once, so it is not queried on every packet
+	boost::system::error_code ec_src;
+	m_ep_tcp_src = m_socket_tcp_dest.local_endpoint(ec_src);
+	m_socket_ops.add(1);
+
+	m_ctrl_ext = false;
+	m_ping.reset();
+	// Control frames are queued before the connection is marked as connected,
+	// so they will be written together ahead of any data
+	if (m_transport == utils::transport::raw) {
+		// Announce support for extended control frames
+		do_ctrl(utils::ctrl::type::hello, nullptr, 0);
+		// Resume the previous session, so the server will forward our traffic
+		// from the same UDP endpoint. The request shall be sent only to the
+		// server which has issued the token.
+		if (m_session && m_session_ep == m_ep_tcp_dest_cache) {
+			LOG(debug) << "resume [" << utils::to_string(m_ep_tcp_dest_cache)
+			           << "]: Resuming session";
+			do_ctrl(utils::ctrl::type::resume, &*m_session, sizeof(*m_session));
+		}
+	}
+
+	m_ep_tcp_dest_provider.tcp_dest_connected(m_ep_tcp_dest_cache);
 
-	if (m_tcp_keep_alive_idle_time > 0) {
-		LOG(debug) << "tcp-keepalive [" << utils::to_string(m_socket_tcp_dest.remote_endpoint())
+	// Unix domain sockets do not support TCP-level options
+	const bool local = utils::is_local(m_ep_tcp_dest_cache);
+
+	if (m_tcp_keep_alive_idle_time > 0 && !local) {
+		LOG(debug) << "tcp-keepalive [" << utils::to_string(m_ep_tcp_dest_cache)
 		           << "]: idle=" << m_tcp_keep_alive_idle_time;
 		utils::socket_set_keep_alive_idle(m_socket_tcp_dest, m_tcp_keep_alive_idle_time);
-		m_socket_tcp_dest.set_option(asio::socket_base::keep_alive(true));
-		m_socket_tcp_dest.set_option(asio::socket_base::linger(true, 0));
+		boost::system::error_code ec2;
+		m_socket_tcp_dest.set_option(asio::socket_base::keep_alive(true), ec2);
+		if (!ec2)
+			m_socket_tcp_dest.set_option(asio::socket_base::linger(true, 0), ec2);
+		if (ec2)
+			LOG(warning) << "tcp-keepalive: Couldn't set SO_KEEPALIVE: " << ec2.message();
+	}
+
+	if (m_aqm_codel_target > 0 && !local) {
+		// Keep the kernel send buffer shallow for the AQM to be effective
+		LOG(debug) << "aqm-codel [" << utils::to_string(m_ep_tcp_dest_cache)
+		           << "]: target=" << m_aqm_codel_target << " interval=" << m_aqm_codel_interval;
+		if (auto err = utils::socket_set_notsent_lowat(m_socket_tcp_dest,
+		                                               egress_queue::aqm_notsent_lowat))
+			LOG(warning) << "aqm-codel: Couldn't set TCP_NOTSENT_LOWAT: " << err;
 	}
 
+	m_socket_tuning.apply(m_socket_tcp_dest);
+
+#if ENABLE_TLS
+	if (m_tls_context) {
+		try {
+			m_tls = std::make_shared<tls::stream>(m_socket_tcp_dest, *m_tls_context,
+			                                      asio::ssl::stream_base::client,
+			                                      m_tls_server_name);
+		} catch (const std::exception & e) {
+			LOG(error) << "connect [" << utils::to_string(m_ep_tcp_dest_cache)
+			           << "]: TLS: " << e.what();
+			do_close();
+			return;
+		}
+		LOG(debug) << "connect: TLS handshake: peer=" << utils::to_string(m_ep_tcp_dest_cache);
+		// Queued control frames are written once the handshake is done
+		m_tls->async_handshake([this](const auto & ec2) { do_tls_handshake_handler(ec2); });
+		return;
+	}
+#endif
+
 #if ENABLE_WEBSOCKET
 	if (m_transport == utils::transport::websocket) {
 		// Set suggested timeout settings for the websocket client
@@ -94,21 +268,245 @@ auto udp2tcp::do_connect_handler(const boost::system::error_code & ec) -> void {
 		LOG(debug) << "connect: Handshake: peer=" << utils::to_string(m_ep_tcp_dest_cache);
 		// Perform WebSocket handshake. In order to override the hard-coded "Host"
 		// header, user needs to provide the "Host" header via ws_headers() method.
-		m_ws.handshake("example.com", "/");
+		m_ws.async_handshake("example.com", "/",
+		                     [this](const auto & ec2) { do_ws_handshake_handler(ec2); });
+		return;
+	}
+#endif
+
+	// Unix domain sockets do not support MSG_ZEROCOPY
+	if (m_zerocopy_threshold > 0 && !local)
+		if (auto err = m_zerocopy.enable(m_socket_tcp_dest, m_zerocopy_threshold))
+			LOG(warning) << "zerocopy: Couldn't set SO_ZEROCOPY: " << err;
+
+	do_established();
+}
+
+#if ENABLE_WEBSOCKET
+auto udp2tcp::do_ws_handshake_handler(const boost::system::error_code & ec) -> void {
+
+	if (ec) {
+		if (ec == asio::error::operation_aborted)
+			return;
+		LOG(error) << "connect [" << utils::to_string(m_ep_tcp_dest_cache)
+		           << "]: Handshake: " << ec.message();
+		do_close();
+		return;
+	}
+
+	do_established();
+}
+#endif
+
+#if ENABLE_TLS
+auto udp2tcp::do_tls_handshake_handler(const boost::system::error_code & ec) -> void {
+
+	if (ec) {
+		if (ec == asio::error::operation_aborted)
+			return;
+		LOG(error) << "connect [" << utils::to_string(m_ep_tcp_dest_cache)
+		           << "]: TLS handshake: " << ec.message();
+		do_close();
+		return;
 	}
+
+	LOG(debug) << "connect [" << utils::to_string(m_ep_tcp_dest_cache)
+	           << "]: TLS: " << m_tls->description();
+	do_established();
+}
 #endif
 
-	// Send UDP packet which was waiting for TCP connection
+auto udp2tcp::do_established() -> void {
+
+	m_socket_tcp_dest_connected = true;
+	// Send UDP packets which were waiting for TCP connection
 	do_send_buffer();
 
-	// Handle next UDP packet
-	do_send();
+	// Start sampling TCP info for buffer sizes auto-tuning
+	if (m_auto_tune && !utils::is_local(m_ep_tcp_dest_cache))
+		do_auto_tune();
 	// Start handling application-level keep-alive
 	do_app_keep_alive_init();
 	// Start handling TCP packets
 	do_recv_init();
 }
 
+auto udp2tcp::do_close() -> void {
+	WGTT_PROBE(udp2tcp_close, probe::id(this), m_queue.bytes(), m_queue.dropped());
+	m_ep_tcp_dest_cache = utils::stream_endpoint();
+	m_app_keep_alive_timer.cancel();
+	m_auto_tune_timer.cancel();
+	m_ping_timer.cancel();
+	m_socket_tcp_dest_connected = false;
+	// Packets of zero-copy sends are held until the kernel completes them
+	m_zerocopy.retire(m_socket_tcp_dest);
+	boost::system::error_code ec;
+	m_socket_tcp_dest.close(ec);
+	// Control frames were meant for the peer of the closed connection, the new
+	// connection starts with the hello frame
+	m_queue.clear_ctrl_frames();
+#if ENABLE_TLS
+	// Pending operations keep the stream until they are aborted
+	m_tls.reset();
+#endif
+}
+
+auto udp2tcp::handoff(class handoff & state) -> void {
+	LOG(info) << "handoff [" << utils::to_string(m_ep_udp_acc) << "]: Passing UDP socket";
+	state.add_socket(utils::to_string(m_ep_udp_acc),
+	                 handoff::duplicate(m_socket_udp_acc.native_handle()));
+}
+
+auto udp2tcp::stop() -> void {
+	m_connecting = false;
+	m_connect_timer.cancel();
+	boost::system::error_code ec;
+	for (auto & socket : m_connect_sockets)
+		socket.close(ec);
+	do_close();
+	m_socket_udp_acc.close(ec);
+}
+
+auto udp2tcp::do_migrate() -> void {
+
+	if (!m_socket_tcp_dest_connected)
+		return;
+
+	LOG(info) << "migrate [" << utils::to_string(m_ep_tcp_dest_cache)
+	          << "]: Switching to better destination";
+	// Control frames queued for the old destination are dropped on close,
+	// queued packets will be sent over the new connection
+	do_close();
+	do_connect();
+}
+
+auto udp2tcp::do_ctrl(utils::ctrl::type type, const void * body, size_t length) -> void {
+	auto pkt = m_queue.acquire();
+	pkt.frame(type, body, length);
+	m_queue.push(std::move(pkt));
+	do_send_buffer();
+}
+
+auto udp2tcp::do_ctrl_handler(utils::ctrl::type type, const void * body) -> void {
+	switch (type) {
+	case utils::ctrl::type::none:
+		break;
+	case utils::ctrl::type::hello:
+		if (std::exchange(m_ctrl_ext, true))
+			break;
+		LOG(debug) << "ctrl [" << utils::to_string(m_ep_tcp_dest_cache)
+		           << "]: Extended control frames enabled";
+		if (m_ping_interval > 0)
+			do_ping();
+		break;
+	case utils::ctrl::type::ping:
+		do_ctrl(utils::ctrl::type::pong, body, sizeof(utils::ctrl::ping));
+		break;
+	case utils::ctrl::type::pong: {
+		utils::ctrl::ping pong;
+		std::memcpy(&pong, body, sizeof(pong));
+		const auto rtt = std::chrono::duration_cast<std::chrono::microseconds>(m_ping.pong(pong));
+		LOG(trace) << "ping [" << utils::to_string(m_ep_tcp_dest_cache)
+		           << "]: rtt=" << rtt.count() << "us";
+	} break;
+	case utils::ctrl::type::session:
+		m_session.emplace();
+		std::memcpy(&*m_session, body, sizeof(*m_session));
+		m_session_ep = m_ep_tcp_dest_cache;
+		break;
+	case utils::ctrl::type::resume:
+		// Sessions are resumed by the client only
+		break;
+	}
+}
+
+auto udp2tcp::do_ping() -> void {
+	m_ping_timer.expires_after(std::chrono::milliseconds(m_ping_interval));
+	m_ping_timer.async_wait([this](const auto & ec) { do_ping_handler(ec); });
+}
+
+auto udp2tcp::do_ping_handler(const boost::system::error_code & ec) -> void {
+
+	if (ec) {
+		if (ec == asio::error::operation_aborted)
+			return;
+		LOG(error) << "ping [" << utils::to_string(m_ep_tcp_dest_cache) << "]: " << ec.message();
+		return;
+	}
+
+	if (m_ping.missed() >= static_cast<unsigned int>(m_ping_count)) {
+		LOG(warning) << "ping [" << utils::to_string(m_ep_tcp_dest_cache)
+		             << "]: Peer not responding: missed=" << m_ping.missed();
+		do_close();
+		// Reconnect right away, so the queued packets will not be lost
+		do_connect();
+		return;
+	}
+
+	const auto body = m_ping.ping();
+	do_ctrl(utils::ctrl::type::ping, &body, sizeof(body));
+
+	// Schedule next ping
+	do_ping();
+}
+
+auto udp2tcp::log_stats() -> void {
+	std::ostringstream str;
+	str << utils::to_string(m_ep_udp_acc) << " >> " << utils::to_string(m_ep_tcp_dest_cache)
+	    << " queue=" << m_queue.bytes() << " dropped=" << m_queue.dropped()
+	    << " aqm-dropped=" << m_queue.dropped_aqm() << m_socket_ops << m_zerocopy;
+	boost::system::error_code ec;
+	if (m_socket_tcp_dest_connected)
+		if (auto sample = tcp_info_sample::sample(m_socket_tcp_dest, ec); !ec)
+			str << " " << sample;
+	if (m_auto_tune)
+		str << " " << m_auto_tuner;
+	if (m_ping.srtt().count() > 0)
+		str << " ping-rtt="
+		    << std::chrono::duration_cast<std::chrono::microseconds>(m_ping.srtt()).count()
+		    << "us";
+	LOG(info) << "stats: " << str.str();
+}
+
+auto udp2tcp::do_auto_tune() -> void {
+	m_auto_tune_timer.expires_after(bdp_tuner::interval);
+	m_auto_tune_timer.async_wait([this](const auto & ec) { do_auto_tune_handler(ec); });
+}
+
+auto udp2tcp::do_auto_tune_handler(const boost::system::error_code & ec) -> void {
+
+	if (ec) {
+		if (ec == asio::error::operation_aborted)
+			return;
+		LOG(error) << "auto-tune [" << utils::to_string(m_ep_tcp_dest_cache)
+		           << "]: " << ec.message();
+		return;
+	}
+
+	boost::system::error_code ec2;
+	m_tcp_info = tcp_info_sample::sample(m_socket_tcp_dest, ec2);
+	if (ec2) {
+		LOG(debug) << "auto-tune [" << utils::to_string(m_ep_tcp_dest_cache)
+		           << "]: Couldn't sample TCP info: " << ec2.message();
+		return;
+	}
+
+	LOG(trace) << "auto-tune [" << utils::to_string(m_ep_tcp_dest_cache) << "]: " << m_tcp_info;
+	if (m_auto_tuner.update(m_tcp_info)) {
+		LOG(debug) << "auto-tune [" << utils::to_string(m_ep_tcp_dest_cache)
+		           << "]: " << m_auto_tuner;
+		m_socket_tcp_dest.set_option(
+		    asio::socket_base::send_buffer_size(m_auto_tuner.sndbuf()), ec2);
+		m_queue.limit(m_auto_tuner.queue_limit());
+		// Coalescing is disabled for message-oriented transports
+		if (m_queue.coalesce() != 0)
+			m_queue.coalesce(m_auto_tuner.coalesce());
+	}
+
+	// Schedule next sample
+	do_auto_tune();
+}
+
 auto udp2tcp::do_app_keep_alive_init() -> void {
 	do_app_keep_alive(true);
 }
@@ -140,59 +538,144 @@ auto udp2tcp::do_app_keep_alive_handler(const boost::system::error_code & ec) ->
 	LOG(debug) << "app-keepalive [" << to_string() << "]: Sending keep-alive packet";
 
 	// Send a control packet
-	utils::ip::udp::header header(m_ep_udp_sender.port(), m_ep_udp_acc.port(), 0);
-	m_socket_tcp_dest.send(asio::buffer(&header, sizeof(header)));
+	auto pkt = m_queue.acquire();
+	pkt.frame(0, m_ep_udp_sender.port(), m_ep_udp_acc.port());
+	m_queue.push(std::move(pkt));
+	do_send_buffer();
 
 	// Initialize next keep-alive timer
 	do_app_keep_alive_init();
 }
 
 auto udp2tcp::do_send() -> void {
+	m_buffer_send = m_queue.acquire();
 	m_socket_udp_acc.async_receive_from(
-	    asio::buffer(m_buffer_send), m_ep_udp_sender,
+	    m_buffer_send.payload(), m_ep_udp_sender,
 	    [this](const auto & ec, size_t length) { do_send_handler(ec, length); });
 }
 
 auto udp2tcp::do_send_buffer() -> void {
-	LOG(trace) << "send [" << to_string(true) << "]: len=" << m_buffer_send_length;
+
+	if (!m_socket_tcp_dest_connected || m_queue_writing || m_queue.empty())
+		return;
+
+	m_queue.pop(m_queue_batch);
+	m_queue_batch_buffers.clear();
+	for (const auto & pkt : m_queue_batch)
+		m_queue_batch_buffers.push_back(pkt.data());
+	m_queue_writing = true;
+	m_queue_dequeued = capture::stamp();
+
 	switch (m_transport) {
-	case utils::transport::raw: {
-		// Send payload with attached UDP header
-		utils::ip::udp::header header(m_ep_udp_sender.port(), m_ep_udp_acc.port(),
-		                              static_cast<uint16_t>(m_buffer_send_length));
-		const std::array<asio::const_buffer, 2> iovec{ asio::buffer(&header, sizeof(header)),
-			                                           asio::buffer(m_buffer_send,
-			                                                        m_buffer_send_length) };
-		m_socket_tcp_dest.send(iovec);
-	} break;
+	case utils::transport::raw:
+		if (m_zerocopy.eligible(asio::buffer_size(m_queue_batch_buffers))) {
+			m_zerocopy.async_write(m_socket_tcp_dest, m_queue_batch_buffers,
+			                       [this](const auto & ec, size_t length) {
+				                       do_send_buffer_handler(ec, length);
+			                       });
+			break;
+		}
+		with_stream([this](auto & stream) {
+			asio::async_write(stream, m_queue_batch_buffers,
+			                  [this](const auto & ec, size_t length) {
+				                  do_send_buffer_handler(ec, length);
+			                  });
+		});
+		break;
 #if ENABLE_WEBSOCKET
 	case utils::transport::websocket:
-		m_ws.write(asio::buffer(m_buffer_send, m_buffer_send_length));
+		m_ws.async_write(m_queue_batch_buffers.front(), [this](const auto & ec, size_t length) {
+			do_send_buffer_handler(ec, length);
+		});
+		break;
+#endif
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+	case utils::transport::seqpacket:
+		m_socket_tcp_dest.async_send(m_queue_batch_buffers.front(),
+		                             [this](const auto & ec, size_t length) {
+			                             do_send_buffer_handler(ec, length);
+		                             });
 		break;
 #endif
 	}
 }
 
+auto udp2tcp::do_send_buffer_handler(const boost::system::error_code & ec, size_t length)
+    -> void {
+
+	m_queue_writing = false;
+	const auto enqueued = m_queue_batch.front().timestamp;
+	if (!ec)
+		capture::record(capture::point::udp2tcp_tx, m_queue_batch, m_ep_udp_sender, m_ep_udp_acc,
+		                m_queue_dequeued);
+	m_zerocopy.release(m_queue_batch);
+
+	if (ec) {
+		if (ec == asio::error::operation_aborted)
+			return;
+		LOG(error) << "send [" << utils::to_string(m_ep_tcp_dest_cache) << "]: " << ec.message();
+		// Connection is broken, the next datagram will trigger reconnection
+		do_close();
+		return;
+	}
+
+	LOG(trace) << "send [" << to_string(true) << "]: len=" << length;
+	WGTT_PROBE(udp2tcp_tcp_write, probe::id(this), length, probe::ns(enqueued));
+	m_socket_ops.add(1);
+	m_zerocopy.async_wait(m_socket_tcp_dest, nullptr);
+
+	// Write next batch of queued packets
+	do_send_buffer();
+}
+
 auto udp2tcp::do_send_handler(const boost::system::error_code & ec, size_t length) -> void {
 
 	if (ec) {
-		LOG(error) << "send [" << to_string() << "]: " << ec.message();
+		// UDP socket was passed to the new process
+		if (ec == asio::error::operation_aborted && !m_socket_udp_acc.is_open())
+			return;
+		LOG(error) << "send [" << utils::to_string(m_ep_udp_acc) << "]: " << ec.message();
 		// Try to recover from error
 		do_send();
 		return;
 	}
 
-	// Save the length of the payload
-	m_buffer_send_length = length;
+	WGTT_PROBE(udp2tcp_udp_recv, probe::id(this), length);
+	m_socket_ops.add(1, 1);
+	switch (m_transport) {
+	case utils::transport::raw:
+		m_buffer_send.frame(length, m_ep_udp_sender.port(), m_ep_udp_acc.port());
+		break;
+#if ENABLE_WEBSOCKET
+	case utils::transport::websocket:
+		m_buffer_send.frame(length);
+		break;
+#endif
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+	case utils::transport::seqpacket:
+		// Empty message would be taken by the server for the end of stream
+		if (length == 0) {
+			do_send();
+			return;
+		}
+		m_buffer_send.frame(length);
+		break;
+#endif
+	}
+	WGTT_PROBE(udp2tcp_frame_encode, probe::id(this), m_buffer_send.length,
+	           m_buffer_send.priority);
 
-	if (!m_socket_tcp_dest.is_open()) {
+	if (!m_queue.push(std::move(m_buffer_send)))
+		LOG(debug) << "send [" << utils::to_string(m_ep_udp_sender)
+		           << "]: Queue full: dropped=" << m_queue.dropped();
+
+	if (!m_socket_tcp_dest.is_open())
 		do_connect();
-		return;
+	else {
+		do_send_buffer();
+		do_app_keep_alive();
 	}
 
-	do_send_buffer();
-	do_app_keep_alive();
-
 	// Handle next UDP packet
 	do_send();
 }
@@ -206,15 +689,22 @@ auto udp2tcp::do_recv_init() -> void {
 	case utils::transport::websocket:
 		do_ws_recv();
 		break;
+#endif
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+	case utils::transport::seqpacket:
+		do_seqpacket_recv();
+		break;
 #endif
 	}
 }
 
 auto udp2tcp::do_recv(std::size_t rlen, bool ctrl) -> void {
 	m_buffer_recv.consume(m_buffer_recv.size()); // Clear any previous data
-	asio::async_read(
-	    m_socket_tcp_dest, m_buffer_recv, asio::transfer_exactly(rlen),
-	    [this, ctrl](const auto & ec, size_t length) { do_recv_handler(ec, length, ctrl); });
+	with_stream([this, rlen, ctrl](auto & stream) {
+		asio::async_read(
+		    stream, m_buffer_recv, asio::transfer_exactly(rlen),
+		    [this, ctrl](const auto & ec, size_t length) { do_recv_handler(ec, length, ctrl); });
+	});
 }
 
 auto udp2tcp::do_recv_handler(const boost::system::error_code & ec, size_t length, bool ctrl)
@@ -223,33 +713,45 @@ auto udp2tcp::do_recv_handler(const boost::system::error_code & ec, size_t lengt
 	if (ec) {
 		if (ec == asio::error::operation_aborted)
 			return;
-		if (ec == asio::error::eof || ec == asio::error::connection_reset) {
+		if (ec == asio::error::eof || ec == asio::error::connection_reset ||
+		    ec == asio::error::connection_aborted) {
 			LOG(debug) << "recv: Connection closed: peer="
 			           << utils::to_string(m_ep_tcp_dest_cache);
-			m_ep_tcp_dest_cache = asio::ip::tcp::endpoint();
-			m_app_keep_alive_timer.cancel();
-			m_socket_tcp_dest.close();
+			do_close();
 			return;
 		}
 		LOG(error) << "recv [" << to_string() << "]: " << ec.message();
-		// Try to recover from error
-		do_recv_init();
+		// Framing can not be recovered, the next datagram will trigger reconnection
+		do_close();
 		return;
 	}
 
 	LOG(trace) << "recv [" << to_string(true) << "]: len=" << length;
+	m_socket_ops.add(1);
 
 	if (ctrl) {
 		auto header =
 		    reinterpret_cast<const utils::ip::udp::header *>(m_buffer_recv.data().data());
 		if (!header->valid()) {
 			LOG(warning) << "recv [" << to_string() << "]: Invalid UDP header";
+			WGTT_PROBE(udp2tcp_invalid_header, probe::id(this));
 			// Handle next TCP packet
 			do_recv_init();
 			return;
 		}
+		m_ctrl_type = utils::ctrl::get_type(*header);
+		WGTT_PROBE(udp2tcp_frame_decode, probe::id(this), header->m_length,
+		           static_cast<int>(m_ctrl_type));
 		// Check if the packet is a control packet
 		if (header->m_length == 0) {
+			const auto size = utils::ctrl::get_body_size(m_ctrl_type);
+			if (size > 0 && m_ctrl_ext) {
+				// Handle control frame body
+				do_recv(size);
+				return;
+			}
+			if (size == 0 && m_ctrl_type != utils::ctrl::type::none)
+				do_ctrl_handler(m_ctrl_type, nullptr);
 			// Handle next TCP packet
 			do_recv_init();
 			return;
@@ -259,8 +761,24 @@ auto udp2tcp::do_recv_handler(const boost::system::error_code & ec, size_t lengt
 		return;
 	}
 
+	if (m_ctrl_type != utils::ctrl::type::none) {
+		do_ctrl_handler(m_ctrl_type, m_buffer_recv.data().data());
+		// Handle next TCP packet
+		do_recv_init();
+		return;
+	}
+
 	if (m_ep_udp_sender.port() != 0) {
-		m_socket_udp_acc.send_to(m_buffer_recv.data(), m_ep_udp_sender);
+		boost::system::error_code ec2;
+		const auto decoded = capture::stamp();
+		m_socket_udp_acc.send_to(m_buffer_recv.data(), m_ep_udp_sender, 0, ec2);
+		WGTT_PROBE(udp2tcp_udp_send, probe::id(this), m_buffer_recv.size(), ec2.value());
+		m_socket_ops.add(1, 1);
+		if (ec2)
+			LOG(debug) << "recv [" << utils::to_string(m_ep_udp_sender) << "]: " << ec2.message();
+		else
+			capture::record(capture::point::udp2tcp_rx, m_buffer_recv.data(), m_ep_udp_acc,
+			                m_ep_udp_sender, decoded, decoded);
 		do_app_keep_alive();
 	}
 
@@ -281,23 +799,35 @@ auto udp2tcp::do_ws_recv_handler(const boost::system::error_code & ec, size_t le
 	if (ec) {
 		if (ec == asio::error::operation_aborted)
 			return;
-		if (ec == asio::error::eof || ec == asio::error::connection_reset) {
+		if (ec == asio::error::eof || ec == asio::error::connection_reset ||
+		    ec == asio::error::connection_aborted) {
 			LOG(debug) << "recv: Connection closed: peer="
 			           << utils::to_string(m_ep_tcp_dest_cache);
-			m_ep_tcp_dest_cache = asio::ip::tcp::endpoint();
-			m_socket_tcp_dest.close();
+			do_close();
 			return;
 		}
 		LOG(error) << "recv [" << to_string() << "]: " << ec.message();
-		// Try to recover from error
-		do_ws_recv();
+		// Framing can not be recovered, the next datagram will trigger reconnection
+		do_close();
 		return;
 	}
 
 	LOG(trace) << "recv [" << to_string(true) << "]: len=" << length;
+	WGTT_PROBE(udp2tcp_frame_decode, probe::id(this), length, 0);
+	m_socket_ops.add(1);
 
-	if (m_ep_udp_sender.port() != 0)
-		m_socket_udp_acc.send_to(m_ws_buffer_recv.data(), m_ep_udp_sender);
+	if (m_ep_udp_sender.port() != 0) {
+		boost::system::error_code ec2;
+		const auto decoded = capture::stamp();
+		m_socket_udp_acc.send_to(m_ws_buffer_recv.data(), m_ep_udp_sender, 0, ec2);
+		WGTT_PROBE(udp2tcp_udp_send, probe::id(this), m_ws_buffer_recv.size(), ec2.value());
+		m_socket_ops.add(1, 1);
+		if (ec2)
+			LOG(debug) << "recv [" << utils::to_string(m_ep_udp_sender) << "]: " << ec2.message();
+		else
+			capture::record(capture::point::udp2tcp_rx, m_ws_buffer_recv.data(), m_ep_udp_acc,
+			                m_ep_udp_sender, decoded, decoded);
+	}
 
 	// Handle next TCP packet
 	do_ws_recv();
@@ -305,13 +835,229 @@ auto udp2tcp::do_ws_recv_handler(const boost::system::error_code & ec, size_t le
 
 #endif
 
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+
+auto udp2tcp::do_seqpacket_recv() -> void {
+	m_buffer_recv.consume(m_buffer_recv.size()); // Clear any previous data
+	m_socket_tcp_dest.async_receive(
+	    m_buffer_recv.prepare(packet::payload_size_max),
+	    [this](const auto & ec, size_t length) { do_seqpacket_recv_handler(ec, length); });
+}
+
+auto udp2tcp::do_seqpacket_recv_handler(const boost::system::error_code & ec, size_t length)
+    -> void {
+
+	// Empty messages are never sent, so zero length means end of stream
+	if (!ec && length == 0) {
+		LOG(debug) << "recv: Connection closed: peer=" << utils::to_string(m_ep_tcp_dest_cache);
+		do_close();
+		return;
+	}
+
+	if (ec) {
+		if (ec == asio::error::operation_aborted)
+			return;
+		if (ec == asio::error::connection_reset || ec == asio::error::connection_aborted) {
+			LOG(debug) << "recv: Connection closed: peer="
+			           << utils::to_string(m_ep_tcp_dest_cache);
+			do_close();
+			return;
+		}
+		LOG(error) << "recv [" << to_string() << "]: " << ec.message();
+		do_close();
+		return;
+	}
+
+	LOG(trace) << "recv [" << to_string(true) << "]: len=" << length;
+	WGTT_PROBE(udp2tcp_frame_decode, probe::id(this), length, 0);
+	m_socket_ops.add(1);
+	m_buffer_recv.commit(length);
+
+	if (m_ep_udp_sender.port() != 0) {
+		boost::system::error_code ec2;
+		const auto decoded = capture::stamp();
+		m_socket_udp_acc.send_to(m_buffer_recv.data(), m_ep_udp_sender, 0, ec2);
+		WGTT_PROBE(udp2tcp_udp_send, probe::id(this), length, ec2.value());
+		m_socket_ops.add(1, 1);
+		if (ec2)
+			LOG(debug) << "recv [" << utils::to_string(m_ep_udp_sender) << "]: " << ec2.message();
+		else
+			capture::record(capture::point::udp2tcp_rx, m_buffer_recv.data(), m_ep_udp_acc,
+			                m_ep_udp_sender, decoded, decoded);
+	}
+
+	// Handle next message
+	do_seqpacket_recv();
+}
+
+#endif
+
+auto udp2tcp_dest_provider::interleave(const std::vector<utils::stream_endpoint> & eps)
+    -> std::vector<utils::stream_endpoint> {
+	std::vector<utils::stream_endpoint> first, second, result;
+	// Start with the address family of the first (most preferred) endpoint
+	const auto family = eps.empty() ? AF_UNSPEC : eps.front().protocol().family();
+	for (const auto & ep : eps)
+		(ep.protocol().family() == family ? first : second).push_back(ep);
+	for (size_t i = 0; i < std::max(first.size(), second.size()); i++) {
+		if (i < first.size())
+			result.push_back(first[i]);
+		if (i < second.size())
+			result.push_back(second[i]);
+	}
+	return result;
+}
+
+udp2tcp_dest_provider_pool::udp2tcp_dest_provider_pool(
+    asio::io_context & ioc, const std::vector<utils::stream_endpoint> & eps,
+    std::chrono::seconds interval)
+    : m_interval(interval), m_timer(ioc) {
+	for (const auto & ep : eps)
+		m_destinations.push_back(std::make_unique<destination>(ioc, ep));
+}
+
+auto udp2tcp_dest_provider_pool::run() -> void {
+	do_probe();
+}
+
+auto udp2tcp_dest_provider_pool::tcp_dest_eps() -> std::vector<utils::stream_endpoint> {
+	std::vector<utils::stream_endpoint> eps;
+	for (const auto * dest : ranked())
+		eps.push_back(dest->ep);
+	return eps;
+}
+
+auto udp2tcp_dest_provider_pool::tcp_dest_connected(const utils::stream_endpoint & ep)
+    -> void {
+	m_connected = nullptr;
+	for (auto & dest : m_destinations)
+		if (dest->ep == ep)
+			m_connected = dest.get();
+}
+
+auto udp2tcp_dest_provider_pool::ranked() -> std::vector<destination *> {
+	std::vector<destination *> dests;
+	for (auto & dest : m_destinations)
+		dests.push_back(dest.get());
+	// Destinations which were not measured yet keep the configured order
+	const auto rtt = [](const destination * d) {
+		return d->srtt.count() == 0 ? std::chrono::microseconds::max() : d->srtt;
+	};
+	std::stable_sort(dests.begin(), dests.end(), [&](const auto * a, const auto * b) {
+		if (a->down() != b->down())
+			return b->down();
+		return rtt(a) < rtt(b);
+	});
+	return dests;
+}
+
+auto udp2tcp_dest_provider_pool::do_probe() -> void {
+
+	for (auto & d : m_destinations) {
+		auto & dest = *d;
+		if (dest.probing) {
+			// Previous probe did not complete within the interval
+			LOG(debug) << "tcp-provider-pool [" << utils::to_string(dest.ep)
+			           << "]: Probe timeout";
+			dest.failures++;
+			boost::system::error_code ec;
+			dest.socket.close(ec);
+		}
+		dest.probing = true;
+		dest.probe_start = std::chrono::steady_clock::now();
+		dest.socket.async_connect(dest.ep, [this, &dest, probe = ++dest.probe](const auto & ec) {
+			do_probe_connect_handler(ec, dest, probe);
+		});
+	}
+
+	do_check();
+
+	m_timer.expires_after(m_interval);
+	m_timer.async_wait([this](const auto & ec) { do_probe_handler(ec); });
+}
+
+auto udp2tcp_dest_provider_pool::do_probe_handler(const boost::system::error_code & ec)
+    -> void {
+
+	if (ec) {
+		if (ec == asio::error::operation_aborted)
+			return;
+		LOG(error) << "tcp-provider-pool: " << ec.message();
+		return;
+	}
+
+	do_probe();
+}
+
+auto udp2tcp_dest_provider_pool::do_probe_connect_handler(const boost::system::error_code & ec,
+                                                          destination & dest,
+                                                          unsigned int probe) -> void {
+
+	// Probe was timed out and the result was already accounted
+	if (probe != dest.probe)
+		return;
+
+	dest.probing = false;
+	boost::system::error_code ec2;
+	dest.socket.close(ec2);
+
+	if (ec) {
+		dest.failures++;
+		LOG(debug) << "tcp-provider-pool [" << utils::to_string(dest.ep)
+		           << "]: Probe failed: failures=" << dest.failures << ": " << ec.message();
+		do_check();
+		return;
+	}
+
+	const auto rtt = std::chrono::duration_cast<std::chrono::microseconds>(
+	    std::chrono::steady_clock::now() - dest.probe_start);
+	dest.srtt = dest.srtt.count() == 0 ? rtt : (7 * dest.srtt + rtt) / 8;
+	dest.failures = 0;
+
+	LOG(trace) << "tcp-provider-pool [" << utils::to_string(dest.ep)
+	           << "]: rtt=" << rtt.count() << "us srtt=" << dest.srtt.count() << "us";
+	do_check();
+}
+
+auto udp2tcp_dest_provider_pool::do_check() -> void {
+
+	if (m_connected == nullptr || !m_migrate_handler)
+		return;
+
+	const auto * best = ranked().front();
+	if (best == m_connected || best->down() || best->srtt.count() == 0)
+		return;
+
+	// Switch only if the difference is significant, so the tunnel
+	// will not flap between destinations with similar RTT.
+	const auto & current = *m_connected;
+	const bool degraded = current.down() ||
+	                      (current.srtt - best->srtt > migrate_rtt_margin &&
+	                       2 * current.srtt > 3 * best->srtt);
+	if (!degraded)
+		return;
+
+	LOG(info) << "tcp-provider-pool: Migrating: " << utils::to_string(current.ep) << " -> "
+	          << utils::to_string(best->ep) << ": failures=" << current.failures
+	          << " srtt=" << current.srtt.count() << "us best-srtt=" << best->srtt.count()
+	          << "us";
+	m_connected = nullptr;
+	m_migrate_handler();
+}
+
 #if ENABLE_NGROK
-auto udp2tcp_dest_provider_ngrok::tcp_dest_ep() -> asio::ip::tcp::endpoint {
+auto udp2tcp_dest_provider_ngrok::stream_endpoints(const ngrok::endpoint & ep)
+    -> std::vector<utils::stream_endpoint> {
+	const auto eps = ep.tcp_endpoints();
+	return std::vector<utils::stream_endpoint>(eps.begin(), eps.end());
+}
+
+auto udp2tcp_dest_provider_ngrok::tcp_dest_eps() -> std::vector<utils::stream_endpoint> {
 	if (!m_endpoint_filter_id.empty()) {
 		LOG(debug) << "tcp-provider-ngrok: id=" << m_endpoint_filter_id;
 		for (const auto & ep : m_client.endpoints())
 			if (ep.id == m_endpoint_filter_id)
-				return { ep.address(), ep.port };
+				return interleave(stream_endpoints(ep));
 		throw std::runtime_error("Endpoint '" + m_endpoint_filter_id + "' not found");
 	}
 	if (!m_endpoint_filter_uri.empty()) {
@@ -319,7 +1065,7 @@ auto udp2tcp_dest_provider_ngrok::tcp_dest_ep() -> asio::ip::tcp::endpoint {
 		auto regex = std::regex(m_endpoint_filter_uri, std::regex::icase);
 		for (const auto & ep : m_client.endpoints())
 			if (std::regex_match(ep.uri(), regex))
-				return { ep.address(), ep.port };
+				return interleave(stream_endpoints(ep));
 		throw std::runtime_error("Endpoint matching '" + m_endpoint_filter_uri + "' not found");
 	}
 	throw std::runtime_error("Endpoint filter not set");
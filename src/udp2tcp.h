@@ -5,17 +5,29 @@
 #pragma once
 
 #include <array>
+#include <chrono>
 #include <cstddef>
+#include <functional>
 #include <memory>
+#include <optional>
 #include <string>
+#include <vector>
 
 #include <boost/asio.hpp>
 #if ENABLE_WEBSOCKET
 #	include <boost/beast/websocket.hpp>
 #endif
 
+#include "handoff.h"
 #include "ngrok.h"
+#include "ping.h"
+#include "queue.h"
+#if ENABLE_TLS
+#	include "tls.h"
+#endif
+#include "tuning.h"
 #include "utils.hpp"
+#include "zerocopy.h"
 
 namespace wg::tunnel {
 
@@ -28,31 +40,126 @@ using std::size_t;
 
 class udp2tcp_dest_provider {
 public:
-	virtual auto tcp_dest_ep() -> asio::ip::tcp::endpoint = 0;
+	virtual ~udp2tcp_dest_provider() = default;
+
+	// Get destination TCP endpoint candidates ordered by preference
+	virtual auto tcp_dest_eps() -> std::vector<utils::stream_endpoint> = 0;
+	// Notify provider about the destination the tunnel got connected to
+	virtual auto tcp_dest_connected(const utils::stream_endpoint &) -> void {}
+
+	// Set handler called when the tunnel shall be migrated to other destination
+	auto tcp_dest_migrate_handler(std::function<void()> handler) -> void {
+		m_migrate_handler = std::move(handler);
+	}
+
+protected:
+	std::function<void()> m_migrate_handler;
+
+	// Interleave address families, so a broken IPv6 or IPv4 path will not
+	// delay connection attempts to the other family (RFC 8305, section 4)
+	static auto interleave(const std::vector<utils::stream_endpoint> & eps)
+	    -> std::vector<utils::stream_endpoint>;
 };
 
 class udp2tcp {
 public:
+	// Delay between consecutive connection attempts (RFC 8305, section 5)
+	static constexpr std::chrono::milliseconds connect_attempt_delay{ 250 };
+
 	udp2tcp(asio::io_context & ioc, asio::ip::udp::endpoint ep_udp_acc,
 	        udp2tcp_dest_provider & ep_tcp_dest_provider)
 	    : m_ep_udp_acc(std::move(ep_udp_acc)), m_socket_udp_acc(ioc, m_ep_udp_acc),
 	      m_socket_tcp_dest(ioc), m_ep_tcp_dest_provider(ep_tcp_dest_provider),
-	      m_app_keep_alive_timer(ioc) {}
+	      m_connect_timer(ioc), m_app_keep_alive_timer(ioc), m_auto_tune_timer(ioc),
+	      m_ping_timer(ioc) {}
+	// Use already bound UDP socket, e.g. inherited from other process
+	udp2tcp(asio::io_context & ioc, asio::ip::udp::socket socket,
+	        udp2tcp_dest_provider & ep_tcp_dest_provider)
+	    : m_ep_udp_acc(socket.local_endpoint()), m_socket_udp_acc(std::move(socket)),
+	      m_socket_tcp_dest(ioc), m_ep_tcp_dest_provider(ep_tcp_dest_provider),
+	      m_connect_timer(ioc), m_app_keep_alive_timer(ioc), m_auto_tune_timer(ioc),
+	      m_ping_timer(ioc) {}
 	~udp2tcp() = default;
 
 	auto run(utils::transport transport) -> void;
 
+	// Pass the UDP socket to the new process, the tunnel keeps running until
+	// the new process confirms that it has taken over
+	auto handoff(class handoff & state) -> void;
+	// Stop the tunnel. The TCP connection is closed, the new process will
+	// establish its own one.
+	auto stop() -> void;
+
 	auto keep_alive_app(int idle_time) -> void { m_app_keep_alive_idle_time = idle_time; }
 	auto keep_alive_tcp(int idle_time) -> void { m_tcp_keep_alive_idle_time = idle_time; }
+	auto aqm_codel(int target, int interval) -> void {
+		m_aqm_codel_target = target;
+		m_aqm_codel_interval = interval;
+	}
+	auto tuning(socket_tuning tuning) -> void { m_socket_tuning = std::move(tuning); }
+	auto auto_tune(bool enabled) -> void { m_auto_tune = enabled; }
+	auto fast_open(bool enabled) -> void { m_fast_open = enabled; }
+	// Write batches of at least the given size with MSG_ZEROCOPY, 0 to disable
+	auto zerocopy_threshold(size_t bytes) -> void { m_zerocopy_threshold = bytes; }
+	auto ping(int interval, int count) -> void {
+		m_ping_interval = interval;
+		m_ping_count = count;
+	}
+
+	// Log statistics of the tunnel connection
+	auto log_stats() -> void;
 #if ENABLE_WEBSOCKET
 	auto ws_headers(utils::http::headers headers) { m_ws_headers = std::move(headers); }
 #endif
+#if ENABLE_TLS
+	// Wrap the raw transport in TLS with the given client context, the server
+	// name is used for SNI and for the certificate verification
+	auto tls(asio::ssl::context ctx, std::string server_name) -> void {
+		m_tls_context.emplace(std::move(ctx));
+		m_tls_server_name = std::move(server_name);
+	}
+#endif
 
 private:
 	auto to_string(bool verbose = false) -> std::string;
 
+	// Call the function with the stream carrying the framed data
+	template <typename F> auto with_stream(F && f) -> void {
+#if ENABLE_TLS
+		if (m_tls) {
+			f(*m_tls);
+			return;
+		}
+#endif
+		f(m_socket_tcp_dest);
+	}
+
 	auto do_connect() -> void;
+	auto do_connect_attempt() -> void;
+	auto do_connect_attempt_handler(const boost::system::error_code & ec, unsigned int race,
+	                                size_t index) -> void;
 	auto do_connect_handler(const boost::system::error_code & ec) -> void;
+#if ENABLE_WEBSOCKET
+	auto do_ws_handshake_handler(const boost::system::error_code & ec) -> void;
+#endif
+#if ENABLE_TLS
+	auto do_tls_handshake_handler(const boost::system::error_code & ec) -> void;
+#endif
+	// Start forwarding packets once the connection is ready
+	auto do_established() -> void;
+	// Close the TCP connection and cancel all pending operations
+	auto do_close() -> void;
+	// Reconnect to the destination preferred by the provider
+	auto do_migrate() -> void;
+
+	auto do_ctrl(utils::ctrl::type type, const void * body, size_t length) -> void;
+	auto do_ctrl_handler(utils::ctrl::type type, const void * body) -> void;
+
+	auto do_ping() -> void;
+	auto do_ping_handler(const boost::system::error_code & ec) -> void;
+
+	auto do_auto_tune() -> void;
+	auto do_auto_tune_handler(const boost::system::error_code & ec) -> void;
 
 	auto do_app_keep_alive_init() -> void;
 	auto do_app_keep_alive(bool init = false) -> void;
@@ -60,6 +167,7 @@ private:
 
 	auto do_send() -> void;
 	auto do_send_buffer() -> void;
+	auto do_send_buffer_handler(const boost::system::error_code & ec, size_t length) -> void;
 	auto do_send_handler(const boost::system::error_code & ec, size_t length) -> void;
 
 	auto do_recv_init() -> void;
@@ -70,14 +178,30 @@ private:
 	auto do_ws_recv() -> void;
 	auto do_ws_recv_handler(const boost::system::error_code & ec, size_t length) -> void;
 #endif
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+	auto do_seqpacket_recv() -> void;
+	auto do_seqpacket_recv_handler(const boost::system::error_code & ec, size_t length) -> void;
+#endif
 
 	asio::ip::udp::endpoint m_ep_udp_acc;
 	asio::ip::udp::endpoint m_ep_udp_sender;
 	asio::ip::udp::socket m_socket_udp_acc;
-	asio::ip::tcp::socket m_socket_tcp_dest;
+	utils::stream_socket m_socket_tcp_dest;
+	bool m_socket_tcp_dest_connected = false;
 	// Provider for obtaining TCP destination endpoint
 	udp2tcp_dest_provider & m_ep_tcp_dest_provider;
-	asio::ip::tcp::endpoint m_ep_tcp_dest_cache;
+	utils::stream_endpoint m_ep_tcp_dest_cache;
+	// Local endpoint of the tunnel connection resolved at the connection setup
+	utils::stream_endpoint m_ep_tcp_src;
+	utils::socket_op_counter m_socket_ops;
+	// Connection attempts racing with each other, the first one which
+	// succeeds becomes the tunnel connection
+	std::vector<utils::stream_endpoint> m_connect_candidates;
+	std::vector<utils::stream_socket> m_connect_sockets;
+	asio::steady_timer m_connect_timer;
+	unsigned int m_connect_race = 0;
+	size_t m_connect_failed = 0;
+	bool m_connecting = false;
 	// Transport protocol used for the TCP connection
 	utils::transport m_transport = utils::transport::raw;
 	// Application keep-alive idle time in seconds, 0 to disable
@@ -85,37 +209,139 @@ private:
 	asio::system_timer m_app_keep_alive_timer;
 	// TCP keep-alive idle time in seconds, 0 to disable
 	int m_tcp_keep_alive_idle_time = 0;
+	// CoDel target and interval in milliseconds, 0 target to disable
+	int m_aqm_codel_target = 0;
+	int m_aqm_codel_interval = 100;
+	// Send the first queued data in the SYN with TCP Fast Open
+	bool m_fast_open = false;
+	// Minimum size of the zero-copy write, 0 to disable
+	size_t m_zerocopy_threshold = 0;
+	// Options applied to every tunnel TCP socket
+	socket_tuning m_socket_tuning;
+	// Buffer sizes auto-tuning based on the TCP_INFO samples
+	bool m_auto_tune = false;
+	asio::steady_timer m_auto_tune_timer;
+	bdp_tuner m_auto_tuner;
+	tcp_info_sample m_tcp_info;
+	// Whether the peer supports extended control frames
+	bool m_ctrl_ext = false;
+	// Type of the control frame which body is being read
+	utils::ctrl::type m_ctrl_type = utils::ctrl::type::none;
+	// Ping interval in milliseconds, 0 to disable, and the number of missed
+	// pongs after which the peer is considered dead
+	int m_ping_interval = 0;
+	int m_ping_count = 3;
+	asio::steady_timer m_ping_timer;
+	ping_tracker m_ping;
+	// Session token issued by the server, used to resume the session after
+	// reconnecting to the same server
+	std::optional<utils::ctrl::session> m_session;
+	utils::stream_endpoint m_session_ep;
 	// Buffers for sending and receiving data
-	std::array<char, 4096> m_buffer_send;
-	size_t m_buffer_send_length;
+	packet m_buffer_send;
 	asio::streambuf m_buffer_recv;
+	// Queue of packets waiting for the TCP write
+	egress_queue m_queue;
+	// Packets being currently written to the TCP socket
+	std::vector<packet> m_queue_batch;
+	std::vector<asio::const_buffer> m_queue_batch_buffers;
+	bool m_queue_writing = false;
+	// Time at which the batch was taken from the queue, for the capture
+	packet::clock::time_point m_queue_dequeued;
+	// Zero-copy writes of the raw transport
+	zerocopy m_zerocopy;
 #if ENABLE_WEBSOCKET
-	ws::stream<asio::ip::tcp::socket &> m_ws{ m_socket_tcp_dest };
+	ws::stream<utils::stream_socket &> m_ws{ m_socket_tcp_dest };
 	beast::flat_buffer m_ws_buffer_recv;
 	// List of WebSocket custom headers used during the handshake
 	utils::http::headers m_ws_headers;
 #endif
+#if ENABLE_TLS
+	// Context of the TLS transport, raw transport is not wrapped if not set
+	std::optional<asio::ssl::context> m_tls_context;
+	std::string m_tls_server_name;
+	std::shared_ptr<tls::stream> m_tls;
+#endif
 };
 
 class udp2tcp_dest_provider_simple : virtual public udp2tcp_dest_provider {
 public:
-	udp2tcp_dest_provider_simple(asio::ip::tcp::endpoint ep) : m_ep(std::move(ep)) {}
-	auto tcp_dest_ep() -> asio::ip::tcp::endpoint override { return m_ep; }
+	// Addresses given by the user are raced in the given order, only addresses
+	// returned by the resolver are interleaved
+	udp2tcp_dest_provider_simple(const std::vector<utils::stream_endpoint> & eps) : m_eps(eps) {}
+	auto tcp_dest_eps() -> std::vector<utils::stream_endpoint> override { return m_eps; }
 
 private:
-	asio::ip::tcp::endpoint m_ep;
+	std::vector<utils::stream_endpoint> m_eps;
+};
+
+// Provider which probes all destinations in the background, prefers the
+// healthy ones with the lowest RTT and requests tunnel migration when the
+// currently used destination degrades
+class udp2tcp_dest_provider_pool : virtual public udp2tcp_dest_provider {
+public:
+	// Number of consecutive failed probes after which destination is down
+	static constexpr unsigned int probe_failures_max = 2;
+	// Minimal RTT difference which justifies the tunnel migration
+	static constexpr std::chrono::milliseconds migrate_rtt_margin{ 10 };
+
+	udp2tcp_dest_provider_pool(asio::io_context & ioc,
+	                           const std::vector<utils::stream_endpoint> & eps,
+	                           std::chrono::seconds interval);
+
+	// Start probing destinations
+	auto run() -> void;
+
+	auto tcp_dest_eps() -> std::vector<utils::stream_endpoint> override;
+	auto tcp_dest_connected(const utils::stream_endpoint & ep) -> void override;
+
+private:
+	struct destination {
+		destination(asio::io_context & ioc, utils::stream_endpoint ep_)
+		    : ep(std::move(ep_)), socket(ioc) {}
+		utils::stream_endpoint ep;
+		utils::stream_socket socket;
+		// Sequence number of the current probe, used to ignore stale results
+		unsigned int probe = 0;
+		bool probing = false;
+		std::chrono::steady_clock::time_point probe_start;
+		// Smoothed connect time, zero if not measured yet
+		std::chrono::microseconds srtt{ 0 };
+		unsigned int failures = 0;
+
+		[[nodiscard]] auto down() const -> bool { return failures >= probe_failures_max; }
+	};
+
+	auto do_probe() -> void;
+	auto do_probe_handler(const boost::system::error_code & ec) -> void;
+	auto do_probe_connect_handler(const boost::system::error_code & ec, destination & dest,
+	                              unsigned int probe) -> void;
+	// Request migration if there is a destination significantly better than
+	// the one the tunnel is connected to
+	auto do_check() -> void;
+
+	// Destinations ordered by preference: healthy first, then by the RTT
+	auto ranked() -> std::vector<destination *>;
+
+	std::vector<std::unique_ptr<destination>> m_destinations;
+	std::chrono::seconds m_interval;
+	asio::steady_timer m_timer;
+	destination * m_connected = nullptr;
 };
 
 #if ENABLE_NGROK
 class udp2tcp_dest_provider_ngrok : virtual public udp2tcp_dest_provider {
 public:
 	udp2tcp_dest_provider_ngrok(wg::ngrok::client & client) : m_client(client) {}
-	auto tcp_dest_ep() -> asio::ip::tcp::endpoint override;
+	auto tcp_dest_eps() -> std::vector<utils::stream_endpoint> override;
 
 	auto filter_id(const std::string_view id) -> void { m_endpoint_filter_id = id; }
 	auto filter_uri(const std::string_view uri) -> void { m_endpoint_filter_uri = uri; }
 
 private:
+	static auto stream_endpoints(const wg::ngrok::endpoint & ep)
+	    -> std::vector<utils::stream_endpoint>;
+
 	wg::ngrok::client & m_client;
 	std::string m_endpoint_filter_id;
 	std::string m_endpoint_filter_uri;
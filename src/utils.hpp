@@ -5,8 +5,12 @@
 #pragma once
 
 #include <array>
+#include <cerrno>
+#include <cstddef>
 #include <cstdint>
+#include <cstring>
 #include <memory>
+#include <ostream>
 #include <stdexcept>
 #include <string>
 #include <vector>
@@ -14,17 +18,37 @@
 #include <boost/asio.hpp>
 #include <boost/crc.hpp>
 
+#if !defined(_WIN32)
+#	include <sys/socket.h>
+#	include <sys/stat.h>
+#	include <unistd.h>
+#endif
+#if defined(__linux__)
+#	include <linux/filter.h>
+#endif
+
 namespace wg::utils {
 
 namespace asio = boost::asio;
+using std::size_t;
 
 enum class transport {
 	raw,
 #if ENABLE_WEBSOCKET
 	websocket,
 #endif
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+	// Unix SOCK_SEQPACKET socket, every message carries exactly one datagram
+	seqpacket,
+#endif
 };
 
+// Stream socket of the tunnel connection: TCP or Unix domain socket
+using stream_protocol = asio::generic::stream_protocol;
+using stream_endpoint = stream_protocol::endpoint;
+using stream_socket = stream_protocol::socket;
+using stream_acceptor = asio::basic_socket_acceptor<stream_protocol>;
+
 namespace ip {
 namespace udp {
 
@@ -55,6 +79,97 @@ static_assert(sizeof(header) == 8, "Invalid UDP header size");
 }; // namespace udp
 }; // namespace ip
 
+// Extended control frames of the raw transport. These frames are sent with
+// the zero length and zero source port in the header, so peers which do not
+// support them will treat them as keep-alive packets. Control frames with a
+// body are sent only after both peers exchanged the hello frame.
+namespace ctrl {
+
+enum class type : uint16_t {
+	none = 0,
+	hello = 0x5701,
+	ping = 0x5702,
+	pong = 0x5703,
+	session = 0x5704,
+	resume = 0x5705,
+};
+
+struct ping {
+	// Timestamp of the ping sender in microseconds, echoed back in the pong
+	uint64_t m_timestamp;
+};
+
+struct session {
+	// Random token assigned to the session by the server, which can be used
+	// by the client to resume the session after reconnecting
+	std::array<uint8_t, 16> m_token;
+};
+
+static inline auto get_type(const ip::udp::header & header) -> type {
+	if (header.m_length != 0 || header.m_src_port != 0)
+		return type::none;
+	switch (static_cast<type>(header.m_dst_port)) {
+	case type::hello:
+	case type::ping:
+	case type::pong:
+	case type::session:
+	case type::resume:
+		return static_cast<type>(header.m_dst_port);
+	default:
+		return type::none;
+	}
+}
+
+static inline auto get_body_size(type t) -> size_t {
+	switch (t) {
+	case type::ping:
+	case type::pong:
+		return sizeof(ping);
+	case type::session:
+	case type::resume:
+		return sizeof(session);
+	default:
+		return 0;
+	}
+}
+
+}; // namespace ctrl
+
+namespace wireguard {
+
+enum class message_type : uint8_t {
+	unknown = 0,
+	handshake_initiation = 1,
+	handshake_response = 2,
+	cookie_reply = 3,
+	transport_data = 4,
+};
+
+// Classify WireGuard datagram based on its message header
+static inline auto get_message_type(const void * data, size_t length) -> message_type {
+	// The message type is followed by three reserved zero bytes
+	auto buffer = static_cast<const uint8_t *>(data);
+	if (length < 4 || buffer[1] != 0 || buffer[2] != 0 || buffer[3] != 0)
+		return message_type::unknown;
+	if (buffer[0] < 1 || buffer[0] > 4)
+		return message_type::unknown;
+	return static_cast<message_type>(buffer[0]);
+}
+
+// Check whether the datagram carries WireGuard handshake or cookie message
+static inline auto is_control_message(const void * data, size_t length) -> bool {
+	switch (get_message_type(data, length)) {
+	case message_type::handshake_initiation:
+	case message_type::handshake_response:
+	case message_type::cookie_reply:
+		return true;
+	default:
+		return false;
+	}
+}
+
+}; // namespace wireguard
+
 namespace http {
 
 using header = std::pair<std::string, std::string>;
@@ -87,10 +202,248 @@ static inline auto to_string(const asio::ip::udp::endpoint & ep) -> std::string
 	return "udp:" + ep.address().to_string() + ":" + std::to_string(ep.port());
 }
 
-static inline auto socket_set_keep_alive_idle(asio::ip::tcp::socket & socket, int time) -> int {
+// Whether the endpoint is a Unix domain socket address
+static inline auto is_local(const stream_endpoint & ep) -> bool {
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+	return ep.protocol().family() == AF_UNIX;
+#else
+	(void)ep;
+	return false;
+#endif
+}
+
+// Get the IP address and port of the endpoint, unspecified for other families
+static inline auto to_tcp(const stream_endpoint & ep) -> asio::ip::tcp::endpoint {
+	asio::ip::tcp::endpoint tcp;
+	const auto family = ep.protocol().family();
+	if ((family == AF_INET || family == AF_INET6) && ep.size() <= tcp.capacity()) {
+		std::memcpy(tcp.data(), ep.data(), ep.size());
+		tcp.resize(ep.size());
+	}
+	return tcp;
+}
+
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+static inline auto to_local(const stream_endpoint & ep) -> asio::local::stream_protocol::endpoint {
+	asio::local::stream_protocol::endpoint local;
+	if (is_local(ep) && ep.size() <= local.capacity()) {
+		std::memcpy(local.data(), ep.data(), ep.size());
+		local.resize(ep.size());
+	}
+	return local;
+}
+#endif
+
+static inline auto to_string(const stream_endpoint & ep) -> std::string {
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+	if (is_local(ep))
+		return "unix:" + to_local(ep).path();
+#endif
+	return to_string(to_tcp(ep));
+}
+
+// Number of socket operations (reads, writes and endpoint queries) started
+// per forwarded datagram, counted in debug builds only, so regressions on the
+// data path can be spotted in the statistics. It is not the syscall count,
+// e.g. an asynchronous read may take several syscalls or none at all.
+class socket_op_counter {
+public:
+	auto add([[maybe_unused]] size_t ops, [[maybe_unused]] size_t packets = 0) -> void {
+#if !defined(NDEBUG)
+		m_ops += ops;
+		m_packets += packets;
+#endif
+	}
+
+	friend auto operator<<(std::ostream & os, const socket_op_counter & c) -> std::ostream & {
+#if !defined(NDEBUG)
+		if (c.m_packets > 0)
+			os << " socket-ops/packet=" << static_cast<double>(c.m_ops) / c.m_packets;
+#else
+		(void)c;
+#endif
+		return os;
+	}
+
+private:
+#if !defined(NDEBUG)
+	size_t m_ops = 0;
+	size_t m_packets = 0;
+#endif
+};
+
+static inline auto socket_set_keep_alive_idle(stream_socket & socket, int time) -> int {
 	boost::system::error_code ec;
 	socket.set_option(asio::detail::socket_option::integer<IPPROTO_TCP, TCP_KEEPIDLE>(time), ec);
 	return ec.value();
 }
 
+static inline auto socket_set_notsent_lowat(stream_socket & socket, int bytes) -> int {
+#if defined(TCP_NOTSENT_LOWAT)
+	boost::system::error_code ec;
+	socket.set_option(asio::detail::socket_option::integer<IPPROTO_TCP, TCP_NOTSENT_LOWAT>(bytes),
+	                  ec);
+	return ec.value();
+#else
+	(void)socket;
+	(void)bytes;
+	return static_cast<int>(boost::system::errc::operation_not_supported);
+#endif
+}
+
+// Enable TCP Fast Open on the listening socket with the given queue length
+static inline auto socket_set_fast_open(stream_acceptor & acceptor, int qlen) -> int {
+#if defined(TCP_FASTOPEN)
+	boost::system::error_code ec;
+	acceptor.set_option(asio::detail::socket_option::integer<IPPROTO_TCP, TCP_FASTOPEN>(qlen), ec);
+	return ec.value();
+#else
+	(void)acceptor;
+	(void)qlen;
+	return static_cast<int>(boost::system::errc::operation_not_supported);
+#endif
+}
+
+// Defer connect() until the first write, so the data can be sent in the SYN
+static inline auto socket_set_fast_open_connect(stream_socket & socket) -> int {
+#if defined(TCP_FASTOPEN_CONNECT)
+	boost::system::error_code ec;
+	socket.set_option(asio::detail::socket_option::integer<IPPROTO_TCP, TCP_FASTOPEN_CONNECT>(1),
+	                  ec);
+	return ec.value();
+#else
+	(void)socket;
+	return static_cast<int>(boost::system::errc::operation_not_supported);
+#endif
+}
+
+// Wake up the acceptor only when the data arrives on the new connection
+static inline auto socket_set_defer_accept(stream_acceptor & acceptor, int time) -> int {
+#if defined(TCP_DEFER_ACCEPT)
+	boost::system::error_code ec;
+	acceptor.set_option(asio::detail::socket_option::integer<IPPROTO_TCP, TCP_DEFER_ACCEPT>(time),
+	                    ec);
+	return ec.value();
+#else
+	(void)acceptor;
+	(void)time;
+	return static_cast<int>(boost::system::errc::operation_not_supported);
+#endif
+}
+
+// Get the CPU which has processed the last packet of the socket, or -1
+static inline auto socket_get_incoming_cpu(stream_socket & socket) -> int {
+#if defined(SO_INCOMING_CPU)
+	asio::detail::socket_option::integer<SOL_SOCKET, SO_INCOMING_CPU> cpu;
+	boost::system::error_code ec;
+	socket.get_option(cpu, ec);
+	return ec ? -1 : cpu.value();
+#else
+	(void)socket;
+	return -1;
+#endif
+}
+
+// Prefer this listening socket of the SO_REUSEPORT group for connections
+// received by the given CPU
+static inline auto socket_set_incoming_cpu(stream_acceptor & acceptor, int cpu) -> int {
+#if defined(SO_INCOMING_CPU)
+	boost::system::error_code ec;
+	acceptor.set_option(asio::detail::socket_option::integer<SOL_SOCKET, SO_INCOMING_CPU>(cpu),
+	                    ec);
+	return ec.value();
+#else
+	(void)acceptor;
+	(void)cpu;
+	return static_cast<int>(boost::system::errc::operation_not_supported);
+#endif
+}
+
+// Attach program to the SO_REUSEPORT group of the listening socket, which
+// selects the N-th socket of the group for connections received by the N-th
+// CPU from the list, other CPUs are spread over sockets by the CPU number
+static inline auto socket_attach_reuseport_cpu(stream_acceptor & acceptor,
+                                               const std::vector<unsigned int> & cpus) -> int {
+#if defined(SO_ATTACH_REUSEPORT_CBPF)
+	if (cpus.empty() || cpus.size() > (BPF_MAXINSNS - 3) / 2)
+		return EINVAL;
+	std::vector<sock_filter> code;
+	// Offset of the ancillary data is negative by definition
+	constexpr auto cpu_offset = static_cast<unsigned int>(SKF_AD_OFF + SKF_AD_CPU);
+	code.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS, cpu_offset));
+	for (unsigned int i = 0; i < cpus.size(); i++) {
+		code.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, cpus[i], 0, 1));
+		code.push_back(BPF_STMT(BPF_RET | BPF_K, i));
+	}
+	code.push_back(BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, static_cast<unsigned int>(cpus.size())));
+	code.push_back(BPF_STMT(BPF_RET | BPF_A, 0));
+	const sock_fprog prog = { static_cast<unsigned short>(code.size()), code.data() };
+	if (::setsockopt(acceptor.native_handle(), SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog,
+	                 sizeof(prog)) == -1)
+		return errno;
+	return 0;
+#else
+	(void)acceptor;
+	(void)cpus;
+	return static_cast<int>(boost::system::errc::operation_not_supported);
+#endif
+}
+
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+// Open the socket of the given type, e.g. SOCK_SEQPACKET, because the generic
+// stream protocol opens SOCK_STREAM sockets only. Message boundaries of such
+// socket are kept by the kernel, so every receive returns a single message.
+template <typename Socket>
+static inline auto socket_open(Socket & socket, const stream_protocol & protocol, int type,
+                               boost::system::error_code & ec) -> void {
+	const int fd = ::socket(protocol.family(), type | SOCK_CLOEXEC, protocol.protocol());
+	if (fd == -1) {
+		ec.assign(errno, boost::system::system_category());
+		return;
+	}
+	socket.assign(protocol, fd, ec);
+	if (ec)
+		::close(fd);
+}
+#endif
+
+// Create listening socket of the given type bound to the endpoint, a stale
+// Unix socket file, e.g. left by a crashed process, is removed first. With
+// reuse_port, the socket joins the SO_REUSEPORT group of the endpoint.
+static inline auto socket_listen(asio::io_context & ioc, const stream_endpoint & ep,
+                                 int type = SOCK_STREAM, bool reuse_port = false)
+    -> stream_acceptor {
+	stream_acceptor acceptor(ioc);
+	boost::system::error_code ec;
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+	socket_open(acceptor, ep.protocol(), type, ec);
+	if (!ec && is_local(ep)) {
+		const auto path = to_local(ep).path();
+		struct stat st = {};
+		if (::stat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+			::unlink(path.c_str());
+	}
+#else
+	(void)type;
+	acceptor.open(ep.protocol(), ec);
+#endif
+	if (!ec && !is_local(ep))
+		acceptor.set_option(asio::socket_base::reuse_address(true), ec);
+	if (!ec && reuse_port) {
+#if defined(SO_REUSEPORT)
+		acceptor.set_option(asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true),
+		                    ec);
+#else
+		ec = asio::error::operation_not_supported;
+#endif
+	}
+	if (!ec)
+		acceptor.bind(ep, ec);
+	if (!ec)
+		acceptor.listen(asio::socket_base::max_listen_connections, ec);
+	if (ec)
+		throw boost::system::system_error(ec, "listen " + to_string(ep));
+	return acceptor;
+}
+
 } // namespace wg::utils
@@ -0,0 +1,209 @@
+// wg-tcp-tunnel - zerocopy.cpp
+// SPDX-FileCopyrightText: 2023-2025 Arkadiusz Bokowy and contributors
+// SPDX-License-Identifier: MIT
+
+#include "zerocopy.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <utility>
+
+#if !defined(_WIN32)
+#	include <fcntl.h>
+#	include <unistd.h>
+#	include <netinet/in.h>
+#	include <sys/socket.h>
+#endif
+#if defined(__linux__)
+#	include <linux/errqueue.h>
+#endif
+
+#include <boost/asio.hpp>
+
+namespace wg::tunnel {
+
+namespace {
+
+// Packets of the closed connection waiting for the completions
+struct retired {
+	explicit retired(const utils::stream_socket::executor_type & ex) : socket(ex), timer(ex) {}
+	utils::stream_socket socket;
+	asio::steady_timer timer;
+	zerocopy zc;
+};
+
+// Time after which the retired connection is aborted, so the kernel drops
+// the data which was not sent, e.g. to the peer advertising zero window
+constexpr std::chrono::seconds retire_timeout{ 60 };
+
+}; // namespace
+
+auto zerocopy::enable(utils::stream_socket & socket, size_t threshold) -> int {
+	reset();
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+	boost::system::error_code ec;
+	socket.set_option(asio::detail::socket_option::boolean<SOL_SOCKET, SO_ZEROCOPY>(true), ec);
+	if (ec)
+		return ec.value();
+	// The kernel numbers sends from zero for every socket
+	m_sends = 0;
+	m_threshold = threshold;
+	return 0;
+#else
+	(void)socket;
+	(void)threshold;
+	return ENOTSUP;
+#endif
+}
+
+auto zerocopy::retire(utils::stream_socket & socket) -> void {
+#if defined(SO_EE_ORIGIN_ZEROCOPY)
+	if (!m_pending.empty() && socket.is_open())
+		do_complete(socket);
+	if (m_pending.empty() || !socket.is_open())
+		return reset();
+
+	boost::system::error_code ec;
+	const auto ep = socket.local_endpoint(ec);
+	const auto fd = ec ? -1 : ::fcntl(socket.native_handle(), F_DUPFD_CLOEXEC, 0);
+	if (fd == -1)
+		return reset();
+	auto r = std::make_shared<retired>(socket.get_executor());
+	if (r->socket.assign(ep.protocol(), fd, ec); ec) {
+		::close(fd);
+		return reset();
+	}
+
+	// The duplicate keeps the connection open after the caller closes it
+	r->socket.shutdown(asio::socket_base::shutdown_both, ec);
+	r->zc.m_sends = m_sends;
+	r->zc.m_pending = std::move(m_pending);
+	r->zc.m_budget = m_budget;
+	r->zc.on_drained([p = r.get()]() {
+		boost::system::error_code ec2;
+		p->socket.close(ec2);
+		p->timer.cancel();
+	});
+	r->timer.expires_after(retire_timeout);
+	r->timer.async_wait([w = std::weak_ptr<retired>(r)](const auto & ec2) {
+		auto p = w.lock();
+		if (ec2 || !p)
+			return;
+		// Disconnect aborts the connection and drops all its buffers
+		sockaddr addr = {};
+		addr.sa_family = AF_UNSPEC;
+		::connect(p->socket.native_handle(), &addr, sizeof(addr));
+		p->zc.do_complete(p->socket);
+	});
+	r->zc.async_wait(r->socket, r);
+	m_pending.clear();
+#else
+	(void)socket;
+#endif
+	reset();
+}
+
+auto zerocopy::reset() -> void {
+	for (auto & p : m_pending)
+		for (auto & pkt : p.packets) {
+			if (p.done) {
+				do_release(std::move(pkt));
+				continue;
+			}
+			// The kernel may still send from the buffer, so it is leaked
+			// rather than reused by the next write
+			if (m_budget)
+				m_budget->release(pkt.buffer.size());
+			static_cast<void>(new std::vector<char>(std::move(pkt.buffer)));
+		}
+	m_pending.clear();
+	m_holding = false;
+	m_threshold = 0;
+}
+
+auto zerocopy::release(std::vector<packet> & batch) -> void {
+	for (auto & pkt : batch)
+		if (m_holding) {
+			if (m_budget)
+				m_budget->add(pkt.buffer.size());
+			m_pending.back().packets.push_back(std::move(pkt));
+		} else {
+			egress_queue::release(std::move(pkt));
+		}
+	batch.clear();
+	m_holding = false;
+}
+
+auto zerocopy::do_release(packet && pkt) -> void {
+	if (m_budget)
+		m_budget->release(pkt.buffer.size());
+	egress_queue::release(std::move(pkt));
+}
+
+auto zerocopy::do_consume(size_t length) -> bool {
+	auto it = m_write.begin();
+	for (; it != m_write.end() && length >= it->size(); ++it)
+		length -= it->size();
+	m_write.erase(m_write.begin(), it);
+	if (!m_write.empty())
+		m_write.front() += length;
+	return !m_write.empty();
+}
+
+auto zerocopy::do_written() -> void {
+	m_holding = m_write_sends > 0;
+	if (!m_holding)
+		return;
+	m_sends += m_write_sends;
+	m_sent += m_write_sends;
+	// All sends of the write are acknowledged in order, so it is enough to
+	// track the last one
+	m_pending.push_back({ m_sends - 1, false, {} });
+}
+
+auto zerocopy::do_complete(utils::stream_socket & socket) -> void {
+#if defined(SO_EE_ORIGIN_ZEROCOPY)
+	for (;;) {
+		char control[CMSG_SPACE(sizeof(sock_extended_err) + sizeof(sockaddr_in6))];
+		msghdr msg = {};
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (::recvmsg(socket.native_handle(), &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
+			break;
+		for (auto cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) &&
+			    !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))
+				continue;
+			sock_extended_err ee;
+			std::memcpy(&ee, CMSG_DATA(cmsg), sizeof(ee));
+			if (ee.ee_errno != 0 || ee.ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+			// The kernel could not send data from our buffers, e.g. over the
+			// loopback or a device without the scatter-gather support
+			if (ee.ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				m_copied += ee.ee_data - ee.ee_info + 1;
+			do_complete(ee.ee_info, ee.ee_data);
+		}
+	}
+#else
+	(void)socket;
+#endif
+}
+
+auto zerocopy::do_complete(uint32_t lo, uint32_t hi) -> void {
+	// Numbers wrap around, so compare the distance from the range start
+	for (auto & p : m_pending)
+		if (p.id - lo <= hi - lo)
+			p.done = true;
+	while (!m_pending.empty() && m_pending.front().done) {
+		for (auto & pkt : m_pending.front().packets)
+			do_release(std::move(pkt));
+		m_pending.pop_front();
+	}
+	if (m_pending.empty() && m_drained)
+		std::exchange(m_drained, nullptr)();
+}
+
+}; // namespace wg::tunnel
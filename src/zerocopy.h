@@ -0,0 +1,178 @@
+// wg-tcp-tunnel - zerocopy.h
+// SPDX-FileCopyrightText: 2023-2025 Arkadiusz Bokowy and contributors
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <ostream>
+#include <utility>
+#include <vector>
+
+#if !defined(_WIN32)
+#	include <sys/socket.h>
+#endif
+
+#include <boost/asio.hpp>
+
+#include "queue.h"
+#include "utils.hpp"
+
+namespace wg::tunnel {
+
+namespace asio = boost::asio;
+using std::size_t;
+
+// Zero-copy transmission on the TCP socket with MSG_ZEROCOPY. The kernel
+// sends data straight from the packet buffers, so the buffers of a write are
+// held until the kernel reports the completion on the socket error queue,
+// and only then they are returned to the packet pool, also when the socket
+// is closed in the meantime. On systems without MSG_ZEROCOPY enabling fails,
+// so all writes are copied.
+class zerocopy {
+public:
+	// Maximum number of writes waiting for the completion, when reached
+	// further writes are copied until the kernel catches up
+	static constexpr size_t pending_max = 256;
+
+	zerocopy() = default;
+	zerocopy(const zerocopy &) = delete;
+	auto operator=(const zerocopy &) -> zerocopy & = delete;
+	~zerocopy() { reset(); }
+
+	// Enable zero-copy for writes of at least the given number of bytes,
+	// return errno if not supported by the socket
+	auto enable(utils::stream_socket & socket, size_t threshold) -> int;
+	[[nodiscard]] auto enabled() const -> bool { return m_threshold != 0; }
+	// Copy all further writes, e.g. before the socket is passed to another
+	// process, which shall not receive our completion notifications
+	auto stop() -> void { m_threshold = 0; }
+	// Account held packets in the budget shared with the egress queues
+	auto budget(std::shared_ptr<memory_budget> budget) -> void { m_budget = std::move(budget); }
+	// Whether the kernel has completed all sends
+	[[nodiscard]] auto idle() const -> bool { return m_pending.empty(); }
+	// Call the handler once the kernel has completed all sends
+	auto on_drained(std::function<void()> handler) -> void { m_drained = std::move(handler); }
+	// Whether the write of the given number of bytes shall be zero-copy
+	[[nodiscard]] auto eligible(size_t bytes) const -> bool {
+		return m_threshold != 0 && bytes >= m_threshold && m_pending.size() < pending_max;
+	}
+
+	// Write all buffers with MSG_ZEROCOPY. If the kernel runs out of memory
+	// for the notifications, the rest of data is written with a copy.
+	template <typename Handler>
+	auto async_write(utils::stream_socket & socket,
+	                 const std::vector<asio::const_buffer> & buffers, Handler && handler)
+	    -> void {
+		m_write.assign(buffers.begin(), buffers.end());
+		m_write_length = 0;
+		m_write_sends = 0;
+		m_write_flags = send_flags;
+		do_write(socket, std::forward<Handler>(handler));
+	}
+
+	// Release packets of the last write, packets written with zero-copy are
+	// held until the kernel releases them
+	auto release(std::vector<packet> & batch) -> void;
+	// Wait for the completion notifications while packets are held, the guard
+	// keeps the owner of the socket alive, e.g. a shared pointer
+	template <typename Guard> auto async_wait(utils::stream_socket & socket, Guard guard) -> void {
+		if (m_waiting || m_pending.empty())
+			return;
+		m_waiting = true;
+		socket.async_wait(asio::socket_base::wait_error,
+		                  [this, &socket, guard = std::move(guard)](const auto &) mutable {
+			                  m_waiting = false;
+			                  // The socket might have been reopened in the meantime
+			                  if (socket.is_open())
+				                  async_wait(socket, std::move(guard));
+		                  });
+		// Notifications which arrived before the wait was armed are not
+		// reported by the edge-triggered reactor
+		do_complete(socket);
+	}
+	// Hold packets of sends which were not completed until the kernel
+	// completes them, must be called before the socket is closed. The
+	// completions are read from the duplicate of the socket, so the
+	// connection is shut down instead of being closed by the caller.
+	auto retire(utils::stream_socket & socket) -> void;
+	// Disable zero-copy and return held packets to the pool. Packets of sends
+	// which were not completed (the socket was not retired) are never reused.
+	auto reset() -> void;
+
+	friend auto operator<<(std::ostream & os, const zerocopy & z) -> std::ostream & {
+		if (z.enabled())
+			os << " zerocopy=" << z.m_sent << " zerocopy-copied=" << z.m_copied;
+		return os;
+	}
+
+private:
+#if defined(MSG_ZEROCOPY)
+	static constexpr int send_flags = MSG_ZEROCOPY;
+#else
+	static constexpr int send_flags = 0;
+#endif
+
+	// Packets of the write which ended with the send of the given number
+	struct pending {
+		uint32_t id;
+		bool done;
+		std::vector<packet> packets;
+	};
+
+	template <typename Handler> auto do_write(utils::stream_socket & socket, Handler && handler)
+	    -> void {
+		socket.async_send(
+		    m_write, m_write_flags,
+		    [this, &socket, handler = std::forward<Handler>(handler)](const auto & ec,
+		                                                              size_t length) mutable {
+			    if (ec == asio::error::no_buffer_space && m_write_flags != 0) {
+				    m_write_flags = 0;
+				    do_write(socket, std::move(handler));
+				    return;
+			    }
+			    if (!ec && m_write_flags != 0)
+				    m_write_sends++;
+			    m_write_length += length;
+			    if (!ec && do_consume(length)) {
+				    do_write(socket, std::move(handler));
+				    return;
+			    }
+			    do_written();
+			    handler(ec, m_write_length);
+		    });
+	}
+	// Skip written bytes, return true if there is data left
+	auto do_consume(size_t length) -> bool;
+	// Start holding packets of the completed write
+	auto do_written() -> void;
+	// Read the completion notifications from the socket error queue
+	auto do_complete(utils::stream_socket & socket) -> void;
+	auto do_complete(uint32_t lo, uint32_t hi) -> void;
+	// Return the packet of the completed send to the pool
+	auto do_release(packet && pkt) -> void;
+
+	size_t m_threshold = 0;
+	// Write in progress
+	std::vector<asio::const_buffer> m_write;
+	size_t m_write_length = 0;
+	uint32_t m_write_sends = 0;
+	int m_write_flags = 0;
+	// Number of zero-copy sends issued on the socket, every send is assigned
+	// a consecutive number by the kernel, starting from zero
+	uint32_t m_sends = 0;
+	std::deque<pending> m_pending;
+	bool m_holding = false;
+	bool m_waiting = false;
+	std::shared_ptr<memory_budget> m_budget;
+	std::function<void()> m_drained;
+	// Statistics: zero-copy sends and sends which the kernel had to copy
+	size_t m_sent = 0;
+	size_t m_copied = 0;
+};
+
+}; // namespace wg::tunnel